@@ -0,0 +1,441 @@
+#ifndef BLink_hpp
+#define BLink_hpp
+
+#include <atomic>
+#include <type_traits>
+
+#include "Concurrent.hpp"
+
+using namespace std;
+
+/*
+ * Nodes of the B-link tree (Lehman and Yao).
+ * Every node links to its right sibling on the same level and knows its high
+ * key, the upper bound (exclusive) of the keys in its subtree. The rightmost
+ * node of a level has no high key. A split fills the right half, links it
+ * from the left half and lowers the high key of the left half in one step
+ * under the lock of the left half only. Until the parent gets the new
+ * seperator, the right half is reached by moving right from the left half:
+ * a search that finds its key not less than the high key of a node follows
+ * the right link instead of going down.
+ */
+template <typename Key>
+struct BLinkNode {
+    OptLock lock;
+    NodeType type;
+    int size;  // # of seperators in internal nodes or values in leaves
+    int level; // 0 for leaves, the parent of a node is one level up
+    bool has_high_key;
+    Key high_key;
+    BLinkNode* right_sibling;
+
+    // whether key belongs to a node to the right of this one
+    template <typename Compare>
+    bool beyond(const Key& key, const Compare& comp) {
+        return has_high_key && !comp(key, high_key);
+    }
+
+    static void* operator new(size_t size) {
+        void* p = NULL;
+        if (posix_memalign(&p, CACHE_LINE_SIZE, size) != 0) throw bad_alloc();
+        return p;
+    }
+    static void operator delete(void* p) {
+        free(p);
+    }
+};
+
+template <typename Key, typename Value, int Order>
+struct BLinkLeaf : BLinkNode<Key> {
+    // at most Order-1 key-value pairs, like the leaves of the sequential tree
+    Key keys[Order - 1];
+    Value values[Order - 1];
+
+    BLinkLeaf() {
+        this->type = LEAF;
+        this->size = 0;
+        this->level = 0;
+        this->has_high_key = false;
+        this->right_sibling = NULL;
+    }
+
+    bool isFull() {
+        return this->size >= Order - 1;
+    }
+
+    // a size read without the lock may be torn, keep the search in the arrays
+    int stable_size() {
+        return this->size < Order - 1 ? this->size : Order - 1;
+    }
+
+    // move the upper half into a new leaf linked to the right of this one,
+    // its smallest key becomes the high key of this leaf
+    BLinkLeaf* split() {
+        BLinkLeaf* right_half = new BLinkLeaf();
+        int half = this->size / 2;
+        for (int i = half, j = 0; i < this->size; ++i, ++j) {
+            right_half->keys[j]   = keys[i];
+            right_half->values[j] = values[i];
+        }
+        right_half->size = this->size - half;
+        right_half->has_high_key  = this->has_high_key;
+        right_half->high_key      = this->high_key;
+        right_half->right_sibling = this->right_sibling;
+        this->size = half;
+        this->has_high_key  = true;
+        this->high_key      = right_half->keys[0];
+        this->right_sibling = right_half;
+        return right_half;
+    }
+};
+
+template <typename Key, int Order>
+struct BLinkInternalNode : BLinkNode<Key> {
+    // at most Order-1 seperators and Order references, the last one is the dummy
+    Key keys[Order - 1];
+    BLinkNode<Key>* children[Order];
+
+    BLinkInternalNode() {
+        this->type = INTERNAL;
+        this->size = 0;
+        this->has_high_key = false;
+        this->right_sibling = NULL;
+    }
+
+    bool isFull() {
+        return this->size >= Order - 1;
+    }
+
+    int stable_size() {
+        return this->size < Order - 1 ? this->size : Order - 1;
+    }
+
+    // Move the upper half into a new node linked to the right of this one.
+    // The median seperator becomes the high key of this node, its reference
+    // the dummy one.
+    BLinkInternalNode* split() {
+        BLinkInternalNode* right_half = new BLinkInternalNode();
+        int mid = this->size / 2;
+        for (int i = mid + 1, j = 0; i <= this->size; ++i, ++j) {
+            if (i < this->size) right_half->keys[j] = keys[i];
+            right_half->children[j] = children[i];
+        }
+        right_half->size  = this->size - mid - 1;
+        right_half->level = this->level;
+        right_half->has_high_key  = this->has_high_key;
+        right_half->high_key      = this->high_key;
+        right_half->right_sibling = this->right_sibling;
+        this->size = mid;
+        this->has_high_key  = true;
+        this->high_key      = keys[mid];
+        this->right_sibling = right_half;
+        return right_half;
+    }
+
+    // the reference at i was split, the upper half right_half goes after it
+    void insert(int i, const Key& sep, BLinkNode<Key>* right_half) {
+        for (int j = this->size; j > i; --j) {
+            keys[j] = keys[j-1];
+            children[j+1] = children[j];
+        }
+        keys[i] = sep;
+        children[i+1] = right_half;
+        this->size++;
+    }
+};
+
+/*
+ * Concurrent B-link Tree class
+ * Key, Value: trivially copyable, readers copy them optimistically as in ConBPlusTree
+ * Order:      branching factor, as in SeqBPlusTree
+ * Compare:    strict weak ordering of keys
+ *
+ * Differences to ConBPlusTree:
+ * - A reader only validates the node it's on. It never restarts from the root:
+ *   if the node changed it reads it again, if the node got split it moves right.
+ * - A split holds a single lock at a time. The half node is published with its
+ *   high key first, then the seperator goes into the parent (moving right on
+ *   the parent level if the parent was split meanwhile), splitting the parent
+ *   the same way if it is full, up to a new root.
+ * Like ConBPlusTree, remove() doesn't merge and no node is freed before the
+ * tree is destroyed.
+ */
+template <typename Key, typename Value, int Order = ORDER, typename Compare = less<Key> >
+class BLinkBPlusTree {
+private:
+    typedef BLinkNode<Key> Node;
+    typedef BLinkLeaf<Key, Value, Order> Leaf;
+    typedef BLinkInternalNode<Key, Order> InternalNode;
+
+    static_assert(Order >= 4, "a split needs at least two entries per half node");
+    static_assert(is_trivially_copyable<Key>::value && is_trivially_copyable<Value>::value,
+                  "optimistic readers may copy a key or value while it's being written");
+
+    // the internal nodes a writer passed on the way down, by level
+    struct Path {
+        InternalNode* nodes[MAX_TREE_DEPTH];
+        int depth; // nodes[1..depth] are set
+    };
+
+    atomic<Node*> root;
+    // held while a new root is added
+    OptLock root_lock;
+    Compare comp;
+
+public:
+    BLinkBPlusTree(const Compare& comp = Compare());
+    ~BLinkBPlusTree();
+    BLinkBPlusTree(const BLinkBPlusTree&) = delete;
+    BLinkBPlusTree& operator=(const BLinkBPlusTree&) = delete;
+
+    // search for the value relative to the given key, return not_found if not exists
+    Value search(const Key& key, const Value& not_found = Value(-1));
+    // return true: successfully insert a new key-value pair
+    // return false: key already exists, replace the previous with the new value
+    bool insert(const Key& key, const Value& value);
+    // return true if the key-value pair is successfully removed
+    // otherwise return false if the key doesn't exist
+    bool remove(const Key& key);
+
+// private helper functions
+private:
+    int leaf_lower_bound(Leaf* leaf, const Key& key) {
+        return node_lower_bound<sizeof(Key)>(leaf->keys, leaf->stable_size(), key, comp);
+    }
+    int child_index(InternalNode* node, const Key& key) {
+        return node_upper_bound<sizeof(Key)>(node->keys, node->stable_size(), key, comp);
+    }
+    // One optimistic step from the node: the right sibling if key is beyond the
+    // high key, otherwise the child for key. Reads the node again until it gets
+    // a consistent picture of it.
+    Node* next_node(Node* curr_node, const Key& key, bool& moved_right);
+    // Descend to the node at the given level where key belongs, without locks.
+    // path records the internal node left on every level if given.
+    Node* descend(const Key& key, int level, Path* path);
+    // write lock the node on its level where key belongs, starting at curr_node
+    // and moving right with one lock at a time
+    Node* lock_covering(Node* curr_node, const Key& key);
+    // Insert the seperator of a split node into its parent level, splitting
+    // further up as needed. path holds the parents seen on the way down.
+    void insert_into_parent(Node* left_half, const Key& sep, Node* right_half, Path& path);
+    // free every node, only when no other thread uses the tree
+    void destroy_nodes();
+};
+
+template <typename Key, typename Value, int Order, typename Compare>
+BLinkBPlusTree<Key, Value, Order, Compare>::BLinkBPlusTree(const Compare& comp) : comp(comp) {
+    root.store(new Leaf());
+}
+
+template <typename Key, typename Value, int Order, typename Compare>
+BLinkBPlusTree<Key, Value, Order, Compare>::~BLinkBPlusTree() {
+    destroy_nodes();
+}
+
+template <typename Key, typename Value, int Order, typename Compare>
+Value BLinkBPlusTree<Key, Value, Order, Compare>::search(const Key& key, const Value& not_found) {
+    Leaf* leaf = (Leaf*) descend(key, 0, NULL);
+    while (true) {
+        bool need_restart = false;
+        uint64_t version = leaf->lock.read_lock_or_restart(need_restart);
+        Leaf* right = (Leaf*) leaf->right_sibling;
+        bool beyond = leaf->beyond(key, comp);
+        int i = leaf_lower_bound(leaf, key);
+        bool found = i < leaf->stable_size() && !comp(key, leaf->keys[i]);
+        Value result = found ? leaf->values[i] : not_found;
+        leaf->lock.read_unlock_or_restart(version, need_restart);
+        if (need_restart) continue;
+        if (beyond) {
+            leaf = right;
+            continue;
+        }
+        return result;
+    }
+}
+
+template <typename Key, typename Value, int Order, typename Compare>
+bool BLinkBPlusTree<Key, Value, Order, Compare>::insert(const Key& key, const Value& value) {
+    Path path;
+    Leaf* leaf = (Leaf*) lock_covering(descend(key, 0, &path), key);
+
+    int i = leaf_lower_bound(leaf, key);
+    if (i < leaf->size && !comp(key, leaf->keys[i])) {
+        leaf->values[i] = value;
+        leaf->lock.write_unlock();
+        return false;
+    }
+    if (!leaf->isFull()) {
+        for (int j = leaf->size; j > i; --j) {
+            leaf->keys[j]   = leaf->keys[j-1];
+            leaf->values[j] = leaf->values[j-1];
+        }
+        leaf->keys[i]   = key;
+        leaf->values[i] = value;
+        leaf->size++;
+        leaf->lock.write_unlock();
+        return true;
+    }
+
+    // split first, then the key goes into the half it belongs to, which is
+    // still only reachable through this leaf
+    Leaf* right_half = leaf->split();
+    Leaf* target = comp(key, leaf->high_key) ? leaf : right_half;
+    i = leaf_lower_bound(target, key);
+    for (int j = target->size; j > i; --j) {
+        target->keys[j]   = target->keys[j-1];
+        target->values[j] = target->values[j-1];
+    }
+    target->keys[i]   = key;
+    target->values[i] = value;
+    target->size++;
+    Key sep = leaf->high_key;
+    leaf->lock.write_unlock();
+
+    insert_into_parent(leaf, sep, right_half, path);
+    return true;
+}
+
+template <typename Key, typename Value, int Order, typename Compare>
+bool BLinkBPlusTree<Key, Value, Order, Compare>::remove(const Key& key) {
+    Leaf* leaf = (Leaf*) lock_covering(descend(key, 0, NULL), key);
+    int i = leaf_lower_bound(leaf, key);
+    bool exists = i < leaf->size && !comp(key, leaf->keys[i]);
+    if (exists) {
+        // move the successive key-value forward
+        for (int j = i; j < leaf->size - 1; ++j) {
+            leaf->keys[j]   = leaf->keys[j+1];
+            leaf->values[j] = leaf->values[j+1];
+        }
+        leaf->size--;
+    }
+    leaf->lock.write_unlock();
+    return exists;
+}
+
+/*
+ * Private helper functions
+ */
+template <typename Key, typename Value, int Order, typename Compare>
+typename BLinkBPlusTree<Key, Value, Order, Compare>::Node*
+BLinkBPlusTree<Key, Value, Order, Compare>::next_node(Node* curr_node, const Key& key, bool& moved_right) {
+    while (true) {
+        bool need_restart = false;
+        uint64_t version = curr_node->lock.read_lock_or_restart(need_restart);
+        Node* next;
+        moved_right = curr_node->beyond(key, comp);
+        if (moved_right) {
+            next = curr_node->right_sibling;
+        } else {
+            InternalNode* curr_internal = (InternalNode*) curr_node;
+            next = curr_internal->children[child_index(curr_internal, key)];
+        }
+        curr_node->lock.read_unlock_or_restart(version, need_restart);
+        if (!need_restart) return next;
+    }
+}
+
+// A node never changes its level, so stopping at a level is safe even while
+// the tree grows above it.
+template <typename Key, typename Value, int Order, typename Compare>
+typename BLinkBPlusTree<Key, Value, Order, Compare>::Node*
+BLinkBPlusTree<Key, Value, Order, Compare>::descend(const Key& key, int level, Path* path) {
+    Node* curr_node = root.load();
+    if (path) path->depth = curr_node->level;
+    while (curr_node->level > level) {
+        bool moved_right;
+        Node* next = next_node(curr_node, key, moved_right);
+        if (path && !moved_right) {
+            path->nodes[curr_node->level] = (InternalNode*) curr_node;
+        }
+        curr_node = next;
+    }
+    return curr_node;
+}
+
+template <typename Key, typename Value, int Order, typename Compare>
+typename BLinkBPlusTree<Key, Value, Order, Compare>::Node*
+BLinkBPlusTree<Key, Value, Order, Compare>::lock_covering(Node* curr_node, const Key& key) {
+    while (true) {
+        bool need_restart = false;
+        curr_node->lock.write_lock_or_restart(need_restart);
+        if (need_restart) continue;
+        if (!curr_node->beyond(key, comp)) return curr_node;
+        Node* right = curr_node->right_sibling;
+        curr_node->lock.write_unlock();
+        curr_node = right;
+    }
+}
+
+template <typename Key, typename Value, int Order, typename Compare>
+void BLinkBPlusTree<Key, Value, Order, Compare>::insert_into_parent(Node* left_half, const Key& sep, Node* right_half, Path& path) {
+    int level = left_half->level + 1;
+    Node* start;
+    if (level <= path.depth) {
+        start = path.nodes[level];
+    } else {
+        // left_half was the root when we passed, add a root above it unless
+        // another split got there first
+        bool need_restart = true;
+        while (need_restart) {
+            need_restart = false;
+            root_lock.write_lock_or_restart(need_restart);
+        }
+        if (root.load() == left_half) {
+            InternalNode* new_root = new InternalNode();
+            new_root->level = level;
+            new_root->keys[0] = sep;
+            new_root->children[0] = left_half;
+            new_root->children[1] = right_half;
+            new_root->size = 1;
+            root.store(new_root);
+            root_lock.write_unlock();
+            return;
+        }
+        root_lock.write_unlock();
+        // the split of the old root may not have added the new root yet
+        while (root.load()->level < level) {
+            this_thread::yield();
+        }
+        start = descend(sep, level, NULL);
+    }
+
+    InternalNode* parent = (InternalNode*) lock_covering(start, sep);
+    if (!parent->isFull()) {
+        parent->insert(child_index(parent, sep), sep, right_half);
+        parent->lock.write_unlock();
+        return;
+    }
+    InternalNode* parent_right = parent->split();
+    InternalNode* target = comp(sep, parent->high_key) ? parent : parent_right;
+    target->insert(child_index(target, sep), sep, right_half);
+    Key parent_sep = parent->high_key;
+    parent->lock.write_unlock();
+
+    insert_into_parent(parent, parent_sep, parent_right, path);
+}
+
+// walk the levels top-down: the first node of the next level is the first
+// child of the first node of this level, the rest follow the right links
+template <typename Key, typename Value, int Order, typename Compare>
+void BLinkBPlusTree<Key, Value, Order, Compare>::destroy_nodes() {
+    Node* level = root.load();
+    while (level != NULL) {
+        Node* next_level = NULL;
+        if (INTERNAL == level->type) {
+            next_level = ((InternalNode*)level)->children[0];
+        }
+        Node* curr_node = level;
+        while (curr_node != NULL) {
+            Node* right = curr_node->right_sibling;
+            if (LEAF == curr_node->type) {
+                delete (Leaf*) curr_node;
+            } else {
+                delete (InternalNode*) curr_node;
+            }
+            curr_node = right;
+        }
+        level = next_level;
+    }
+}
+
+#endif /* BLink_hpp */
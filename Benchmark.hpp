@@ -0,0 +1,496 @@
+#ifndef Benchmark_hpp
+#define Benchmark_hpp
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <map>
+#include <random>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "Sequential.hpp"
+
+using namespace std;
+
+/*
+ * Benchmark suite: SeqBPlusTree of several orders against std::map and a
+ * sorted vector, on micro workloads and the YCSB core workloads.
+ *
+ * A benchmark runs one workload on one structure holding n keys, and prints
+ * one line named like BM_<workload>/<structure>/<n> with
+ * - the throughput in M operations/s, from the time of the whole run
+ * - the p50, p99 and p99.9 latency, from timing every BENCH_LATENCY_EVERY-th
+ *   operation on its own, so reading the clock hardly slows the run down
+ *   (each latency still includes one clock read, some 20 ns)
+ * The keys and operations are generated before the clock starts.
+ *
+ * Keys and values are int64_t. Item i of the data set has the key
+ * bench_key(i), a bijective hash of i, so the keys are spread over the whole
+ * key space and the popular items of a skewed distribution aren't neighbours
+ * (as in YCSB). Only insert/sequential uses i itself.
+ *
+ * Workloads, for each n:
+ * - insert/random, insert/sequential: n inserts into an empty structure,
+ *   repeated on a new one until there were BenchmarkOptions::operations
+ * - lookup/uniform, lookup/zipfian: lookups of existing keys
+ * - scan: read BENCH_SCAN_LENGTH pairs from a key picked uniformly
+ * - ycsb-a .. ycsb-f, one after the other on the same structure:
+ *     A  50% read, 50% update                zipfian
+ *     B  95% read,  5% update                zipfian
+ *     C 100% read                            zipfian
+ *     D  95% read,  5% insert                latest (the newest items are popular)
+ *     E  95% scan of 1-100 pairs, 5% insert  zipfian
+ *     F  50% read, 50% read-modify-write     zipfian
+ * - remove: remove existing keys in random order
+ * A sorted vector shifts O(n) pairs per insert or remove, so the workloads
+ * that insert or remove are skipped for a sorted vector beyond
+ * BenchmarkOptions::sorted_vector_max_modify keys.
+ *
+ * 100M keys take about 3.5 GB in the tree (with half full leaves after random
+ * inserts, up to twice that) and about 5 GB in std::map, plus 1.6 GB for the
+ * data set; the Zipfian constants for 100M items take a few seconds.
+ */
+
+// time one operation in this many on its own for the latency percentiles
+const size_t BENCH_LATENCY_EVERY = 64;
+// # of pairs read by the scan workload
+const int BENCH_SCAN_LENGTH = 100;
+
+struct BenchmarkOptions {
+    // # of keys in the structures, one round of benchmarks each
+    vector<size_t> sizes;
+    // # of operations per benchmark
+    size_t operations;
+    // skew of the Zipfian distribution, YCSB uses 0.99
+    double zipf_theta;
+    // run the workloads that insert or remove on a sorted vector up to this many keys
+    size_t sorted_vector_max_modify;
+
+    BenchmarkOptions() : operations(1000000), zipf_theta(0.99), sorted_vector_max_modify(100000) {
+        sizes.push_back(1000);
+        sizes.push_back(100000);
+        sizes.push_back(1000000);
+    }
+};
+
+// the key of item i, bijective (the splitmix64 finalizer)
+inline int64_t bench_key(uint64_t i) {
+    i ^= i >> 30;
+    i *= 0xbf58476d1ce4e5b9ULL;
+    i ^= i >> 27;
+    i *= 0x94d049bb133111ebULL;
+    i ^= i >> 31;
+    return (int64_t) i;
+}
+
+/*
+ * Zipfian distribution over the items [0, n), item 0 the most popular, as
+ * generated by YCSB (Gray et al., "Quickly generating billion-record synthetic
+ * databases"). n may grow between calls, the constants are then extended
+ * with the new items instead of computed again.
+ */
+class ZipfianGenerator {
+private:
+    uint64_t items;
+    double theta, alpha, zeta2, zetan, eta;
+
+    void extend(uint64_t n) {
+        for (uint64_t i = items + 1; i <= n; ++i) {
+            zetan += 1.0 / pow((double) i, theta);
+        }
+        items = n;
+        eta = (1 - pow(2.0 / items, 1 - theta)) / (1 - zeta2 / zetan);
+    }
+
+public:
+    ZipfianGenerator(uint64_t n, double theta = 0.99)
+        : items(0), theta(theta), alpha(1 / (1 - theta)), zeta2(1 + pow(0.5, theta)), zetan(0), eta(0) {
+        extend(n > 2 ? n : 2);
+    }
+
+    template <typename Rng>
+    uint64_t next(Rng& rng, uint64_t n) {
+        if (n > items) extend(n);
+        double u = uniform_real_distribution<double>(0, 1)(rng);
+        double uz = u * zetan;
+        if (uz < 1) return 0;
+        if (uz < zeta2) return n > 1 ? 1 : 0;
+        uint64_t i = (uint64_t)(n * pow(eta * u - eta + 1, alpha));
+        return i < n ? i : n - 1;
+    }
+};
+
+/*
+ * The structures under test, all with the same interface:
+ * insert(key, value), find(key, value) (false if missing), update(key, value)
+ * of an existing key, scan(key, n) (the sum of the values of up to n pairs
+ * from the first key not less than key), remove(key), and load(first, last)
+ * to build from sorted pairs.
+ */
+template <int Order>
+class TreeBench {
+private:
+    SeqBPlusTree<int64_t, int64_t, Order> tree;
+
+public:
+    static const bool cheap_modify = true;
+    static string name() {
+        return "SeqBPlusTree<" + to_string(Order) + ">";
+    }
+
+    void insert(int64_t key, int64_t value) {
+        tree.insert(key, value);
+    }
+    bool find(int64_t key, int64_t& value) {
+        typename SeqBPlusTree<int64_t, int64_t, Order>::iterator it = tree.find(key);
+        if (it == tree.end()) return false;
+        value = it.value();
+        return true;
+    }
+    void update(int64_t key, int64_t value) {
+        tree.insert_or_assign(key, value);
+    }
+    int64_t scan(int64_t key, int n) {
+        int64_t sum = 0;
+        typename SeqBPlusTree<int64_t, int64_t, Order>::iterator it = tree.lower_bound(key);
+        for (int i = 0; i < n && it != tree.end(); ++i, ++it) {
+            sum += it.value();
+        }
+        return sum;
+    }
+    bool remove(int64_t key) {
+        return tree.remove(key);
+    }
+    template <typename ForwardIt>
+    void load(ForwardIt first, ForwardIt last) {
+        tree.bulk_load(first, last);
+    }
+};
+
+class MapBench {
+private:
+    map<int64_t, int64_t> tree;
+
+public:
+    static const bool cheap_modify = true;
+    static string name() {
+        return "std::map";
+    }
+
+    void insert(int64_t key, int64_t value) {
+        tree[key] = value;
+    }
+    bool find(int64_t key, int64_t& value) {
+        map<int64_t, int64_t>::iterator it = tree.find(key);
+        if (it == tree.end()) return false;
+        value = it->second;
+        return true;
+    }
+    void update(int64_t key, int64_t value) {
+        tree[key] = value;
+    }
+    int64_t scan(int64_t key, int n) {
+        int64_t sum = 0;
+        map<int64_t, int64_t>::iterator it = tree.lower_bound(key);
+        for (int i = 0; i < n && it != tree.end(); ++i, ++it) {
+            sum += it->second;
+        }
+        return sum;
+    }
+    bool remove(int64_t key) {
+        return tree.erase(key) == 1;
+    }
+    template <typename ForwardIt>
+    void load(ForwardIt first, ForwardIt last) {
+        tree = map<int64_t, int64_t>(first, last);
+    }
+};
+
+class SortedVectorBench {
+private:
+    typedef vector<pair<int64_t, int64_t> > Pairs;
+    Pairs pairs;
+
+    Pairs::iterator position(int64_t key) {
+        return std::lower_bound(pairs.begin(), pairs.end(), key,
+                                [](const pair<int64_t, int64_t>& p, int64_t k) { return p.first < k; });
+    }
+
+public:
+    static const bool cheap_modify = false;
+    static string name() {
+        return "sorted vector";
+    }
+
+    void insert(int64_t key, int64_t value) {
+        Pairs::iterator it = position(key);
+        if (it != pairs.end() && it->first == key) {
+            it->second = value;
+        } else {
+            pairs.insert(it, make_pair(key, value));
+        }
+    }
+    bool find(int64_t key, int64_t& value) {
+        Pairs::iterator it = position(key);
+        if (it == pairs.end() || it->first != key) return false;
+        value = it->second;
+        return true;
+    }
+    void update(int64_t key, int64_t value) {
+        insert(key, value);
+    }
+    int64_t scan(int64_t key, int n) {
+        int64_t sum = 0;
+        Pairs::iterator it = position(key);
+        for (int i = 0; i < n && it != pairs.end(); ++i, ++it) {
+            sum += it->second;
+        }
+        return sum;
+    }
+    bool remove(int64_t key) {
+        Pairs::iterator it = position(key);
+        if (it == pairs.end() || it->first != key) return false;
+        pairs.erase(it);
+        return true;
+    }
+    template <typename ForwardIt>
+    void load(ForwardIt first, ForwardIt last) {
+        pairs.assign(first, last);
+    }
+};
+
+// the time and the latency samples of the operations of one benchmark
+struct BenchResult {
+    double seconds;
+    size_t operations;
+    vector<double> latency_ns;
+
+    BenchResult() : seconds(0), operations(0) {}
+
+    // run op(0), ..., op(n-1) and add them to the result
+    template <typename Op>
+    void run(size_t n, Op op) {
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        for (size_t i = 0; i < n; ++i) {
+            if (i % BENCH_LATENCY_EVERY != 0) {
+                op(i);
+                continue;
+            }
+            chrono::steady_clock::time_point t = chrono::steady_clock::now();
+            op(i);
+            latency_ns.push_back(chrono::duration<double, nano>(chrono::steady_clock::now() - t).count());
+        }
+        seconds += chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        operations += n;
+    }
+
+    double percentile(double p) {
+        if (latency_ns.empty()) return 0;
+        return latency_ns[(size_t)(p * (latency_ns.size() - 1))];
+    }
+
+    void print(const string& name) {
+        sort(latency_ns.begin(), latency_ns.end());
+        printf("%-48s %9.2f M ops/s  p50 %7.0f ns  p99 %7.0f ns  p99.9 %8.0f ns\n", name.c_str(),
+               operations / seconds / 1e6, percentile(0.5), percentile(0.99), percentile(0.999));
+    }
+};
+
+// a result the compiler can't drop the benchmarked reads from
+inline void bench_consume(int64_t x) {
+    static volatile int64_t sink;
+    sink = sink + x;
+}
+
+// one operation of a YCSB workload
+struct YcsbOperation {
+    enum Type { READ, UPDATE, INSERT, SCAN, READ_MODIFY_WRITE };
+    Type type;
+    int64_t key;
+    int length; // of a scan
+};
+
+// the mix of a YCSB workload, in percent
+struct YcsbWorkload {
+    const char* name;
+    int read, update, insert, scan; // read-modify-write takes the rest
+    bool latest;                    // pick the newest items, otherwise Zipfian
+};
+
+// Generate the operations of a YCSB workload over the items [0, items).
+// Inserts add the items items, items+1, ...; items is updated.
+template <typename Rng>
+vector<YcsbOperation> ycsb_operations(const YcsbWorkload& w, size_t n, uint64_t& items,
+                                      ZipfianGenerator& zipf, Rng& rng) {
+    vector<YcsbOperation> ops(n);
+    uniform_int_distribution<int> percent(0, 99), length(1, 100);
+    for (size_t i = 0; i < n; ++i) {
+        int p = percent(rng);
+        YcsbOperation& op = ops[i];
+        op.length = 0;
+        if (p < w.insert) {
+            op.type = YcsbOperation::INSERT;
+            op.key = bench_key(items++);
+            continue;
+        }
+        uint64_t item = zipf.next(rng, items);
+        op.key = bench_key(w.latest ? items - 1 - item : item);
+        p -= w.insert;
+        if (p < w.read) {
+            op.type = YcsbOperation::READ;
+        } else if (p < w.read + w.update) {
+            op.type = YcsbOperation::UPDATE;
+        } else if (p < w.read + w.update + w.scan) {
+            op.type = YcsbOperation::SCAN;
+            op.length = length(rng);
+        } else {
+            op.type = YcsbOperation::READ_MODIFY_WRITE;
+        }
+    }
+    return ops;
+}
+
+// every benchmark for one structure holding n keys
+template <typename Structure>
+void run_structure_benchmarks(const BenchmarkOptions& options, size_t n) {
+    string suffix = "/" + Structure::name() + "/" + to_string(n);
+    bool modify = Structure::cheap_modify || n <= options.sorted_vector_max_modify;
+    mt19937_64 rng(42);
+    uniform_int_distribution<uint64_t> uniform(0, n - 1);
+    ZipfianGenerator zipf(n, options.zipf_theta);
+    size_t ops = options.operations;
+    size_t rounds = ops / n > 0 ? ops / n : 1;
+
+    // build it by random inserts, or load it if that would take too long
+    Structure s;
+    if (modify) {
+        BenchResult result;
+        for (size_t r = 0; r < rounds; ++r) {
+            Structure fresh;
+            result.run(n, [&](size_t i) { fresh.insert(bench_key(i), (int64_t) i); });
+            if (r + 1 == rounds) swap(s, fresh);
+        }
+        result.print("BM_insert/random" + suffix);
+    } else {
+        vector<pair<int64_t, int64_t> > pairs(n);
+        for (size_t i = 0; i < n; ++i) {
+            pairs[i] = make_pair(bench_key(i), (int64_t) i);
+        }
+        sort(pairs.begin(), pairs.end());
+        s.load(pairs.begin(), pairs.end());
+        printf("%-48s skipped\n", ("BM_insert/random" + suffix).c_str());
+    }
+    {
+        BenchResult result;
+        for (size_t r = 0; r < rounds; ++r) {
+            Structure fresh;
+            result.run(n, [&](size_t i) { fresh.insert((int64_t) i, (int64_t) i); });
+        }
+        result.print("BM_insert/sequential" + suffix);
+    }
+
+    vector<int64_t> keys(ops);
+    for (size_t i = 0; i < ops; ++i) {
+        keys[i] = bench_key(uniform(rng));
+    }
+    int64_t sum = 0;
+    {
+        BenchResult result;
+        result.run(ops, [&](size_t i) { int64_t v = 0; s.find(keys[i], v); sum += v; });
+        result.print("BM_lookup/uniform" + suffix);
+    }
+    // the scans start at uniform keys too, before they are replaced by Zipfian ones
+    {
+        BenchResult result;
+        result.run(ops / 10, [&](size_t i) { sum += s.scan(keys[i], BENCH_SCAN_LENGTH); });
+        result.print("BM_scan/" + to_string(BENCH_SCAN_LENGTH) + suffix);
+    }
+    for (size_t i = 0; i < ops; ++i) {
+        keys[i] = bench_key(zipf.next(rng, n));
+    }
+    {
+        BenchResult result;
+        result.run(ops, [&](size_t i) { int64_t v = 0; s.find(keys[i], v); sum += v; });
+        result.print("BM_lookup/zipfian" + suffix);
+    }
+    keys.clear();
+    keys.shrink_to_fit();
+
+    static const YcsbWorkload workloads[] = {
+        {"a", 50, 50, 0, 0, false},
+        {"b", 95, 5, 0, 0, false},
+        {"c", 100, 0, 0, 0, false},
+        {"d", 95, 0, 5, 0, true},
+        {"e", 0, 0, 5, 95, false},
+        {"f", 50, 0, 0, 0, false},
+    };
+    uint64_t items = n;
+    for (size_t w = 0; w < sizeof(workloads) / sizeof(workloads[0]); ++w) {
+        string name = string("BM_ycsb-") + workloads[w].name + suffix;
+        if (workloads[w].insert > 0 && !modify) {
+            printf("%-48s skipped\n", name.c_str());
+            continue;
+        }
+        vector<YcsbOperation> y = ycsb_operations(workloads[w], ops, items, zipf, rng);
+        BenchResult result;
+        result.run(ops, [&](size_t i) {
+            const YcsbOperation& op = y[i];
+            int64_t v = 0;
+            switch (op.type) {
+            case YcsbOperation::READ:
+                s.find(op.key, v);
+                sum += v;
+                break;
+            case YcsbOperation::UPDATE:
+                s.update(op.key, (int64_t) i);
+                break;
+            case YcsbOperation::INSERT:
+                s.insert(op.key, (int64_t) i);
+                break;
+            case YcsbOperation::SCAN:
+                sum += s.scan(op.key, op.length);
+                break;
+            case YcsbOperation::READ_MODIFY_WRITE:
+                s.find(op.key, v);
+                s.update(op.key, v + 1);
+                break;
+            }
+        });
+        result.print(name);
+    }
+
+    if (modify) {
+        vector<uint64_t> order(n);
+        for (size_t i = 0; i < n; ++i) {
+            order[i] = i;
+        }
+        shuffle(order.begin(), order.end(), rng);
+        BenchResult result;
+        result.run(min(ops, n), [&](size_t i) { s.remove(bench_key(order[i])); });
+        result.print("BM_remove/random" + suffix);
+    } else {
+        printf("%-48s skipped\n", ("BM_remove/random" + suffix).c_str());
+    }
+    bench_consume(sum);
+}
+
+// every benchmark for every size in the options
+void run_benchmarks(const BenchmarkOptions& options = BenchmarkOptions()) {
+    for (size_t k = 0; k < options.sizes.size(); ++k) {
+        size_t n = options.sizes[k];
+        printf("---- %zu keys, %zu operations per benchmark ----\n", n, options.operations);
+        run_structure_benchmarks<TreeBench<4> >(options, n);
+        run_structure_benchmarks<TreeBench<16> >(options, n);
+        run_structure_benchmarks<TreeBench<64> >(options, n);
+        run_structure_benchmarks<TreeBench<256> >(options, n);
+        run_structure_benchmarks<MapBench>(options, n);
+        run_structure_benchmarks<SortedVectorBench>(options, n);
+    }
+}
+
+#endif /* Benchmark_hpp */
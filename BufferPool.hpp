@@ -0,0 +1,322 @@
+#ifndef BufferPool_hpp
+#define BufferPool_hpp
+
+#include <cassert>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <unistd.h>
+#include <unordered_map>
+#include <vector>
+
+using namespace std;
+
+// pages are read and written as a whole, at offset page_id * page size
+typedef uint32_t page_id_t;
+// page 0 holds the file header, so no node ever lives there
+const page_id_t INVALID_PAGE = 0;
+// default page size of a disk-backed tree
+const size_t PAGE_SIZE = 4096;
+// frames start on this boundary, enough for O_DIRECT on common devices
+const size_t PAGE_ALIGN = 4096;
+
+/*
+ * A file of fixed-size pages.
+ * Every read and write moves whole pages with pread/pwrite. I/O errors throw
+ * runtime_error: a page that can't be read or written leaves no sensible value
+ * to return.
+ */
+class PageFile {
+private:
+    int fd;
+    size_t page_size;
+    string path;
+
+    void fail(const char* what) {
+        throw runtime_error(string(what) + " " + path + ": " + strerror(errno));
+    }
+
+public:
+    PageFile(const string& path, size_t page_size) : fd(-1), page_size(page_size), path(path) {
+        fd = ::open(path.c_str(), O_RDWR | O_CREAT, 0644);
+        if (fd < 0) fail("cannot open");
+    }
+    ~PageFile() {
+        if (fd >= 0) ::close(fd);
+    }
+    PageFile(const PageFile&) = delete;
+    PageFile& operator=(const PageFile&) = delete;
+
+    // # of whole pages in the file
+    page_id_t page_count() {
+        off_t end = ::lseek(fd, 0, SEEK_END);
+        if (end < 0) fail("cannot seek");
+        return (page_id_t)(end / page_size);
+    }
+
+    void read_page(page_id_t id, char* buf) {
+        size_t done = 0;
+        while (done < page_size) {
+            ssize_t n = ::pread(fd, buf + done, page_size - done, (off_t)id * page_size + done);
+            if (n < 0 && errno == EINTR) continue;
+            if (n < 0) fail("cannot read");
+            // past the end of the file, e.g. a page allocated but never written
+            if (n == 0) {
+                memset(buf + done, 0, page_size - done);
+                return;
+            }
+            done += n;
+        }
+    }
+
+    void write_page(page_id_t id, const char* buf) {
+        size_t done = 0;
+        while (done < page_size) {
+            ssize_t n = ::pwrite(fd, buf + done, page_size - done, (off_t)id * page_size + done);
+            if (n < 0 && errno == EINTR) continue;
+            if (n < 0) fail("cannot write");
+            done += n;
+        }
+    }
+
+    // wait until every write so far is on the device
+    void sync() {
+        if (::fdatasync(fd) != 0) fail("cannot sync");
+    }
+};
+
+/*
+ * Bounded cache of the pages of one PageFile with CLOCK replacement.
+ * pin() brings a page into a frame (reading it if needed) and keeps it there
+ * until the matching unpin(). A pinned frame is never evicted. unpin(id, true)
+ * marks the page dirty, a dirty page is written back when its frame is taken
+ * for another page or by flush().
+ * The hand sweeps the frames in a circle: a frame used since the last sweep
+ * gets a second chance, the first unpinned one not used since is the victim.
+ * A log can hook in (see set_hooks): it hears of a clean page before it's
+ * first modified, and of a dirty page before it's written back.
+ * Not thread safe, the tree using it serializes the calls.
+ */
+class BufferPool {
+public:
+    // called with the id and the content of a page, context is what was passed to set_hooks
+    typedef void (*PageHook)(void* context, page_id_t id, const char* page);
+
+private:
+    struct Frame {
+        page_id_t page;  // INVALID_PAGE if the frame is free
+        int pin_count;
+        bool dirty;
+        bool referenced; // used since the hand last passed
+        char* data;
+    };
+
+    PageFile& file;
+    size_t page_size;
+    vector<Frame> frames;
+    unordered_map<page_id_t, size_t> page_table; // page -> frame
+    size_t hand;
+    // counters, e.g. to size the pool
+    size_t hits, misses, write_backs;
+    PageHook before_modify;     // a clean page is about to be modified
+    PageHook before_write_back; // a dirty page is about to be written to the file
+    void* hook_context;
+
+public:
+    BufferPool(PageFile& file, size_t page_size, size_t frame_count)
+        : file(file), page_size(page_size), hand(0), hits(0), misses(0), write_backs(0),
+          before_modify(NULL), before_write_back(NULL), hook_context(NULL) {
+        if (frame_count == 0) frame_count = 1;
+        frames.resize(frame_count);
+        for (size_t i = 0; i < frame_count; ++i) {
+            void* p = NULL;
+            if (posix_memalign(&p, PAGE_ALIGN, page_size) != 0) throw bad_alloc();
+            frames[i].page = INVALID_PAGE;
+            frames[i].pin_count = 0;
+            frames[i].dirty = false;
+            frames[i].referenced = false;
+            frames[i].data = (char*) p;
+        }
+        page_table.reserve(frame_count);
+    }
+    // the owner flushes first, whatever is still dirty here is dropped
+    ~BufferPool() {
+        for (size_t i = 0; i < frames.size(); ++i) {
+            free(frames[i].data);
+        }
+    }
+    BufferPool(const BufferPool&) = delete;
+    BufferPool& operator=(const BufferPool&) = delete;
+
+    // the content of the page, valid until it's unpinned
+    char* pin(page_id_t id) {
+        unordered_map<page_id_t, size_t>::iterator it = page_table.find(id);
+        if (it != page_table.end()) {
+            Frame& frame = frames[it->second];
+            frame.pin_count++;
+            frame.referenced = true;
+            ++hits;
+            return frame.data;
+        }
+        ++misses;
+        Frame& frame = frames[take_frame(id)];
+        file.read_page(id, frame.data);
+        return frame.data;
+    }
+
+    // pin a page that is new to the file, its content starts zeroed and dirty
+    char* pin_new(page_id_t id) {
+        Frame& frame = frames[take_frame(id)];
+        memset(frame.data, 0, page_size);
+        frame.dirty = true;
+        return frame.data;
+    }
+
+    // the pinned page is about to be modified, call before changing it
+    // A page new to the file (pin_new) is dirty from the start and never
+    // reaches the hook until it's been written back.
+    void mark_dirty(page_id_t id) {
+        Frame& frame = frames[page_table.at(id)];
+        if (frame.dirty) return;
+        if (before_modify) before_modify(hook_context, id, frame.data);
+        frame.dirty = true;
+    }
+
+    void unpin(page_id_t id, bool dirty) {
+        Frame& frame = frames[page_table.at(id)];
+        if (frame.pin_count <= 0) {
+            throw logic_error("BufferPool: unpin of a page that isn't pinned");
+        }
+        frame.pin_count--;
+        frame.dirty = frame.dirty || dirty;
+    }
+    // unpin for PageGuard, whose destructor may run while an I/O error unwinds
+    // and so can't throw; the guard pinned the page itself
+    void unpin_pinned(page_id_t id, bool dirty) noexcept {
+        unordered_map<page_id_t, size_t>::iterator it = page_table.find(id);
+        assert(it != page_table.end() && frames[it->second].pin_count > 0);
+        if (it == page_table.end() || frames[it->second].pin_count <= 0) return;
+        Frame& frame = frames[it->second];
+        frame.pin_count--;
+        frame.dirty = frame.dirty || dirty;
+    }
+
+    // write every dirty page back, pinned or not
+    void flush() {
+        for (size_t i = 0; i < frames.size(); ++i) {
+            write_back(frames[i]);
+        }
+    }
+
+    // NULL for no hook
+    void set_hooks(PageHook before_modify, PageHook before_write_back, void* context) {
+        this->before_modify = before_modify;
+        this->before_write_back = before_write_back;
+        hook_context = context;
+    }
+
+    size_t frame_count() const {
+        return frames.size();
+    }
+    size_t hit_count() const {
+        return hits;
+    }
+    size_t miss_count() const {
+        return misses;
+    }
+    size_t write_back_count() const {
+        return write_backs;
+    }
+
+private:
+    void write_back(Frame& frame) {
+        if (frame.page == INVALID_PAGE || !frame.dirty) return;
+        if (before_write_back) before_write_back(hook_context, frame.page, frame.data);
+        file.write_page(frame.page, frame.data);
+        frame.dirty = false;
+        ++write_backs;
+    }
+
+    // a frame for page id, pinned once and registered in the page table
+    size_t take_frame(page_id_t id) {
+        // two full turns: the first may only clear the referenced bits
+        for (size_t step = 0; step < 2 * frames.size(); ++step) {
+            size_t i = hand;
+            hand = (hand + 1) % frames.size();
+            Frame& frame = frames[i];
+            if (frame.pin_count > 0) continue;
+            if (frame.referenced) {
+                frame.referenced = false;
+                continue;
+            }
+            write_back(frame);
+            if (frame.page != INVALID_PAGE) page_table.erase(frame.page);
+            frame.page = id;
+            frame.pin_count = 1;
+            frame.dirty = false;
+            frame.referenced = true;
+            page_table[id] = i;
+            return i;
+        }
+        throw runtime_error("BufferPool: every frame is pinned");
+    }
+};
+
+// keeps a page pinned while in scope, unpins it dirty if mark_dirty() was called
+// mark_dirty() has to come before the page is changed, see BufferPool::mark_dirty
+class PageGuard {
+private:
+    BufferPool* pool;
+    page_id_t id;
+    char* page;
+    bool dirty;
+
+public:
+    PageGuard() : pool(NULL), id(INVALID_PAGE), page(NULL), dirty(false) {}
+    PageGuard(BufferPool& pool, page_id_t id) : pool(&pool), id(id), page(pool.pin(id)), dirty(false) {}
+    PageGuard(BufferPool& pool, page_id_t id, char* page) : pool(&pool), id(id), page(page), dirty(true) {}
+    ~PageGuard() {
+        release();
+    }
+    PageGuard(const PageGuard&) = delete;
+    PageGuard& operator=(const PageGuard&) = delete;
+    PageGuard(PageGuard&& other) : pool(other.pool), id(other.id), page(other.page), dirty(other.dirty) {
+        other.pool = NULL;
+    }
+    PageGuard& operator=(PageGuard&& other) {
+        if (this != &other) {
+            release();
+            pool = other.pool;
+            id = other.id;
+            page = other.page;
+            dirty = other.dirty;
+            other.pool = NULL;
+        }
+        return *this;
+    }
+
+    page_id_t page_id() const {
+        return id;
+    }
+    template <typename T>
+    T* as() const {
+        return (T*) page;
+    }
+    void mark_dirty() {
+        if (!dirty) pool->mark_dirty(id);
+        dirty = true;
+    }
+    // unpin now instead of at the end of the scope
+    void release() noexcept {
+        if (pool) pool->unpin_pinned(id, dirty);
+        pool = NULL;
+    }
+};
+
+#endif /* BufferPool_hpp */
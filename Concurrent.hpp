@@ -0,0 +1,489 @@
+#ifndef Concurrent_hpp
+#define Concurrent_hpp
+
+#include <atomic>
+#include <cstdint>
+#include <thread>
+#include <type_traits>
+
+#include "Epoch.hpp"
+#include "Sequential.hpp"
+
+using namespace std;
+
+/*
+ * Version lock for optimistic lock coupling (OLC).
+ * A reader remembers the version of a node, reads the node without locking it
+ * and then checks that the version is unchanged, otherwise what it read may be
+ * torn and it restarts from the root. A writer locks the node, which makes the
+ * version odd in bit 1, and unlocking bumps the version so that every reader
+ * that overlapped the write notices.
+ * version: bit 0 obsolete (the node was removed from the tree),
+ *          bit 1 locked, the rest counts the writes
+ */
+struct OptLock {
+    atomic<uint64_t> version;
+
+    OptLock() : version(4) {}
+
+    static bool isLocked(uint64_t v) {
+        return (v & 2) == 2;
+    }
+    static bool isObsolete(uint64_t v) {
+        return (v & 1) == 1;
+    }
+
+    // spin until no writer holds the lock, return the version seen
+    uint64_t await_unlocked() const {
+        uint64_t v = version.load();
+        while (isLocked(v)) {
+            this_thread::yield();
+            v = version.load();
+        }
+        return v;
+    }
+
+    // start an optimistic read, restart if the node is obsolete
+    uint64_t read_lock_or_restart(bool& need_restart) const {
+        uint64_t v = await_unlocked();
+        if (isObsolete(v)) need_restart = true;
+        return v;
+    }
+    // the reads since start_read are valid only if the version is unchanged
+    void check_or_restart(uint64_t start_read, bool& need_restart) const {
+        read_unlock_or_restart(start_read, need_restart);
+    }
+    void read_unlock_or_restart(uint64_t start_read, bool& need_restart) const {
+        need_restart = start_read != version.load();
+    }
+
+    // turn an optimistic read into the write lock, unless somebody wrote in between
+    void upgrade_to_write_lock_or_restart(uint64_t& v, bool& need_restart) {
+        if (version.compare_exchange_strong(v, v + 2)) {
+            v = v + 2;
+        } else {
+            need_restart = true;
+        }
+    }
+    void write_lock_or_restart(bool& need_restart) {
+        uint64_t v = read_lock_or_restart(need_restart);
+        if (need_restart) return;
+        upgrade_to_write_lock_or_restart(v, need_restart);
+    }
+    void write_unlock() {
+        version.fetch_add(2);
+    }
+    // unlock and mark the node as removed from the tree
+    void write_unlock_obsolete() {
+        version.fetch_add(3);
+    }
+};
+
+/*
+ * Nodes of the concurrent tree.
+ * Same seperator convention as the sequential tree: child(i) holds the keys
+ * less than key(i) and not less than key(i-1), the reference at child(size)
+ * is the dummy one without a seperator.
+ * Full nodes are split on the way down, so an insert never has to go back up
+ * and a split only locks the node and its parent. Nodes are never merged, but
+ * a leaf that becomes empty is unlinked from its parent.
+ */
+struct ConNode {
+    OptLock lock;
+    NodeType type;
+    int size; // # of seperators in internal nodes or values in leaves
+
+    static void* operator new(size_t size) {
+        void* p = NULL;
+        if (posix_memalign(&p, CACHE_LINE_SIZE, size) != 0) throw bad_alloc();
+        return p;
+    }
+    static void operator delete(void* p) {
+        free(p);
+    }
+};
+
+template <typename Key, typename Value, int Order>
+struct ConLeaf : ConNode {
+    // at most Order-1 key-value pairs, like the leaves of the sequential tree
+    Key keys[Order - 1];
+    Value values[Order - 1];
+
+    ConLeaf() {
+        type = LEAF;
+        size = 0;
+    }
+
+    bool isFull() {
+        return size >= Order - 1;
+    }
+
+    // a size read without the lock may be torn, keep the search in the arrays
+    int stable_size() {
+        return size < Order - 1 ? size : Order - 1;
+    }
+
+    // move the upper half into right_half, a new empty leaf, sep is its smallest key
+    ConLeaf* split(Key& sep, ConLeaf* right_half) {
+        int half = size / 2;
+        for (int i = half, j = 0; i < size; ++i, ++j) {
+            right_half->keys[j]   = keys[i];
+            right_half->values[j] = values[i];
+        }
+        right_half->size = size - half;
+        size = half;
+        sep = right_half->keys[0];
+        return right_half;
+    }
+};
+
+template <typename Key, int Order>
+struct ConInternalNode : ConNode {
+    // at most Order-1 seperators and Order references, the last one is the dummy
+    Key keys[Order - 1];
+    ConNode* children[Order];
+
+    ConInternalNode() {
+        type = INTERNAL;
+        size = 0;
+    }
+
+    bool isFull() {
+        return size >= Order - 1;
+    }
+
+    int stable_size() {
+        return size < Order - 1 ? size : Order - 1;
+    }
+
+    // Move the upper half into right_half, a new empty node. The median
+    // seperator moves up as sep, its reference becomes the dummy one of the left half.
+    ConInternalNode* split(Key& sep, ConInternalNode* right_half) {
+        int mid = size / 2;
+        for (int i = mid + 1, j = 0; i <= size; ++i, ++j) {
+            if (i < size) right_half->keys[j] = keys[i];
+            right_half->children[j] = children[i];
+        }
+        right_half->size = size - mid - 1;
+        sep = keys[mid];
+        size = mid;
+        return right_half;
+    }
+
+    // the reference at i was split, the upper half right_half goes after it
+    void insert(int i, const Key& sep, ConNode* right_half) {
+        for (int j = size; j > i; --j) {
+            keys[j] = keys[j-1];
+            children[j+1] = children[j];
+        }
+        keys[i] = sep;
+        children[i+1] = right_half;
+        size++;
+    }
+
+    // drop the reference at i and the seperator bounding it, at least one is left
+    void erase(int i) {
+        int k = i < size ? i : i - 1;
+        for (int j = k; j < size - 1; ++j) {
+            keys[j] = keys[j+1];
+        }
+        for (int j = i; j < size; ++j) {
+            children[j] = children[j+1];
+        }
+        size--;
+    }
+};
+
+/*
+ * Concurrent B+ Tree class with optimistic lock coupling
+ * Key, Value: trivially copyable, as readers copy them out of nodes that a
+ *             writer may be changing at the same time (and then throw them away)
+ * Order:      branching factor, as in SeqBPlusTree
+ * Compare:    strict weak ordering of keys
+ *
+ * search() takes no lock at all. insert() and remove() descend the same way
+ * and only lock the leaf they change, plus the parent when a node gets split.
+ * A thread that sees a version change restarts from the root.
+ * remove() doesn't merge or borrow. A leaf that becomes empty is unlinked from
+ * its parent if that's possible without waiting, then marked obsolete and
+ * retired to the epoch manager: every operation runs inside an epoch, so the
+ * leaf only goes back to the node pool (a SharedNodeAllocator) once no thread
+ * can be reading it anymore.
+ */
+template <typename Key, typename Value, int Order = ORDER, typename Compare = less<Key> >
+class ConBPlusTree {
+private:
+    typedef ConLeaf<Key, Value, Order> Leaf;
+    typedef ConInternalNode<Key, Order> InternalNode;
+
+    static_assert(Order >= 4, "a split needs at least two entries per half node");
+    static_assert(is_trivially_copyable<Key>::value && is_trivially_copyable<Value>::value,
+                  "optimistic readers may copy a key or value while it's being written");
+
+    atomic<ConNode*> root;
+    Compare comp;
+    // declared before epoch, which frees the nodes still retired into it
+    SharedNodeAllocator<Leaf, InternalNode> alloc;
+    EpochManager epoch;
+
+public:
+    ConBPlusTree(const Compare& comp = Compare());
+    ~ConBPlusTree();
+    ConBPlusTree(const ConBPlusTree&) = delete;
+    ConBPlusTree& operator=(const ConBPlusTree&) = delete;
+
+    // search for the value relative to the given key, return not_found if not exists
+    Value search(const Key& key, const Value& not_found = Value(-1));
+    // return true: successfully insert a new key-value pair
+    // return false: key already exists, replace the previous with the new value
+    bool insert(const Key& key, const Value& value);
+    // return true if the key-value pair is successfully removed
+    // otherwise return false if the key doesn't exist
+    bool remove(const Key& key);
+
+// private helper functions
+private:
+    // index of the first key-value pair in the leaf whose key is not less than key
+    int leaf_lower_bound(Leaf* leaf, const Key& key) {
+        return node_lower_bound<sizeof(Key)>(leaf->keys, leaf->stable_size(), key, comp);
+    }
+    // index of the reference to follow for key
+    int child_index(InternalNode* node, const Key& key) {
+        return node_upper_bound<sizeof(Key)>(node->keys, node->stable_size(), key, comp);
+    }
+    // Descend to the leaf of key. On return the leaf is read locked at
+    // leaf_version and its parent (NULL for a root leaf) at parent_version.
+    // Full nodes on the way are split first if split_full is set.
+    // return NULL if the descent has to restart
+    Leaf* descend(const Key& key, bool split_full, InternalNode*& parent,
+                  uint64_t& parent_version, uint64_t& leaf_version);
+    // Split the full node (read at node_version) under its parent (read at
+    // parent_version, NULL if the node is the root). Always restart afterwards.
+    void split_node(ConNode* node, uint64_t node_version, InternalNode* parent,
+                    uint64_t parent_version, const Key& key);
+    // free the subtree, only when no other thread uses the tree
+    void destroy_subtree(ConNode* node);
+};
+
+template <typename Key, typename Value, int Order, typename Compare>
+ConBPlusTree<Key, Value, Order, Compare>::ConBPlusTree(const Compare& comp) : comp(comp) {
+    root.store(alloc.new_leaf());
+}
+
+template <typename Key, typename Value, int Order, typename Compare>
+ConBPlusTree<Key, Value, Order, Compare>::~ConBPlusTree() {
+    destroy_subtree(root.load());
+}
+
+template <typename Key, typename Value, int Order, typename Compare>
+Value ConBPlusTree<Key, Value, Order, Compare>::search(const Key& key, const Value& not_found) {
+    EpochGuard guard(epoch);
+    while (true) {
+        InternalNode* parent;
+        uint64_t parent_version, leaf_version;
+        Leaf* leaf = descend(key, false, parent, parent_version, leaf_version);
+        if (leaf == NULL) continue;
+
+        int i = leaf_lower_bound(leaf, key);
+        bool found = i < leaf->stable_size() && !comp(key, leaf->keys[i]);
+        Value result = found ? leaf->values[i] : not_found;
+
+        // the parent is checked too: the leaf may have been split after the
+        // reference to it was checked but before its version was read
+        bool need_restart = false;
+        if (parent) {
+            parent->lock.read_unlock_or_restart(parent_version, need_restart);
+            if (need_restart) continue;
+        }
+        leaf->lock.read_unlock_or_restart(leaf_version, need_restart);
+        if (need_restart) continue;
+        return result;
+    }
+}
+
+template <typename Key, typename Value, int Order, typename Compare>
+bool ConBPlusTree<Key, Value, Order, Compare>::insert(const Key& key, const Value& value) {
+    EpochGuard guard(epoch);
+    while (true) {
+        InternalNode* parent;
+        uint64_t parent_version, leaf_version;
+        Leaf* leaf = descend(key, true, parent, parent_version, leaf_version);
+        if (leaf == NULL) continue;
+
+        if (leaf->isFull()) {
+            split_node(leaf, leaf_version, parent, parent_version, key);
+            continue;
+        }
+        // only the leaf is locked, the parent just has to be unchanged
+        bool need_restart = false;
+        leaf->lock.upgrade_to_write_lock_or_restart(leaf_version, need_restart);
+        if (need_restart) continue;
+        if (parent) {
+            parent->lock.read_unlock_or_restart(parent_version, need_restart);
+            if (need_restart) {
+                leaf->lock.write_unlock();
+                continue;
+            }
+        }
+
+        int i = leaf_lower_bound(leaf, key);
+        bool exists = i < leaf->size && !comp(key, leaf->keys[i]);
+        if (!exists) {
+            for (int j = leaf->size; j > i; --j) {
+                leaf->keys[j]   = leaf->keys[j-1];
+                leaf->values[j] = leaf->values[j-1];
+            }
+            leaf->keys[i] = key;
+            leaf->size++;
+        }
+        leaf->values[i] = value;
+        leaf->lock.write_unlock();
+        return !exists;
+    }
+}
+
+template <typename Key, typename Value, int Order, typename Compare>
+bool ConBPlusTree<Key, Value, Order, Compare>::remove(const Key& key) {
+    EpochGuard guard(epoch);
+    while (true) {
+        InternalNode* parent;
+        uint64_t parent_version, leaf_version;
+        Leaf* leaf = descend(key, false, parent, parent_version, leaf_version);
+        if (leaf == NULL) continue;
+
+        bool need_restart = false;
+        leaf->lock.upgrade_to_write_lock_or_restart(leaf_version, need_restart);
+        if (need_restart) continue;
+        if (parent) {
+            parent->lock.read_unlock_or_restart(parent_version, need_restart);
+            if (need_restart) {
+                leaf->lock.write_unlock();
+                continue;
+            }
+        }
+
+        int i = leaf_lower_bound(leaf, key);
+        bool exists = i < leaf->size && !comp(key, leaf->keys[i]);
+        // The last pair goes, unlink the leaf instead if the parent keeps a
+        // reference. Taking the parent lock may fail, then the leaf stays empty.
+        if (exists && leaf->size == 1 && parent && parent->size > 0) {
+            parent->lock.upgrade_to_write_lock_or_restart(parent_version, need_restart);
+            if (!need_restart) {
+                parent->erase(child_index(parent, key));
+                parent->lock.write_unlock();
+                leaf->lock.write_unlock_obsolete();
+                epoch.retire(leaf, SharedNodeAllocator<Leaf, InternalNode>::reclaim_leaf, &alloc);
+                return true;
+            }
+        }
+        if (exists) {
+            // move the successive key-value forward
+            for (int j = i; j < leaf->size - 1; ++j) {
+                leaf->keys[j]   = leaf->keys[j+1];
+                leaf->values[j] = leaf->values[j+1];
+            }
+            leaf->size--;
+        }
+        leaf->lock.write_unlock();
+        return exists;
+    }
+}
+
+/*
+ * Private helper functions
+ */
+// Lock coupling without locks: read the version of the child before checking
+// that the parent is unchanged, so the reference followed was valid. Only the
+// parent and the current node are tracked, the grandparent is released.
+template <typename Key, typename Value, int Order, typename Compare>
+typename ConBPlusTree<Key, Value, Order, Compare>::Leaf*
+ConBPlusTree<Key, Value, Order, Compare>::descend(const Key& key, bool split_full, InternalNode*& parent,
+                                                  uint64_t& parent_version, uint64_t& leaf_version) {
+    bool need_restart = false;
+    ConNode* curr_node = root.load();
+    uint64_t curr_version = curr_node->lock.read_lock_or_restart(need_restart);
+    if (need_restart || curr_node != root.load()) return NULL;
+    parent = NULL;
+    parent_version = 0;
+
+    while (INTERNAL == curr_node->type) {
+        InternalNode* curr_internal = (InternalNode*) curr_node;
+        if (split_full && curr_internal->isFull()) {
+            split_node(curr_internal, curr_version, parent, parent_version, key);
+            return NULL;
+        }
+        if (parent) {
+            parent->lock.read_unlock_or_restart(parent_version, need_restart);
+            if (need_restart) return NULL;
+        }
+        parent = curr_internal;
+        parent_version = curr_version;
+
+        curr_node = curr_internal->children[child_index(curr_internal, key)];
+        // the reference may be garbage if the node changed, check before using it
+        curr_internal->lock.check_or_restart(curr_version, need_restart);
+        if (need_restart) return NULL;
+        curr_version = curr_node->lock.read_lock_or_restart(need_restart);
+        if (need_restart) return NULL;
+    }
+    leaf_version = curr_version;
+    return (Leaf*) curr_node;
+}
+
+// The parent has room because full nodes get split on the way down, so the
+// split ends there. A split root gets a new root above it.
+template <typename Key, typename Value, int Order, typename Compare>
+void ConBPlusTree<Key, Value, Order, Compare>::split_node(ConNode* node, uint64_t node_version, InternalNode* parent,
+                                                          uint64_t parent_version, const Key& key) {
+    bool need_restart = false;
+    if (parent) {
+        parent->lock.upgrade_to_write_lock_or_restart(parent_version, need_restart);
+        if (need_restart) return;
+    }
+    node->lock.upgrade_to_write_lock_or_restart(node_version, need_restart);
+    if (need_restart) {
+        if (parent) parent->lock.write_unlock();
+        return;
+    }
+    // the node was the root when read, but another thread may have added a root above
+    if (!parent && node != root.load()) {
+        node->lock.write_unlock();
+        return;
+    }
+
+    Key sep;
+    ConNode* right_half;
+    if (LEAF == node->type) {
+        right_half = ((Leaf*)node)->split(sep, alloc.new_leaf());
+    } else {
+        right_half = ((InternalNode*)node)->split(sep, alloc.new_internal());
+    }
+    if (parent) {
+        parent->insert(child_index(parent, key), sep, right_half);
+    } else {
+        InternalNode* new_root = alloc.new_internal();
+        new_root->keys[0] = sep;
+        new_root->children[0] = node;
+        new_root->children[1] = right_half;
+        new_root->size = 1;
+        root.store(new_root);
+    }
+
+    node->lock.write_unlock();
+    if (parent) parent->lock.write_unlock();
+}
+
+template <typename Key, typename Value, int Order, typename Compare>
+void ConBPlusTree<Key, Value, Order, Compare>::destroy_subtree(ConNode* node) {
+    if (INTERNAL == node->type) {
+        InternalNode* curr_internal = (InternalNode*) node;
+        for (int i = 0; i <= curr_internal->size; ++i) {
+            destroy_subtree(curr_internal->children[i]);
+        }
+        alloc.delete_internal(curr_internal);
+    } else {
+        alloc.delete_leaf((Leaf*) node);
+    }
+}
+
+#endif /* Concurrent_hpp */
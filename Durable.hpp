@@ -0,0 +1,249 @@
+#ifndef Durable_hpp
+#define Durable_hpp
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "Persistent.hpp"
+#include "Wal.hpp"
+
+using namespace std;
+
+// the records a DurableBPlusTree writes to its log
+enum WalRecordType {
+    WAL_CHECKPOINT = 1, // DiskFileHeader of the checkpoint, always the first record
+    WAL_PAGE_IMAGE,     // page id, then the page as of the checkpoint
+    WAL_INSERT,         // key, then value
+    WAL_REMOVE          // key
+};
+
+/*
+ * Disk-backed B+ Tree whose inserts and removes survive a crash
+ * Key, Value, Compare, PageSize: as in DiskBPlusTree
+ *
+ * The tree file only holds a consistent tree right after a checkpoint: the
+ * buffer pool writes modified pages back whenever it evicts them, and a split
+ * touches several pages. So the log keeps what's needed to get back to the
+ * last checkpoint and redo from there:
+ * - before a page is first modified after the checkpoint, its content goes to
+ *   the log (its before-image), and the page isn't written back until that
+ *   record is on the device
+ * - every insert and remove is logged after it's applied to the pages, so the
+ *   before-images of every page it touched come before it in the log
+ * Opening the tree writes the before-images back, which restores the file to
+ * the checkpoint, then redoes the inserts and removes that made it to the log,
+ * and checkpoints. A crash during recovery just means recovering again.
+ *
+ * A checkpoint writes every modified page and the header to the file and
+ * starts the log over. It happens when the log grows past
+ * WalOptions::checkpoint_bytes, on checkpoint() and in the destructor.
+ *
+ * The tree itself is guarded by one lock, but a writer lets go of it before
+ * waiting for its log record: the commits of concurrent writers are synced
+ * together (see WriteAheadLog), so one fdatasync serves many of them.
+ */
+template <typename Key, typename Value, typename Compare = less<Key>, size_t PageSize = PAGE_SIZE>
+class DurableBPlusTree {
+private:
+    typedef DiskBPlusTree<Key, Value, Compare, PageSize> Tree;
+
+    WriteAheadLog wal;
+    Tree* tree;
+    mutex tree_lock;
+    // pages from here on were added since the checkpoint and need no before-image
+    page_id_t checkpoint_pages;
+    // the LSN of the before-image of every page modified since the checkpoint
+    unordered_map<page_id_t, uint64_t> image_lsn;
+    size_t checkpoint_bytes;
+
+public:
+    // open the tree in the file at path with its log at path.wal, recovering
+    // from a crash if needed, or create both
+    DurableBPlusTree(const string& path, const WalOptions& options = WalOptions(),
+                     size_t pool_pages = DISK_POOL_PAGES, const Compare& comp = Compare());
+    // checkpoint, the log is then empty but for the checkpoint record
+    ~DurableBPlusTree();
+    DurableBPlusTree(const DurableBPlusTree&) = delete;
+    DurableBPlusTree& operator=(const DurableBPlusTree&) = delete;
+
+    // search for the value relative to the given key, return not_found if not exists
+    Value search(const Key& key, const Value& not_found = Value(-1));
+    // return true: successfully insert a new key-value pair
+    // return false: key already exists, replace the previous with the new value
+    // Either way the pair is durable on return, see WalOptions::sync_on_commit.
+    bool insert(const Key& key, const Value& value);
+    // return true if the key-value pair is successfully removed, it's durable then
+    // otherwise return false if the key doesn't exist
+    bool remove(const Key& key);
+    // the key-value pairs with keys in [lo, hi), in key order
+    vector<pair<Key, Value> > range(const Key& lo, const Key& hi);
+    // write the tree to its file and start the log over
+    void checkpoint();
+
+    WriteAheadLog& log() {
+        return wal;
+    }
+
+// private helper functions
+private:
+    // bring the file back to the last checkpoint, redo the logged operations and checkpoint
+    void recover(const string& path, size_t pool_pages, const Compare& comp);
+    // checkpoint with tree_lock held
+    void checkpoint_locked();
+    // BufferPool hooks, context is the tree
+    // log the before-image of a page modified for the first time since the checkpoint
+    static void log_page_image(void* context, page_id_t id, const char* page);
+    // a page may only be written back once its before-image is on the device
+    static void sync_page_image(void* context, page_id_t id, const char* page);
+};
+
+template <typename Key, typename Value, typename Compare, size_t PageSize>
+DurableBPlusTree<Key, Value, Compare, PageSize>::DurableBPlusTree(const string& path, const WalOptions& options,
+                                                                  size_t pool_pages, const Compare& comp)
+    : wal(path + ".wal", options), tree(NULL), checkpoint_pages(0), checkpoint_bytes(options.checkpoint_bytes) {
+    recover(path, pool_pages, comp);
+}
+
+template <typename Key, typename Value, typename Compare, size_t PageSize>
+DurableBPlusTree<Key, Value, Compare, PageSize>::~DurableBPlusTree() {
+    try {
+        checkpoint();
+    } catch (const exception& e) {
+        cerr << "Error: cannot checkpoint the tree: " << e.what() << endl;
+    }
+    tree->set_page_hooks(NULL, NULL, NULL);
+    delete tree;
+}
+
+template <typename Key, typename Value, typename Compare, size_t PageSize>
+Value DurableBPlusTree<Key, Value, Compare, PageSize>::search(const Key& key, const Value& not_found) {
+    lock_guard<mutex> guard(tree_lock);
+    return tree->search(key, not_found);
+}
+
+template <typename Key, typename Value, typename Compare, size_t PageSize>
+bool DurableBPlusTree<Key, Value, Compare, PageSize>::insert(const Key& key, const Value& value) {
+    bool inserted;
+    uint64_t lsn;
+    {
+        lock_guard<mutex> guard(tree_lock);
+        inserted = tree->insert(key, value);
+        lsn = wal.append(WAL_INSERT, &key, sizeof(Key), &value, sizeof(Value));
+        if (checkpoint_bytes > 0 && wal.size() > checkpoint_bytes) checkpoint_locked();
+    }
+    wal.commit(lsn);
+    return inserted;
+}
+
+template <typename Key, typename Value, typename Compare, size_t PageSize>
+bool DurableBPlusTree<Key, Value, Compare, PageSize>::remove(const Key& key) {
+    uint64_t lsn;
+    {
+        lock_guard<mutex> guard(tree_lock);
+        if (!tree->remove(key)) return false;
+        lsn = wal.append(WAL_REMOVE, &key, sizeof(Key));
+        if (checkpoint_bytes > 0 && wal.size() > checkpoint_bytes) checkpoint_locked();
+    }
+    wal.commit(lsn);
+    return true;
+}
+
+template <typename Key, typename Value, typename Compare, size_t PageSize>
+vector<pair<Key, Value> > DurableBPlusTree<Key, Value, Compare, PageSize>::range(const Key& lo, const Key& hi) {
+    lock_guard<mutex> guard(tree_lock);
+    return tree->range(lo, hi);
+}
+
+template <typename Key, typename Value, typename Compare, size_t PageSize>
+void DurableBPlusTree<Key, Value, Compare, PageSize>::checkpoint() {
+    lock_guard<mutex> guard(tree_lock);
+    checkpoint_locked();
+}
+
+/*
+ * Private helper functions
+ */
+template <typename Key, typename Value, typename Compare, size_t PageSize>
+void DurableBPlusTree<Key, Value, Compare, PageSize>::recover(const string& path, size_t pool_pages, const Compare& comp) {
+    bool has_checkpoint = false;
+    DiskFileHeader header;
+    vector<pair<page_id_t, vector<char> > > images;
+    vector<pair<uint8_t, vector<char> > > operations;
+    wal.replay([&](uint8_t type, const char* payload, size_t length) {
+        if (type == WAL_CHECKPOINT && length == sizeof(DiskFileHeader)) {
+            memcpy(&header, payload, sizeof(header));
+            has_checkpoint = true;
+        } else if (!has_checkpoint) {
+            return;
+        } else if (type == WAL_PAGE_IMAGE && length == sizeof(page_id_t) + PageSize) {
+            page_id_t id;
+            memcpy(&id, payload, sizeof(id));
+            images.push_back(make_pair(id, vector<char>(payload + sizeof(id), payload + length)));
+        } else if ((type == WAL_INSERT && length == sizeof(Key) + sizeof(Value))
+                   || (type == WAL_REMOVE && length == sizeof(Key))) {
+            operations.push_back(make_pair(type, vector<char>(payload, payload + length)));
+        }
+    });
+
+    // back to the checkpoint: its pages and its header
+    if (has_checkpoint) {
+        PageFile file(path, PageSize);
+        for (size_t i = 0; i < images.size(); ++i) {
+            file.write_page(images[i].first, images[i].second.data());
+        }
+        vector<char> header_page(PageSize, 0);
+        memcpy(header_page.data(), &header, sizeof(header));
+        file.write_page(0, header_page.data());
+        file.sync();
+    }
+
+    tree = new Tree(path, pool_pages, comp);
+    for (size_t i = 0; i < operations.size(); ++i) {
+        Key key;
+        memcpy(&key, operations[i].second.data(), sizeof(Key));
+        if (operations[i].first == WAL_INSERT) {
+            Value value;
+            memcpy(&value, operations[i].second.data() + sizeof(Key), sizeof(Value));
+            tree->insert(key, value);
+        } else {
+            tree->remove(key);
+        }
+    }
+    tree->set_page_hooks(log_page_image, sync_page_image, this);
+    checkpoint_locked();
+}
+
+// Every logged operation has to be on the device before the pages are written,
+// and the pages before the log starts over.
+template <typename Key, typename Value, typename Compare, size_t PageSize>
+void DurableBPlusTree<Key, Value, Compare, PageSize>::checkpoint_locked() {
+    wal.sync(wal.last_lsn());
+    tree->flush();
+    image_lsn.clear();
+    checkpoint_pages = tree->pages();
+    DiskFileHeader header = tree->header();
+    wal.reset(WAL_CHECKPOINT, &header, sizeof(header));
+}
+
+template <typename Key, typename Value, typename Compare, size_t PageSize>
+void DurableBPlusTree<Key, Value, Compare, PageSize>::log_page_image(void* context, page_id_t id, const char* page) {
+    DurableBPlusTree* self = (DurableBPlusTree*) context;
+    if (id >= self->checkpoint_pages || self->image_lsn.count(id) > 0) return;
+    self->image_lsn[id] = self->wal.append(WAL_PAGE_IMAGE, &id, sizeof(id), page, PageSize);
+}
+
+template <typename Key, typename Value, typename Compare, size_t PageSize>
+void DurableBPlusTree<Key, Value, Compare, PageSize>::sync_page_image(void* context, page_id_t id, const char*) {
+    DurableBPlusTree* self = (DurableBPlusTree*) context;
+    unordered_map<page_id_t, uint64_t>::iterator it = self->image_lsn.find(id);
+    if (it != self->image_lsn.end()) self->wal.sync(it->second);
+}
+
+#endif /* Durable_hpp */
@@ -0,0 +1,200 @@
+#ifndef Epoch_hpp
+#define Epoch_hpp
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+// most threads that can use one EpochManager at the same time
+const int EPOCH_MAX_THREADS = 256;
+// a thread tries to free its retired memory every this many retires
+const size_t EPOCH_RECLAIM_THRESHOLD = 64;
+// # of EpochManagers a thread remembers its slot in
+const int EPOCH_SLOT_CACHE = 4;
+// slots are a cache line apart, so threads don't write to the same line
+const size_t EPOCH_SLOT_ALIGN = 64;
+
+/*
+ * Epoch-based memory reclamation.
+ * A thread that may hold pointers into a shared structure enters the current
+ * global epoch before and exits it afterwards (see EpochGuard). Memory that got
+ * unlinked from the structure is not freed right away but retired: it's tagged
+ * with the global epoch and freed later by its deleter.
+ * The global epoch only moves on once every thread inside an epoch has seen
+ * the current one, so while a thread stays in epoch e the global epoch is at
+ * most e+1. Memory retired in epoch e was unlinked before any thread entered
+ * epoch e+1, so once the global epoch reaches e+2 no thread can still hold it.
+ *
+ * Every thread gets a slot the first time it uses the manager; the slot keeps
+ * its own list of retired memory, so retire() needs no lock. A slot belongs to
+ * a thread id: a new thread that gets the id of a finished one takes over the
+ * slot and its retired memory.
+ * The deleter decides where retired memory goes, e.g. back to the node pool
+ * of a concurrent tree through SharedNodeAllocator::reclaim_leaf.
+ */
+class EpochManager {
+public:
+    // frees a retired pointer, context is what was passed to retire()
+    typedef void (*Deleter)(void* context, void* p);
+
+private:
+    struct Retired {
+        void* p;
+        Deleter deleter;
+        void* context;
+        uint64_t epoch;
+    };
+
+    static const uint64_t INACTIVE = ~(uint64_t)0;
+
+    struct alignas(EPOCH_SLOT_ALIGN) Slot {
+        atomic<thread::id> owner;
+        atomic<uint64_t> epoch; // the epoch entered, INACTIVE if outside
+        int nesting;            // guards of the owner on the stack
+        vector<Retired> retired;
+
+        Slot() : owner(thread::id()), epoch(INACTIVE), nesting(0) {}
+    };
+
+    atomic<uint64_t> global_epoch;
+    Slot slots[EPOCH_MAX_THREADS];
+    atomic<int> slots_used; // slots[0..slots_used) have been handed out
+    uint64_t manager_id;    // tells managers apart in the per thread slot cache
+
+    static uint64_t next_manager_id() {
+        static atomic<uint64_t> counter(0);
+        return ++counter;
+    }
+
+public:
+    EpochManager() : global_epoch(1), slots_used(0), manager_id(next_manager_id()) {}
+    // free everything still retired, no thread may be inside an epoch anymore
+    ~EpochManager() {
+        for (int i = 0; i < slots_used.load(); ++i) {
+            free_retired(slots[i], INACTIVE);
+        }
+    }
+    EpochManager(const EpochManager&) = delete;
+    EpochManager& operator=(const EpochManager&) = delete;
+
+    // enter the current epoch, guards of the same thread may nest
+    void enter() {
+        Slot& slot = local_slot();
+        if (slot.nesting++ > 0) return;
+        slot.epoch.store(global_epoch.load());
+    }
+
+    void exit() {
+        Slot& slot = local_slot();
+        if (--slot.nesting > 0) return;
+        slot.epoch.store(INACTIVE);
+    }
+
+    // free p with deleter(context, p) once no thread can hold it anymore
+    // p has to be unlinked already, so no thread entering from now on finds it
+    void retire(void* p, Deleter deleter, void* context = NULL) {
+        Slot& slot = local_slot();
+        Retired r = {p, deleter, context, global_epoch.load()};
+        slot.retired.push_back(r);
+        if (slot.retired.size() % EPOCH_RECLAIM_THRESHOLD == 0) {
+            try_advance();
+            free_retired(slot, global_epoch.load());
+        }
+    }
+
+    // # of retired pointers of the calling thread not freed yet
+    size_t pending() {
+        return local_slot().retired.size();
+    }
+
+private:
+    // move the global epoch on if every thread inside an epoch has seen it
+    void try_advance() {
+        uint64_t curr = global_epoch.load();
+        for (int i = 0; i < slots_used.load(); ++i) {
+            uint64_t e = slots[i].epoch.load();
+            if (e != INACTIVE && e != curr) return;
+        }
+        global_epoch.compare_exchange_strong(curr, curr + 1);
+    }
+
+    // free the retired pointers of the slot that are at least two epochs old
+    void free_retired(Slot& slot, uint64_t curr) {
+        size_t kept = 0;
+        for (size_t i = 0; i < slot.retired.size(); ++i) {
+            Retired& r = slot.retired[i];
+            if (curr == INACTIVE || r.epoch + 2 <= curr) {
+                r.deleter(r.context, r.p);
+            } else {
+                slot.retired[kept++] = r;
+            }
+        }
+        slot.retired.resize(kept);
+    }
+
+    // the slot of the calling thread, taken the first time
+    Slot& local_slot() {
+        struct CacheEntry {
+            uint64_t manager_id;
+            Slot* slot;
+        };
+        static thread_local CacheEntry cache[EPOCH_SLOT_CACHE];
+        static thread_local int next_victim = 0;
+        for (int i = 0; i < EPOCH_SLOT_CACHE; ++i) {
+            if (cache[i].manager_id == manager_id) return *cache[i].slot;
+        }
+
+        Slot* slot = find_slot(this_thread::get_id());
+        cache[next_victim].manager_id = manager_id;
+        cache[next_victim].slot = slot;
+        next_victim = (next_victim + 1) % EPOCH_SLOT_CACHE;
+        return *slot;
+    }
+
+    // the slot owned by id, or a new one
+    Slot* find_slot(thread::id id) {
+        int used = slots_used.load();
+        for (int i = 0; i < used; ++i) {
+            if (slots[i].owner.load() == id) return &slots[i];
+        }
+        while (true) {
+            used = slots_used.load();
+            if (used == EPOCH_MAX_THREADS) {
+                throw runtime_error("EpochManager: too many threads");
+            }
+            // claim the slot first, then publish it
+            thread::id nobody;
+            if (slots[used].owner.compare_exchange_strong(nobody, id)) {
+                slots_used.fetch_add(1);
+                return &slots[used];
+            }
+            // another thread claimed it, wait until it's published
+            while (slots_used.load() == used) {
+                this_thread::yield();
+            }
+        }
+    }
+};
+
+// keeps the calling thread inside an epoch while in scope
+class EpochGuard {
+private:
+    EpochManager& manager;
+
+public:
+    explicit EpochGuard(EpochManager& manager) : manager(manager) {
+        manager.enter();
+    }
+    ~EpochGuard() {
+        manager.exit();
+    }
+    EpochGuard(const EpochGuard&) = delete;
+    EpochGuard& operator=(const EpochGuard&) = delete;
+};
+
+#endif /* Epoch_hpp */
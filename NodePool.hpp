@@ -0,0 +1,231 @@
+#ifndef NodePool_hpp
+#define NodePool_hpp
+
+#include <cstddef>
+#include <cstdlib>
+#include <mutex>
+#include <new>
+#include <vector>
+
+using namespace std;
+
+// chunks start on a cache line, so do the blocks whose size is a multiple of it
+const size_t SLAB_CHUNK_ALIGN = 64;
+// a chunk holds at least this many bytes (and at least SLAB_MIN_BLOCKS blocks)
+const size_t SLAB_CHUNK_BYTES = 64 * 1024;
+const size_t SLAB_MIN_BLOCKS  = 16;
+
+/*
+ * Slab allocator for blocks of a single size class.
+ * Blocks are carved out of large chunks one after another, so nodes created
+ * together sit next to each other in memory. A freed block goes onto a free
+ * list and is handed out again before a new one is carved. Allocation and
+ * deallocation are O(1), except for one chunk allocation every
+ * blocks_per_chunk blocks. All chunks are released at once by release() or
+ * when the pool is destroyed; blocks still in use are not destructed.
+ */
+template <size_t BlockSize, size_t BlockAlign>
+class SlabPool {
+private:
+    struct FreeBlock {
+        FreeBlock* next;
+    };
+    // round up so that every block in a chunk keeps the alignment
+    static const size_t block_size =
+        ((BlockSize < sizeof(FreeBlock) ? sizeof(FreeBlock) : BlockSize) + BlockAlign - 1)
+        / BlockAlign * BlockAlign;
+    static const size_t chunk_align = BlockAlign > SLAB_CHUNK_ALIGN ? BlockAlign : SLAB_CHUNK_ALIGN;
+    static const size_t blocks_per_chunk =
+        SLAB_CHUNK_BYTES / block_size > SLAB_MIN_BLOCKS ? SLAB_CHUNK_BYTES / block_size : SLAB_MIN_BLOCKS;
+
+    vector<void*> chunks;
+    FreeBlock* free_list;
+    char* bump;     // next block to carve in the last chunk
+    char* bump_end; // end of the last chunk
+
+public:
+    SlabPool() : free_list(NULL), bump(NULL), bump_end(NULL) {}
+    ~SlabPool() {
+        release();
+    }
+    // the chunks belong to exactly one pool
+    SlabPool(const SlabPool&) = delete;
+    SlabPool& operator=(const SlabPool&) = delete;
+    SlabPool(SlabPool&& other)
+        : chunks(std::move(other.chunks)), free_list(other.free_list),
+          bump(other.bump), bump_end(other.bump_end) {
+        other.chunks.clear();
+        other.free_list = NULL;
+        other.bump = other.bump_end = NULL;
+    }
+    SlabPool& operator=(SlabPool&& other) {
+        if (this != &other) {
+            release();
+            chunks.swap(other.chunks);
+            free_list = other.free_list;
+            bump = other.bump;
+            bump_end = other.bump_end;
+            other.free_list = NULL;
+            other.bump = other.bump_end = NULL;
+        }
+        return *this;
+    }
+
+    void* allocate() {
+        if (free_list) {
+            FreeBlock* block = free_list;
+            free_list = block->next;
+            return block;
+        }
+        if (bump == bump_end) {
+            void* chunk = NULL;
+            if (posix_memalign(&chunk, chunk_align, block_size * blocks_per_chunk) != 0) {
+                throw bad_alloc();
+            }
+            chunks.push_back(chunk);
+            bump = (char*) chunk;
+            bump_end = bump + block_size * blocks_per_chunk;
+        }
+        void* block = bump;
+        bump += block_size;
+        return block;
+    }
+
+    void deallocate(void* p) {
+        FreeBlock* block = (FreeBlock*) p;
+        block->next = free_list;
+        free_list = block;
+    }
+
+    // free every chunk, all blocks become invalid
+    void release() {
+        for (size_t i = 0; i < chunks.size(); ++i) {
+            free(chunks[i]);
+        }
+        chunks.clear();
+        free_list = NULL;
+        bump = bump_end = NULL;
+    }
+
+    // # of bytes held from the system
+    size_t capacity() const {
+        return chunks.size() * block_size * blocks_per_chunk;
+    }
+};
+
+/*
+ * Node allocators used by SeqBPlusTree. An allocator creates and destroys the
+ * leaves and internal nodes of one tree:
+ *   LeafT* new_leaf();                   InternalT* new_internal();
+ *   void delete_leaf(LeafT*);            void delete_internal(InternalT*);
+ *   void release();  free the memory of every node at once without destructing
+ *                    them, only does anything if can_release is true
+ * SharedNodeAllocator has the same interface for the threads of a concurrent
+ * tree, and deleters for the nodes it retires to an EpochManager.
+ */
+
+// A slab pool per node size class, owned by the tree.
+template <typename LeafT, typename InternalT>
+class PooledNodeAllocator {
+private:
+    SlabPool<sizeof(LeafT), alignof(LeafT)> leaves;
+    SlabPool<sizeof(InternalT), alignof(InternalT)> internals;
+
+public:
+    static const bool can_release = true;
+
+    LeafT* new_leaf() {
+        return ::new (leaves.allocate()) LeafT();
+    }
+    InternalT* new_internal() {
+        return ::new (internals.allocate()) InternalT();
+    }
+    void delete_leaf(LeafT* leaf) {
+        leaf->~LeafT();
+        leaves.deallocate(leaf);
+    }
+    void delete_internal(InternalT* node) {
+        node->~InternalT();
+        internals.deallocate(node);
+    }
+    void release() {
+        leaves.release();
+        internals.release();
+    }
+    size_t capacity() const {
+        return leaves.capacity() + internals.capacity();
+    }
+};
+
+// Every node from the global heap, one new/delete per node.
+template <typename LeafT, typename InternalT>
+class HeapNodeAllocator {
+public:
+    static const bool can_release = false;
+
+    LeafT* new_leaf() {
+        return new LeafT();
+    }
+    InternalT* new_internal() {
+        return new InternalT();
+    }
+    void delete_leaf(LeafT* leaf) {
+        delete leaf;
+    }
+    void delete_internal(InternalT* node) {
+        delete node;
+    }
+    // the heap can't drop the nodes at once, they have to be deleted one by one
+    void release() {}
+    size_t capacity() const {
+        return 0;
+    }
+};
+
+// A pooled allocator shared by the threads of a concurrent tree, every call
+// takes the lock. Nodes are only created by splits and destroyed when the
+// epoch manager frees retired ones, so the lock is rarely contended.
+template <typename LeafT, typename InternalT>
+class SharedNodeAllocator {
+private:
+    PooledNodeAllocator<LeafT, InternalT> pool;
+    mutex lock;
+
+public:
+    static const bool can_release = true;
+
+    LeafT* new_leaf() {
+        lock_guard<mutex> guard(lock);
+        return pool.new_leaf();
+    }
+    InternalT* new_internal() {
+        lock_guard<mutex> guard(lock);
+        return pool.new_internal();
+    }
+    void delete_leaf(LeafT* leaf) {
+        lock_guard<mutex> guard(lock);
+        pool.delete_leaf(leaf);
+    }
+    void delete_internal(InternalT* node) {
+        lock_guard<mutex> guard(lock);
+        pool.delete_internal(node);
+    }
+    // deleters for EpochManager::retire, the allocator is the context passed
+    // there; they may run on any thread that retires
+    static void reclaim_leaf(void* allocator, void* leaf) {
+        ((SharedNodeAllocator*)allocator)->delete_leaf((LeafT*)leaf);
+    }
+    static void reclaim_internal(void* allocator, void* node) {
+        ((SharedNodeAllocator*)allocator)->delete_internal((InternalT*)node);
+    }
+    void release() {
+        lock_guard<mutex> guard(lock);
+        pool.release();
+    }
+    size_t capacity() {
+        lock_guard<mutex> guard(lock);
+        return pool.capacity();
+    }
+};
+
+#endif /* NodePool_hpp */
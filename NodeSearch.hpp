@@ -0,0 +1,202 @@
+#ifndef NodeSearch_hpp
+#define NodeSearch_hpp
+
+#include <cstddef>
+#include <functional>
+#include <type_traits>
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+using namespace std;
+
+/*
+ * Search kernels for the sorted keys inside one node.
+ * The keys don't need to be contiguous: the i-th key lives Stride bytes after
+ * the (i-1)-th one, so they work on an array of key-value pairs as well.
+ *
+ * node_lower_bound returns the index of the first key not less than the given
+ * key, node_upper_bound the index of the first key greater than it, which is
+ * the same as std::lower_bound/std::upper_bound over the keys.
+ *
+ * The kernel is picked by the number of keys in the node:
+ * - small nodes are scanned, with AVX2/SSE compare-and-movemask when the keys
+ *   are 32/64-bit signed integers compared by less<Key>, otherwise one by one
+ * - larger nodes are binary searched without branches on the comparison result
+ * The key searched for may be of another type than the keys in the node if the
+ * comparator compares the two both ways (a transparent comparator), then the
+ * node is always searched without SIMD.
+ */
+
+// nodes with at most this many keys are scanned with SIMD
+const int NODE_SCAN_MAX_SIMD   = 64;
+// nodes with at most this many keys are scanned one key by one key
+const int NODE_SCAN_MAX_SCALAR = 8;
+
+// the i-th key in an array of keys that are Stride bytes apart
+template <size_t Stride, typename Key>
+inline const Key& node_key_at(const Key* keys, int i) {
+    return *(const Key*)((const char*)keys + i * Stride);
+}
+
+// Whether a SIMD scan is available for this key type, comparator and stride.
+// A vector load covers several entries, the lanes that hold values or
+// references are masked out of the comparison result.
+template <size_t Stride, typename Key, typename Compare>
+struct NodeSimdScan {
+    static const bool lane_fits = is_integral<Key>::value && is_signed<Key>::value
+        && Stride % sizeof(Key) == 0
+        && (Stride / sizeof(Key) == 1 || Stride / sizeof(Key) == 2 || Stride / sizeof(Key) == 4);
+#if defined(__AVX2__) || defined(__SSE4_2__)
+    static const bool isa = sizeof(Key) == 4 || sizeof(Key) == 8;
+#elif defined(__SSE2__)
+    static const bool isa = sizeof(Key) == 4;
+#else
+    static const bool isa = false;
+#endif
+    static const bool enabled = lane_fits && isa && is_same<Compare, less<Key> >::value;
+};
+
+// Count the keys less than (OrEqual: not greater than) the given key.
+// As the keys are sorted, the hits are a prefix and the scan stops at the
+// first vector with a miss.
+template <size_t Stride, bool OrEqual, typename Key>
+inline int node_simd_count(const Key* keys, int n, Key key, integral_constant<int, 4>) {
+    const int lanes_per_entry = Stride / sizeof(Key);
+    int count = 0, i = 0;
+#if defined(__AVX2__)
+    const int per_vec = 8 / lanes_per_entry;
+    const int mask = lanes_per_entry == 1 ? 0xFF : (lanes_per_entry == 2 ? 0x55 : 0x11);
+    __m256i probe = _mm256_set1_epi32((int)key);
+    for (; i + per_vec <= n; i += per_vec) {
+        __m256i v = _mm256_loadu_si256((const __m256i*)((const char*)keys + i * Stride));
+        __m256i hit = OrEqual ? _mm256_cmpgt_epi32(v, probe) : _mm256_cmpgt_epi32(probe, v);
+        int bits = _mm256_movemask_ps(_mm256_castsi256_ps(hit)) & mask;
+        if (OrEqual) bits = ~bits & mask;
+        count += __builtin_popcount(bits);
+        if (bits != mask) return count;
+    }
+#elif defined(__SSE2__)
+    const int per_vec = 4 / lanes_per_entry;
+    const int mask = lanes_per_entry == 1 ? 0xF : (lanes_per_entry == 2 ? 0x5 : 0x1);
+    __m128i probe = _mm_set1_epi32((int)key);
+    for (; i + per_vec <= n; i += per_vec) {
+        __m128i v = _mm_loadu_si128((const __m128i*)((const char*)keys + i * Stride));
+        __m128i hit = OrEqual ? _mm_cmpgt_epi32(v, probe) : _mm_cmpgt_epi32(probe, v);
+        int bits = _mm_movemask_ps(_mm_castsi128_ps(hit)) & mask;
+        if (OrEqual) bits = ~bits & mask;
+        count += __builtin_popcount(bits);
+        if (bits != mask) return count;
+    }
+#endif
+    for (; i < n; ++i) {
+        const Key& k = node_key_at<Stride>(keys, i);
+        if (OrEqual ? key < k : !(k < key)) break;
+        ++count;
+    }
+    return count;
+}
+
+template <size_t Stride, bool OrEqual, typename Key>
+inline int node_simd_count(const Key* keys, int n, Key key, integral_constant<int, 8>) {
+    const int lanes_per_entry = Stride / sizeof(Key);
+    int count = 0, i = 0;
+#if defined(__AVX2__)
+    const int per_vec = 4 / lanes_per_entry;
+    const int mask = lanes_per_entry == 1 ? 0xF : (lanes_per_entry == 2 ? 0x5 : 0x1);
+    __m256i probe = _mm256_set1_epi64x((long long)key);
+    for (; i + per_vec <= n; i += per_vec) {
+        __m256i v = _mm256_loadu_si256((const __m256i*)((const char*)keys + i * Stride));
+        __m256i hit = OrEqual ? _mm256_cmpgt_epi64(v, probe) : _mm256_cmpgt_epi64(probe, v);
+        int bits = _mm256_movemask_pd(_mm256_castsi256_pd(hit)) & mask;
+        if (OrEqual) bits = ~bits & mask;
+        count += __builtin_popcount(bits);
+        if (bits != mask) return count;
+    }
+#elif defined(__SSE4_2__)
+    // one 128-bit vector holds two keys, or a single one when interleaved
+    const int per_vec = lanes_per_entry == 1 ? 2 : 1;
+    const int mask = lanes_per_entry == 1 ? 0x3 : 0x1;
+    __m128i probe = _mm_set1_epi64x((long long)key);
+    for (; i + per_vec <= n; i += per_vec) {
+        __m128i v = _mm_loadu_si128((const __m128i*)((const char*)keys + i * Stride));
+        __m128i hit = OrEqual ? _mm_cmpgt_epi64(v, probe) : _mm_cmpgt_epi64(probe, v);
+        int bits = _mm_movemask_pd(_mm_castsi128_pd(hit)) & mask;
+        if (OrEqual) bits = ~bits & mask;
+        count += __builtin_popcount(bits);
+        if (bits != mask) return count;
+    }
+#endif
+    for (; i < n; ++i) {
+        const Key& k = node_key_at<Stride>(keys, i);
+        if (OrEqual ? key < k : !(k < key)) break;
+        ++count;
+    }
+    return count;
+}
+
+// Count the keys less than (OrEqual: not greater than) the given key,
+// without SIMD.
+template <size_t Stride, bool OrEqual, typename Key, typename K, typename Compare>
+inline int node_scalar_count(const Key* keys, int n, const K& key, const Compare& comp) {
+    if (n <= NODE_SCAN_MAX_SCALAR) {
+        int i = 0;
+        while (i < n && (OrEqual ? !comp(key, node_key_at<Stride>(keys, i))
+                                 : comp(node_key_at<Stride>(keys, i), key))) {
+            ++i;
+        }
+        return i;
+    }
+    // Branchless binary search: the range halves every round no matter which
+    // side the key is on, and the compiler turns the select into a cmov.
+    int base = 0, len = n;
+    while (len > 1) {
+        int half = len / 2;
+        const Key& k = node_key_at<Stride>(keys, base + half);
+        bool right = OrEqual ? !comp(key, k) : comp(k, key);
+        base = right ? base + half : base;
+        len -= half;
+    }
+    const Key& k = node_key_at<Stride>(keys, base);
+    return base + (OrEqual ? !comp(key, k) : comp(k, key));
+}
+
+template <size_t Stride, bool OrEqual, typename Key, typename Compare>
+inline int node_count(const Key* keys, int n, const Key& key, const Compare& comp, true_type) {
+    if (n <= NODE_SCAN_MAX_SIMD) {
+        return node_simd_count<Stride, OrEqual>(keys, n, key, integral_constant<int, sizeof(Key)>());
+    }
+    return node_scalar_count<Stride, OrEqual>(keys, n, key, comp);
+}
+
+template <size_t Stride, bool OrEqual, typename Key, typename Compare>
+inline int node_count(const Key* keys, int n, const Key& key, const Compare& comp, false_type) {
+    return node_scalar_count<Stride, OrEqual>(keys, n, key, comp);
+}
+
+// index of the first key in keys[0..n) not less than key
+template <size_t Stride, typename Key, typename Compare>
+inline int node_lower_bound(const Key* keys, int n, const Key& key, const Compare& comp) {
+    return node_count<Stride, false>(keys, n, key, comp,
+        integral_constant<bool, NodeSimdScan<Stride, Key, Compare>::enabled>());
+}
+
+// index of the first key in keys[0..n) greater than key
+template <size_t Stride, typename Key, typename Compare>
+inline int node_upper_bound(const Key* keys, int n, const Key& key, const Compare& comp) {
+    return node_count<Stride, true>(keys, n, key, comp,
+        integral_constant<bool, NodeSimdScan<Stride, Key, Compare>::enabled>());
+}
+
+// the same for a key of another type K, which comp compares with Key
+template <size_t Stride, typename Key, typename K, typename Compare>
+inline int node_lower_bound(const Key* keys, int n, const K& key, const Compare& comp) {
+    return node_scalar_count<Stride, false>(keys, n, key, comp);
+}
+
+template <size_t Stride, typename Key, typename K, typename Compare>
+inline int node_upper_bound(const Key* keys, int n, const K& key, const Compare& comp) {
+    return node_scalar_count<Stride, true>(keys, n, key, comp);
+}
+
+#endif /* NodeSearch_hpp */
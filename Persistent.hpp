@@ -0,0 +1,475 @@
+#ifndef Persistent_hpp
+#define Persistent_hpp
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "BufferPool.hpp"
+#include "NodeSearch.hpp"
+#include "Sequential.hpp"
+
+using namespace std;
+
+// default # of frames in the buffer pool of a disk-backed tree
+const size_t DISK_POOL_PAGES = 1024;
+// a split pins the leaf, the new half and the right sibling, and the pool
+// needs room to bring the parent in besides
+const size_t DISK_MIN_POOL_PAGES = 8;
+// first bytes of the file, to refuse files that aren't a tree
+const char DISK_MAGIC[8] = {'B', 'P', 'T', 'R', 'E', 'E', '0', '1'};
+
+/*
+ * Page formats of DiskBPlusTree.
+ * A node is one page and refers to other nodes by page id instead of pointer,
+ * so the file can be opened again at any address. Page 0 holds the file
+ * header. Keys and references are kept in separate arrays like SPLIT_LAYOUT,
+ * so the search kernels scan the keys only.
+ * The capacity of a node follows from the page size, one entry is reserved
+ * for inserting into a full node before it's split, as in the in-memory nodes.
+ */
+struct DiskPageHeader {
+    uint32_t type;   // NodeType
+    int32_t size;    // # of seperators in internal nodes or values in leaves
+    page_id_t left_sibling;
+    page_id_t right_sibling;
+};
+
+template <typename Key, typename Value, size_t PageSize>
+struct DiskLeaf : DiskPageHeader {
+    // the room left for the arrays, minus the padding the value array may need
+    static const int order = (PageSize - sizeof(DiskPageHeader) - alignof(Value))
+                             / (sizeof(Key) + sizeof(Value));
+
+    Key keys[order];
+    Value values[order];
+
+    // the maximum num of values is order - 1
+    bool isFull() {
+        return size >= order - 1;
+    }
+};
+
+template <typename Key, size_t PageSize>
+struct DiskInternal : DiskPageHeader {
+    // keys[i] and children[i] form the i-th seperator-reference pair, children[size]
+    // is the dummy reference, one pair is reserved for the split
+    static const int order = (PageSize - sizeof(DiskPageHeader) - alignof(page_id_t))
+                             / (sizeof(Key) + sizeof(page_id_t)) - 1;
+
+    Key keys[order + 1];
+    page_id_t children[order + 1];
+
+    // the maximum num of seperators is order - 1
+    bool isFull() {
+        return size >= order - 1;
+    }
+};
+
+// page 0 of the file
+struct DiskFileHeader {
+    char magic[8];
+    uint32_t page_size;
+    uint32_t key_size;
+    uint32_t value_size;
+    page_id_t root;
+    int32_t depth;
+    page_id_t page_count; // pages in use, including this one
+};
+
+/*
+ * Disk-backed B+ Tree
+ * Key, Value: trivially copyable, they are stored in pages byte for byte
+ * Compare:    strict weak ordering of keys, as in SeqBPlusTree
+ * PageSize:   bytes per node, the order is derived from it
+ *
+ * The nodes live in a file and are reached through a bounded buffer pool, so
+ * the tree can be larger than memory, and opening an existing file only reads
+ * its header: the pages come in as lookups touch them.
+ * Every operation pins the pages it reads and unpins them before it returns.
+ * Modified pages are written back when evicted, and all of them together with
+ * the header by flush() or the destructor. A crash between two flushes can
+ * leave the file with some pages of the later state and some of the earlier.
+ *
+ * remove() takes the pair out of its leaf without borrowing or merging, so
+ * leaves may become underfull or empty; an empty leaf stays linked and is
+ * filled again by later inserts into its range.
+ * Not thread safe.
+ */
+template <typename Key, typename Value, typename Compare = less<Key>, size_t PageSize = PAGE_SIZE>
+class DiskBPlusTree {
+private:
+    typedef DiskLeaf<Key, Value, PageSize> Leaf;
+    typedef DiskInternal<Key, PageSize> InternalNode;
+
+    static_assert(is_trivially_copyable<Key>::value && is_trivially_copyable<Value>::value,
+                  "keys and values are stored in pages byte for byte");
+    static_assert(sizeof(Leaf) <= PageSize && sizeof(InternalNode) <= PageSize,
+                  "a node has to fit in a page");
+    static_assert(sizeof(DiskFileHeader) <= PageSize, "the file header has to fit in a page");
+    static_assert(Leaf::order >= 4 && InternalNode::order >= 4,
+                  "the page is too small for keys and values of this size");
+
+    // the internal nodes from the root down to a leaf, and the index of the
+    // reference followed in each of them, as in SeqBPlusTree
+    struct Path {
+        page_id_t nodes[MAX_TREE_DEPTH];
+        int index[MAX_TREE_DEPTH];
+        int depth;
+    };
+
+    PageFile file;
+    BufferPool pool;
+    Compare comp;
+    page_id_t root;
+    int depth;
+    page_id_t page_count;
+
+public:
+    // open the tree in the file at path, or create it if the file is empty
+    DiskBPlusTree(const string& path, size_t pool_pages = DISK_POOL_PAGES, const Compare& comp = Compare());
+    // flush, the file then holds the whole tree
+    ~DiskBPlusTree();
+    DiskBPlusTree(const DiskBPlusTree&) = delete;
+    DiskBPlusTree& operator=(const DiskBPlusTree&) = delete;
+
+    // search for the value relative to the given key, return not_found if not exists
+    Value search(const Key& key, const Value& not_found = Value(-1));
+    // return true: successfully insert a new key-value pair
+    // return false: key already exists, replace the previous with the new value
+    bool insert(const Key& key, const Value& value);
+    // return true if the key-value pair is successfully removed
+    // otherwise return false if the key doesn't exist
+    bool remove(const Key& key);
+    // the key-value pairs with keys in [lo, hi), in key order
+    vector<pair<Key, Value> > range(const Key& lo, const Key& hi);
+    // write every modified page and then the header back, and wait for the device
+    void flush();
+
+    // # of pages in the file, including the header
+    page_id_t pages() const {
+        return page_count;
+    }
+    // what flush() writes to page 0 for the current state
+    DiskFileHeader header() const {
+        DiskFileHeader header;
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, DISK_MAGIC, sizeof(DISK_MAGIC));
+        header.page_size = PageSize;
+        header.key_size = sizeof(Key);
+        header.value_size = sizeof(Value);
+        header.root = root;
+        header.depth = depth;
+        header.page_count = page_count;
+        return header;
+    }
+    // let a log follow the page changes, see BufferPool::set_hooks
+    void set_page_hooks(BufferPool::PageHook before_modify, BufferPool::PageHook before_write_back, void* context) {
+        pool.set_hooks(before_modify, before_write_back, context);
+    }
+    const BufferPool& buffer_pool() const {
+        return pool;
+    }
+    static int leaf_order() {
+        return Leaf::order;
+    }
+    static int internal_order() {
+        return InternalNode::order;
+    }
+
+// private helper functions
+private:
+    bool key_equal(const Key& a, const Key& b) {
+        return !comp(a, b) && !comp(b, a);
+    }
+    int leaf_lower_bound(Leaf* leaf, const Key& key) {
+        return node_lower_bound<sizeof(Key)>(leaf->keys, leaf->size, key, comp);
+    }
+    int child_index(InternalNode* node, const Key& key) {
+        return node_upper_bound<sizeof(Key)>(node->keys, node->size, key, comp);
+    }
+    // the leaf where the key possibly exists, pinned, record the path to it if asked
+    PageGuard leaf_search(const Key& key, Path* path = NULL);
+    // a new zeroed page at the end of the file, pinned
+    PageGuard new_page(NodeType type);
+    // split the current full leaf and insert a seperator into its parent
+    void split_leaf(PageGuard& curr_page, Path& path);
+    // insert a seperator into the parent at level and link to right_half,
+    // splitting the full internal nodes on the way up
+    void parent_insert(page_id_t curr_node, Key key, page_id_t right_half, Path& path, int level);
+    void read_header();
+    void write_header();
+};
+
+template <typename Key, typename Value, typename Compare, size_t PageSize>
+DiskBPlusTree<Key, Value, Compare, PageSize>::DiskBPlusTree(const string& path, size_t pool_pages, const Compare& comp)
+    : file(path, PageSize),
+      pool(file, PageSize, pool_pages < DISK_MIN_POOL_PAGES ? DISK_MIN_POOL_PAGES : pool_pages),
+      comp(comp) {
+    if (file.page_count() > 0) {
+        read_header();
+        return;
+    }
+    // at the beginning the root should be only a leaf
+    page_count = 1;
+    depth = 0;
+    PageGuard root_page = new_page(LEAF);
+    root = root_page.page_id();
+    root_page.release();
+    flush();
+}
+
+template <typename Key, typename Value, typename Compare, size_t PageSize>
+DiskBPlusTree<Key, Value, Compare, PageSize>::~DiskBPlusTree() {
+    try {
+        flush();
+    } catch (const exception& e) {
+        cerr << "Error: cannot flush the tree: " << e.what() << endl;
+    }
+}
+
+template <typename Key, typename Value, typename Compare, size_t PageSize>
+Value DiskBPlusTree<Key, Value, Compare, PageSize>::search(const Key& key, const Value& not_found) {
+    PageGuard page = leaf_search(key);
+    Leaf* leaf = page.as<Leaf>();
+    int i = leaf_lower_bound(leaf, key);
+    if (i < leaf->size && key_equal(key, leaf->keys[i])) {
+        return leaf->values[i];
+    }
+    return not_found;
+}
+
+template <typename Key, typename Value, typename Compare, size_t PageSize>
+bool DiskBPlusTree<Key, Value, Compare, PageSize>::insert(const Key& key, const Value& value) {
+    Path path;
+    PageGuard page = leaf_search(key, &path);
+    Leaf* leaf = page.as<Leaf>();
+    page.mark_dirty();
+    int i = leaf_lower_bound(leaf, key);
+    if (i < leaf->size && key_equal(key, leaf->keys[i])) {
+        leaf->values[i] = value;
+        return false;
+    }
+    // if the node is full, need to split after insertion
+    bool needSplit = leaf->isFull();
+    memmove(leaf->keys + i + 1, leaf->keys + i, (leaf->size - i) * sizeof(Key));
+    memmove(leaf->values + i + 1, leaf->values + i, (leaf->size - i) * sizeof(Value));
+    leaf->keys[i] = key;
+    leaf->values[i] = value;
+    leaf->size++;
+
+    if (needSplit) {
+        split_leaf(page, path);
+    }
+    return true;
+}
+
+template <typename Key, typename Value, typename Compare, size_t PageSize>
+bool DiskBPlusTree<Key, Value, Compare, PageSize>::remove(const Key& key) {
+    PageGuard page = leaf_search(key);
+    Leaf* leaf = page.as<Leaf>();
+    int i = leaf_lower_bound(leaf, key);
+    if (i == leaf->size || !key_equal(key, leaf->keys[i])) return false;
+
+    page.mark_dirty();
+    memmove(leaf->keys + i, leaf->keys + i + 1, (leaf->size - i - 1) * sizeof(Key));
+    memmove(leaf->values + i, leaf->values + i + 1, (leaf->size - i - 1) * sizeof(Value));
+    leaf->size--;
+    return true;
+}
+
+// descend once for lo, then walk the leaf chain until a key not less than hi
+template <typename Key, typename Value, typename Compare, size_t PageSize>
+vector<pair<Key, Value> > DiskBPlusTree<Key, Value, Compare, PageSize>::range(const Key& lo, const Key& hi) {
+    vector<pair<Key, Value> > result;
+    if (!comp(lo, hi)) return result;
+    PageGuard page = leaf_search(lo);
+    int i = leaf_lower_bound(page.as<Leaf>(), lo);
+    while (true) {
+        Leaf* leaf = page.as<Leaf>();
+        for (; i < leaf->size; ++i) {
+            if (!comp(leaf->keys[i], hi)) return result;
+            result.push_back(pair<Key, Value>(leaf->keys[i], leaf->values[i]));
+        }
+        if (leaf->right_sibling == INVALID_PAGE) return result;
+        page = PageGuard(pool, leaf->right_sibling);
+        i = 0;
+    }
+}
+
+template <typename Key, typename Value, typename Compare, size_t PageSize>
+void DiskBPlusTree<Key, Value, Compare, PageSize>::flush() {
+    pool.flush();
+    write_header();
+    file.sync();
+}
+
+/*
+ * Private helper functions
+ */
+// Descend from the root, keeping only the current node pinned. If path is
+// given push every internal node on the way and the index of the reference
+// followed in it.
+template <typename Key, typename Value, typename Compare, size_t PageSize>
+PageGuard DiskBPlusTree<Key, Value, Compare, PageSize>::leaf_search(const Key& key, Path* path) {
+    if (path) path->depth = 0;
+    PageGuard page(pool, root);
+    for (int level = 0; level < depth; ++level) {
+        InternalNode* curr_internal = page.as<InternalNode>();
+        int i = child_index(curr_internal, key);
+        if (path) {
+            path->nodes[path->depth] = page.page_id();
+            path->index[path->depth++] = i;
+        }
+        page = PageGuard(pool, curr_internal->children[i]);
+    }
+    return page;
+}
+
+template <typename Key, typename Value, typename Compare, size_t PageSize>
+PageGuard DiskBPlusTree<Key, Value, Compare, PageSize>::new_page(NodeType type) {
+    page_id_t id = page_count++;
+    PageGuard page(pool, id, pool.pin_new(id));
+    DiskPageHeader* node = page.as<DiskPageHeader>();
+    node->type = type;
+    node->size = 0;
+    node->left_sibling = node->right_sibling = INVALID_PAGE;
+    return page;
+}
+
+// split the current full leaf and insert a seperator into its parent
+template <typename Key, typename Value, typename Compare, size_t PageSize>
+void DiskBPlusTree<Key, Value, Compare, PageSize>::split_leaf(PageGuard& curr_page, Path& path) {
+    Leaf* curr_node = curr_page.as<Leaf>();
+    PageGuard right_page = new_page(LEAF);
+    Leaf* right_half = right_page.as<Leaf>();
+
+    int half = curr_node->size / 2;
+    right_half->size = curr_node->size - half;
+    memcpy(right_half->keys, curr_node->keys + half, right_half->size * sizeof(Key));
+    memcpy(right_half->values, curr_node->values + half, right_half->size * sizeof(Value));
+    curr_node->size = half;
+    Key medianKey = right_half->keys[0];
+
+    // update siblings, from right to left
+    if (INVALID_PAGE != curr_node->right_sibling) {
+        PageGuard next_page(pool, curr_node->right_sibling);
+        next_page.mark_dirty();
+        next_page.as<Leaf>()->left_sibling = right_page.page_id();
+    }
+    right_half->right_sibling = curr_node->right_sibling;
+    right_half->left_sibling  = curr_page.page_id();
+    curr_node->right_sibling  = right_page.page_id();
+
+    page_id_t left_id = curr_page.page_id(), right_id = right_page.page_id();
+    right_page.release();
+    curr_page.release();
+    parent_insert(left_id, medianKey, right_id, path, path.depth - 1);
+}
+
+// The same as SeqBPlusTree::parent_insert followed by split_internal, as a loop:
+// a full parent is split and its median goes one level up, until a parent
+// has room or a new root is added.
+template <typename Key, typename Value, typename Compare, size_t PageSize>
+void DiskBPlusTree<Key, Value, Compare, PageSize>::parent_insert(page_id_t curr_node, Key key, page_id_t right_half,
+                                                                 Path& path, int level) {
+    while (true) {
+        PageGuard parent_page;
+        int i;
+        // if the split node is root, we need to add a new root
+        if (level < 0) {
+            parent_page = new_page(INTERNAL);
+            root = parent_page.page_id();
+            depth++;
+            i = 0;
+        } else {
+            parent_page = PageGuard(pool, path.nodes[level]);
+            parent_page.mark_dirty();
+            i = path.index[level];
+        }
+        InternalNode* parent = parent_page.as<InternalNode>();
+        bool parent_split = parent->isFull();
+
+        // shift the reference to the current node and everything after it
+        // (including the dummy one) right, the new seperator takes its place
+        int moved = parent->size - i;
+        if (parent->size > 0) {
+            memmove(parent->keys + i + 1, parent->keys + i, moved * sizeof(Key));
+            memmove(parent->children + i + 1, parent->children + i, (moved + 1) * sizeof(page_id_t));
+        }
+        parent->keys[i]       = key;
+        parent->children[i]   = curr_node;
+        parent->children[i+1] = right_half;
+        parent->size++;
+        if (!parent_split) return;
+
+        // split the full parent, the reference of the median key becomes the
+        // dummy one of the left half
+        PageGuard right_page = new_page(INTERNAL);
+        InternalNode* right_node = right_page.as<InternalNode>();
+        int half = parent->size / 2;
+        right_node->size = parent->size - half - 1;
+        memcpy(right_node->keys, parent->keys + half + 1, right_node->size * sizeof(Key));
+        memcpy(right_node->children, parent->children + half + 1, (right_node->size + 1) * sizeof(page_id_t));
+        key = parent->keys[half];
+        parent->size = half;
+
+        if (INVALID_PAGE != parent->right_sibling) {
+            PageGuard next_page(pool, parent->right_sibling);
+            next_page.mark_dirty();
+            next_page.as<InternalNode>()->left_sibling = right_page.page_id();
+        }
+        right_node->right_sibling = parent->right_sibling;
+        right_node->left_sibling  = parent_page.page_id();
+        parent->right_sibling     = right_page.page_id();
+
+        curr_node = parent_page.page_id();
+        right_half = right_page.page_id();
+        --level;
+    }
+}
+
+template <typename Key, typename Value, typename Compare, size_t PageSize>
+void DiskBPlusTree<Key, Value, Compare, PageSize>::read_header() {
+    void* buf = NULL;
+    if (posix_memalign(&buf, PAGE_ALIGN, PageSize) != 0) throw bad_alloc();
+    file.read_page(0, (char*) buf);
+    DiskFileHeader header;
+    memcpy(&header, buf, sizeof(header));
+    free(buf);
+    if (memcmp(header.magic, DISK_MAGIC, sizeof(DISK_MAGIC)) != 0) {
+        throw runtime_error("DiskBPlusTree: not a tree file");
+    }
+    if (header.page_size != PageSize || header.key_size != sizeof(Key) || header.value_size != sizeof(Value)) {
+        throw runtime_error("DiskBPlusTree: the file was written with another page, key or value size");
+    }
+    root = header.root;
+    depth = header.depth;
+    page_count = header.page_count;
+}
+
+template <typename Key, typename Value, typename Compare, size_t PageSize>
+void DiskBPlusTree<Key, Value, Compare, PageSize>::write_header() {
+    void* buf = NULL;
+    if (posix_memalign(&buf, PAGE_ALIGN, PageSize) != 0) throw bad_alloc();
+    memset(buf, 0, PageSize);
+    DiskFileHeader curr_header = header();
+    memcpy(buf, &curr_header, sizeof(curr_header));
+    try {
+        file.write_page(0, (const char*) buf);
+    } catch (...) {
+        free(buf);
+        throw;
+    }
+    free(buf);
+}
+
+#endif /* Persistent_hpp */
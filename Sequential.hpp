@@ -2,16 +2,53 @@
 #define Sequential_hpp
 
 #include <algorithm>
-#include <climits>
-#include <iostream>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
 #include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <iterator>
+#include <new>
+#include <string>
+#include <type_traits>
+#include <utility>
 #include <vector>
 
+#include "NodePool.hpp"
+#include "NodeSearch.hpp"
+#include "Snapshot.hpp"
+#include "Stats.hpp"
+
 using namespace std;
 
-// tree brachning factor
+// default tree brachning factor
 const int ORDER = 4;
 
+// nodes start on a cache line so that the arrays inside keep their alignment
+const size_t CACHE_LINE_SIZE = 64;
+
+// # of lookups search_batch moves down the tree together
+const int SEARCH_BATCH_GROUP = 32;
+// search_batch prefetches at most this many cache lines of each node
+const size_t PREFETCH_MAX_LINES = 8;
+
+// ask for the first cache lines of a node, which hold the keys searched first
+template <typename NodeT>
+inline void prefetch_node(const NodeT* node) {
+    const size_t lines = (sizeof(NodeT) + CACHE_LINE_SIZE - 1) / CACHE_LINE_SIZE;
+    for (size_t i = 0; i < lines && i < PREFETCH_MAX_LINES; ++i) {
+        __builtin_prefetch((const char*)node + i * CACHE_LINE_SIZE);
+    }
+}
+
+// upper bound of the # of internal nodes from the root to a leaf
+// A non-root internal node has at least two references, so a tree this deep
+// would hold more than 2^63 leaves.
+const int MAX_TREE_DEPTH = 64;
+
 // two types of nodes:
 // internal node for search path guidance (seperator-reference pairs)
 // leaf for key-value pair storage
@@ -20,55 +57,118 @@ enum NodeType {
     LEAF
 };
 
+// how the entries are laid out in a node
+// PAIR_LAYOUT:  one array of key-value (key-reference) pairs
+// SPLIT_LAYOUT: separate cache-line aligned arrays of keys and of values
+//               (references), so a key scan only pulls the key cache lines
+enum NodeLayout {
+    PAIR_LAYOUT = 0,
+    SPLIT_LAYOUT
+};
+
 /*
  * self-defined data structures used in this class
+ * The node types carry no virtual functions (and no vtable pointer). Code that
+ * only holds a Node* dispatches on the type tag and casts to Leaf/InternalNode.
+ * Nodes don't point to their parents. The tree records the path from the root
+ * while descending and walks back up that path to split or rebalance.
  */
 struct Node {
     NodeType type;
     // int height;
     int size; // # of seperators in internal nodes or values in leaves
-    Node* parent;
     Node* left_sibling;
     Node* right_sibling;
     int id;
 
-    bool isRoot() {
-        return parent == NULL;
+    // Leaf and InternalNode also provide:
+    // bool isDeficient();     size is less than necessary, need to borrow or merge
+    // bool isNearDeficient(); will be deficient if a key gets removed
+    // void print(Node* parent); for debug
+
+    // plain operator new doesn't honor alignment beyond max_align_t before C++17
+    static void* operator new(size_t size) {
+        void* p = NULL;
+        if (posix_memalign(&p, CACHE_LINE_SIZE, size) != 0) throw bad_alloc();
+        return p;
     }
-    // the maximum num of seperators/values is ORDER - 1
-    bool isFull() {
-        return size >= ORDER - 1;
+    static void operator delete(void* p) {
+        free(p);
     }
-    virtual bool isDeficient() = 0; // size is less than necessary, need to borrow or merge
-    virtual bool isNearDeficient() = 0; // will be deficient if a key gets removed
-    virtual void print() = 0; // for debug
 };
 
+template <typename Key, typename Value>
 struct KeyValuePair {
-    int key;
-    int value;
+    Key key;
+    Value value;
 };
-struct Leaf : Node {
+
+// the key-value storage of a leaf, in either layout
+// key_stride: # of bytes between two successive keys, for the search kernels
+// shift_right(i, n, by): move the pairs in [i, n) to [i+by, n+by), a memmove
+//                        when the keys and values are trivially copyable
+template <typename Key, typename Value, int Order, NodeLayout Layout>
+struct LeafEntries;
+
+template <typename Key, typename Value, int Order>
+struct LeafEntries<Key, Value, Order, PAIR_LAYOUT> {
     // key-value pair
-    // should be ORDER - 1, but reserve one for inserting into a full leaf then split
-    KeyValuePair key_value[ORDER];
+    // should be Order - 1, but reserve one for inserting into a full leaf then split
+    KeyValuePair<Key, Value> key_value[Order];
+    static const size_t key_stride = sizeof(KeyValuePair<Key, Value>);
+
+    Key& key(int i) { return key_value[i].key; }
+    Value& value(int i) { return key_value[i].value; }
+    void shift_right(int i, int n, int by) {
+        copy_backward(key_value + i, key_value + n, key_value + n + by);
+    }
+};
 
+template <typename Key, typename Value, int Order>
+struct LeafEntries<Key, Value, Order, SPLIT_LAYOUT> {
+    // keys[i] and values[i] form the i-th key-value pair
+    // should be Order - 1, but reserve one for inserting into a full leaf then split
+    alignas(CACHE_LINE_SIZE) Key keys[Order];
+    alignas(CACHE_LINE_SIZE) Value values[Order];
+    static const size_t key_stride = sizeof(Key);
+
+    Key& key(int i) { return keys[i]; }
+    Value& value(int i) { return values[i]; }
+    void shift_right(int i, int n, int by) {
+        copy_backward(keys + i, keys + n, keys + n + by);
+        copy_backward(values + i, values + n, values + n + by);
+    }
+};
+
+template <typename Key, typename Value, int Order, NodeLayout Layout = PAIR_LAYOUT>
+struct Leaf : Node, LeafEntries<Key, Value, Order, Layout> {
     Leaf() {
         type = LEAF;
         size = 0;
-        parent = left_sibling = right_sibling = NULL;
+        left_sibling = right_sibling = NULL;
+    }
+
+    // the maximum num of values is Order - 1
+    bool isFull() {
+        return size >= Order - 1;
     }
 
     bool isDeficient() {
         // the critical value is actually floor(OEDER/2)
-        return size < ORDER / 2;
+        return size < Order / 2;
     }
 
     bool isNearDeficient() {
-        return size == ORDER / 2;
+        return size == Order / 2;
     }
 
-    void print() {
+    // copy the i-th key-value pair of a leaf into the j-th slot of this one
+    void copy_entry(int j, Leaf* from, int i) {
+        this->key(j)   = from->key(i);
+        this->value(j) = from->value(i);
+    }
+
+    void print(Node* parent) {
         if (parent) {
             printf("|ID: %2d, size: %d, parent: %2d, " , id, size, parent->id);
         } else {
@@ -85,50 +185,98 @@ struct Leaf : Node {
             printf("RSib: NULL");
         }
         for (int i = 0; i < size; ++i) {
-            printf(" (%d)key=%3d,value=%3d", i, key_value[i].key, key_value[i].value);
+            cout << " (" << i << ")key=" << setw(3) << this->key(i)
+                 << ",value=" << setw(3) << this->value(i);
         }
         cout << "|";
     }
 };
 
+template <typename Key>
 struct KeyReferencePair {
-    int key;
+    Key key;
     Node* reference;
 };
-struct InternalNode : Node {
+
+// the seperator-reference storage of an internal node, in either layout
+// key_stride: # of bytes between two successive seperators, for the search kernels
+// shift_right(i, n, by): move the pairs in [i, n) to [i+by, n+by)
+template <typename Key, int Order, NodeLayout Layout>
+struct InternalEntries;
+
+template <typename Key, int Order>
+struct InternalEntries<Key, Order, PAIR_LAYOUT> {
+    KeyReferencePair<Key> key_ref[Order+1];
+    static const size_t key_stride = sizeof(KeyReferencePair<Key>);
+
+    Key& key(int i) { return key_ref[i].key; }
+    Node*& child(int i) { return key_ref[i].reference; }
+    void shift_right(int i, int n, int by) {
+        copy_backward(key_ref + i, key_ref + n, key_ref + n + by);
+    }
+};
+
+template <typename Key, int Order>
+struct InternalEntries<Key, Order, SPLIT_LAYOUT> {
+    // keys[i] and children[i] form the i-th key-reference pair
+    alignas(CACHE_LINE_SIZE) Key keys[Order+1];
+    alignas(CACHE_LINE_SIZE) Node* children[Order+1];
+    static const size_t key_stride = sizeof(Key);
+
+    Key& key(int i) { return keys[i]; }
+    Node*& child(int i) { return children[i]; }
+    void shift_right(int i, int n, int by) {
+        copy_backward(keys + i, keys + n, keys + n + by);
+        copy_backward(children + i, children + n, children + n + by);
+    }
+};
+
+template <typename Key, int Order, NodeLayout Layout = PAIR_LAYOUT>
+struct InternalNode : Node, InternalEntries<Key, Order, Layout> {
     // seperators and references to children
-    // references[i]: the child node containing all elements *less* than seperators[i]
-    // Dummy seperator: seperators[size] = INT_MAX (not count in size)
-    // Should be ORDER (including the dummy), but reserve one for inserting into a full node then split
-    // Note an internal node is full if the size hits ORDER-1
-    KeyReferencePair key_ref[ORDER+1];
+    // child(i): the child node containing all elements *less* than key(i)
+    // Dummy seperator: the reference at child(size) holds everything not less
+    // than the last seperator, its key is never read (not count in size)
+    // Should be Order (including the dummy), but reserve one for inserting into a full node then split
+    // Note an internal node is full if the size hits Order-1
 
     InternalNode() {
         type = INTERNAL;
         size = 0;
-        parent = left_sibling = right_sibling = NULL;
-        key_ref[0].key = INT_MAX;
+        left_sibling = right_sibling = NULL;
     }
 
-    bool isDeficient() {
-        if (isRoot()) {
+    // the maximum num of seperators is Order - 1
+    bool isFull() {
+        return size >= Order - 1;
+    }
+
+    // nodes don't know whether they are the root, the caller tells
+    bool isDeficient(bool is_root = false) {
+        if (is_root) {
             return size < 1;
         } else {
             // count the numebr of references, which is the number of seperators+1
-            return size + 1 < ORDER / 2;
+            return size + 1 < Order / 2;
         }
     }
 
-    bool isNearDeficient() {
-        if (isRoot()) {
+    bool isNearDeficient(bool is_root = false) {
+        if (is_root) {
             return size == 1;
         } else {
             // count the numebr of references, which is the number of seperators+1
-            return size + 1 == ORDER / 2;
+            return size + 1 == Order / 2;
         }
     }
 
-    void print() {
+    // copy the i-th key-reference pair of a node into the j-th slot of this one
+    void copy_entry(int j, InternalNode* from, int i) {
+        this->key(j)   = from->key(i);
+        this->child(j) = from->child(i);
+    }
+
+    void print(Node* parent) {
         if (parent) {
             printf("|ID: %2d, size: %d, parent: %2d, ", id, size, parent->id);
         } else {
@@ -144,18 +292,82 @@ struct InternalNode : Node {
         } else {
             printf("RSib: NULL");
         }
-        for (int i = 0; i <= size; ++i) {
-            printf(" (%d)key=%3d,childID=%3d", i, key_ref[i].key, key_ref[i].reference->id);
+        for (int i = 0; i < size; ++i) {
+            cout << " (" << i << ")key=" << setw(3) << this->key(i);
+            printf(",childID=%3d", this->child(i)->id);
         }
+        printf(" (%d)key=  M,childID=%3d", size, this->child(size)->id);
         cout << "|";
     }
 };
 
+// The seperator put between two neighbouring leaves: any key s with
+// left_max < s <= right_min routes every key to the right leaf.
+// The default is right_min itself. Strings compared by less take the shortest
+// prefix of right_min that is still greater than left_max, so long keys with
+// a shared stem leave short seperators in the internal nodes (which are
+// cheaper to compare and, past the small-string buffer, to store).
+template <typename Key, typename Compare>
+struct SeperatorPolicy {
+    static Key between(const Key& /*left_max*/, const Key& right_min) {
+        return right_min;
+    }
+};
+
+template <typename CharT, typename Traits, typename Alloc>
+struct SeperatorPolicy<basic_string<CharT, Traits, Alloc>, less<basic_string<CharT, Traits, Alloc> > > {
+    typedef basic_string<CharT, Traits, Alloc> String;
+    // right_min up to and including the first character that differs from
+    // left_max, or one past left_max if that's a prefix of right_min
+    static String between(const String& left_max, const String& right_min) {
+        size_t i = 0;
+        while (i < left_max.size() && Traits::eq(left_max[i], right_min[i])) ++i;
+        return right_min.substr(0, i + 1);
+    }
+};
+
+// Derive the branching factor from a target node size in bytes at compile time,
+// e.g. SeqBPlusTree<int, int, OrderForNodeSize<int, int, 256>::value>.
+// A leaf holds Order key-value pairs and an internal node Order+1 key-reference
+// pairs (one reserved for the split), so take the smaller of the two orders
+// that fit. The order never drops below the default one.
+template <typename Key, typename Value, size_t NodeBytes>
+struct OrderForNodeSize {
+    static const size_t payload = NodeBytes > sizeof(Node) ? NodeBytes - sizeof(Node) : 0;
+    static const int leaf_order = payload / sizeof(KeyValuePair<Key, Value>);
+    static const int internal_order = (int)(payload / sizeof(KeyReferencePair<Key>)) - 1;
+    static const int fit_order = leaf_order < internal_order ? leaf_order : internal_order;
+    static const int value = fit_order > ORDER ? fit_order : ORDER;
+};
+
 /*
  * Sequential B+ Tree class
+ * Key:     ordered by Compare, needs to be copyable
+ * Value:   copyable
+ * Order:   branching factor, see OrderForNodeSize to derive it from a node size
+ * Compare: strict weak ordering of keys, equivalent keys are the same key
+ * Layout:  how the entries are laid out in the nodes, see NodeLayout
+ * NodeAllocator: creates and destroys the nodes, see NodePool.hpp
  */
+template <typename Key, typename Value, int Order = ORDER, typename Compare = less<Key>,
+          NodeLayout Layout = PAIR_LAYOUT,
+          template <typename, typename> class NodeAllocator = PooledNodeAllocator>
 class SeqBPlusTree {
 private:
+    typedef ::Leaf<Key, Value, Order, Layout> Leaf;
+    typedef ::InternalNode<Key, Order, Layout> InternalNode;
+
+    // the internal nodes from the root down to a leaf, and the index of the
+    // reference followed in each of them
+    // nodes[0] is the root, the parent of the leaf is nodes[depth-1]
+    struct Path {
+        InternalNode* nodes[MAX_TREE_DEPTH];
+        int index[MAX_TREE_DEPTH];
+        int depth;
+    };
+
+    static_assert(Order >= 4, "the rebalancing rules need at least two entries per half node");
+
     Node* root;
     int depth;
     int node_count; // # of nodes
@@ -169,199 +381,889 @@ private:
     // node id when the set is empty. Otherwise, extract an id from the set for
     // a newly created node.
     int id_accumulator;
+    // a leaf is rebalanced once a remove leaves it with fewer pairs than this,
+    // see set_merge_threshold
+    int min_leaf_pairs;
+    // the smallest key of the leaf compact() continues at, none at the start of a pass
+    // (a vector so that Key needn't be default constructible)
+    vector<Key> compact_cursor;
+    Compare comp;
+    NodeAllocator<Leaf, InternalNode> alloc;
+    // the event counters, empty unless BPLUSTREE_STATS is defined
+    TreeStatsCounters counters;
 
 public:
-    SeqBPlusTree();
+    /*
+     * Bidirectional iterator over the key-value pairs in key order.
+     * It walks the pairs of a leaf, then follows right_sibling (left_sibling)
+     * to the next (previous) leaf. The end iterator points to no leaf.
+     * Any insert or remove invalidates every iterator.
+     */
+    class iterator {
+    public:
+        typedef bidirectional_iterator_tag iterator_category;
+        typedef pair<Key, Value> value_type;
+        typedef ptrdiff_t difference_type;
+        typedef void pointer;
+        typedef pair<const Key&, Value&> reference;
+
+        iterator() : tree(NULL), leaf(NULL), idx(0) {}
+
+        const Key& key() const { return leaf->key(idx); }
+        Value& value() const { return leaf->value(idx); }
+        reference operator*() const { return reference(leaf->key(idx), leaf->value(idx)); }
+
+        iterator& operator++() {
+            if (++idx == leaf->size) {
+                leaf = (Leaf*) leaf->right_sibling;
+                idx = 0;
+            }
+            return *this;
+        }
+        iterator operator++(int) {
+            iterator old = *this;
+            ++*this;
+            return old;
+        }
+        // decrementing end() gives the last pair
+        iterator& operator--() {
+            if (leaf == NULL) {
+                leaf = tree->rightmost_leaf();
+                idx = leaf->size;
+            }
+            while (idx == 0) {
+                leaf = (Leaf*) leaf->left_sibling;
+                idx = leaf->size;
+            }
+            --idx;
+            return *this;
+        }
+        iterator operator--(int) {
+            iterator old = *this;
+            --*this;
+            return old;
+        }
+
+        bool operator==(const iterator& other) const {
+            return leaf == other.leaf && idx == other.idx;
+        }
+        bool operator!=(const iterator& other) const {
+            return !(*this == other);
+        }
+
+    private:
+        friend class SeqBPlusTree;
+        // the pair at index i of the leaf, or the first one of the next leaf if
+        // i is past the last pair of this one
+        iterator(SeqBPlusTree* tree, Leaf* leaf, int i) : tree(tree), leaf(leaf), idx(i) {
+            if (leaf != NULL && idx == leaf->size) {
+                this->leaf = (Leaf*) leaf->right_sibling;
+                idx = 0;
+            }
+        }
+
+        SeqBPlusTree* tree;
+        Leaf* leaf;
+        int idx;
+    };
+
+    // the pairs with keys in [lo, hi), usable in a range-based for loop
+    struct range_type {
+        iterator first, last;
+        iterator begin() const { return first; }
+        iterator end() const { return last; }
+    };
+
+    SeqBPlusTree(const Compare& comp = Compare());
+    // build the tree from the key-value pairs in [first, last), see bulk_load
+    template <typename ForwardIt>
+    SeqBPlusTree(ForwardIt first, ForwardIt last, double fill_factor = 1.0,
+                 const Compare& comp = Compare());
+    // free every node
+    ~SeqBPlusTree();
+    // a tree owns its nodes, so it can be moved but not copied
+    SeqBPlusTree(const SeqBPlusTree&) = delete;
+    SeqBPlusTree& operator=(const SeqBPlusTree&) = delete;
+    // take over the nodes of other in O(1), other is left an empty tree
+    // with a new root leaf, ready to be filled again
+    SeqBPlusTree(SeqBPlusTree&& other);
+    // free the nodes of this tree, then take over the ones of other, which
+    // is left empty as above
+    SeqBPlusTree& operator=(SeqBPlusTree&& other);
+    // remove every key-value pair, the root becomes an empty leaf again and
+    // the event counters start over
+    void clear();
+    // Replace the content of the tree with the key-value pairs in [first, last),
+    // e.g. the ones of a vector<pair<Key, Value> > or a map<Key, Value>.
+    // Sorted input is built bottom-up in one pass; unsorted input is copied and
+    // sorted first. If a key appears more than once the last value wins, like a
+    // sequence of inserts.
+    // fill_factor in (0, 1] is how full the nodes are packed: 1 leaves no room,
+    // so the next insert into a node splits it, a lower factor leaves room for
+    // later inserts. Nodes are never packed below the half full minimum.
+    template <typename ForwardIt>
+    void bulk_load(ForwardIt first, ForwardIt last, double fill_factor = 1.0);
     // print the node information by level for debug
     void print();
-    // search for the value relative to the given key, return -1 if not exists
-    int search(int key);
+    // Write the key-value pairs to path as a read-only snapshot, which
+    // SnapshotReader serves from mmap without loading it (see Snapshot.hpp).
+    // Keys and values have to be trivially copyable.
+    template <int LeafFanout = SNAPSHOT_LEAF_FANOUT, int InternalFanout = SNAPSHOT_INTERNAL_FANOUT,
+              SnapshotKeyEncoding Encoding = SNAPSHOT_PLAIN_KEYS>
+    void serialize(const string& path) {
+        write_snapshot<Key, Value, LeafFanout, InternalFanout, Encoding>(path, begin(), end(), distance(begin(), end()));
+    }
+    // search for the value relative to the given key, return not_found if not exists
+    // (see find to tell a missing key from one whose value is not_found)
+    Value search(const Key& key, const Value& not_found);
+    // the pair with the given key, end() if there is none
+    iterator find(const Key& key) {
+        return find_key(key);
+    }
+    // true if there is a pair with the given key
+    bool contains(const Key& key) {
+        return find_key(key) != end();
+    }
+    // Heterogeneous lookups: if Compare defines is_transparent and compares Key
+    // with K both ways, a key can be looked up as a K without building a Key
+    // first, e.g. a string key by a const char* or a string view.
+    template <typename K, typename C = Compare, typename = typename C::is_transparent>
+    iterator find(const K& key) {
+        return find_key(key);
+    }
+    template <typename K, typename C = Compare, typename = typename C::is_transparent>
+    bool contains(const K& key) {
+        return find_key(key) != end();
+    }
+    // search for n keys at once, out[i] is the value of keys[i] or not_found
+    void search_batch(const Key* keys, size_t n, Value* out, const Value& not_found);
+    void search_batch(const vector<Key>& keys, vector<Value>& out, const Value& not_found) {
+        out.resize(keys.size());
+        search_batch(keys.data(), keys.size(), out.data(), not_found);
+    }
     // return true: successfully insert a new key-value pair
     // return false: key already exists, replace the previous with the new value
-    bool insert(int key, int value);
+    bool insert(const Key& key, const Value& value);
+    // If the key is new, insert it with a value constructed from args,
+    // otherwise leave the tree (and args) alone.
+    // Return the pair of the key and true if it was inserted, with one descent.
+    template <typename... Args>
+    pair<iterator, bool> try_emplace(const Key& key, Args&&... args);
+    // Insert the key with the value, or assign the value to the pair of the
+    // key if it exists. Return the pair and true if the key was new.
+    template <typename M>
+    pair<iterator, bool> insert_or_assign(const Key& key, M&& value);
+    // Insert or update every key-value pair in [first, last) and return the #
+    // of keys that were new. Sorted input (e.g. a micro-batch of increasing
+    // time stamps) is taken as is, unsorted input is copied and sorted first.
+    // If a key appears more than once the last value wins.
+    // The pairs are grouped by the leaf they go to: each leaf is found with one
+    // descent, merged with all its new pairs in one pass, and split into as
+    // many leaves as needed at once.
+    template <typename ForwardIt>
+    size_t insert_batch(ForwardIt first, ForwardIt last);
     // return true if the key-value pair is successfully removed
     // otherwise return false if the key doesn't exist
-    bool remove(int key);
+    bool remove(const Key& key);
+    // A remove rebalances a leaf once it holds fewer than min_pairs pairs. The
+    // default Order/2 keeps every node at least half full, which may take a
+    // chain of borrows and merges up to the root. A lower threshold relaxes
+    // deletes: leaves may stay underfull (1: a leaf is only merged away once
+    // it's empty) and internal nodes are only rebalanced when they are down to
+    // a single reference, so deletes rarely touch more than one leaf and
+    // alternating inserts and removes around a node boundary no longer split
+    // and merge it over and over. compact() packs the nodes again later.
+    // min_pairs is clamped to [1, Order/2].
+    void set_merge_threshold(int min_pairs);
+    int merge_threshold() const {
+        return min_leaf_pairs;
+    }
+    // Refill or merge the leaves that are less than half full, e.g. after
+    // relaxed deletes, at most max_steps leaves (or rebalancing steps) per
+    // call. Each call continues where the previous one stopped, so a pass can
+    // be spread over idle time between operations. Return true once a pass
+    // over every leaf is complete, the next call starts a new one.
+    bool compact(size_t max_steps = SIZE_MAX);
+    // true if there is no key-value pair, O(1): only a root leaf can be empty
+    bool empty() const {
+        return LEAF == root->type && root->size == 0;
+    }
+    // # of nodes in the tree
+    int nodes() const {
+        return node_count;
+    }
+    // The depth, node counts and fill factor histograms, measured by visiting
+    // every node, and the event counters of every thread if the tree is
+    // compiled with BPLUSTREE_STATS, see Stats.hpp.
+    TreeStats stats() const;
+    // zero the event counters, while no other thread uses the tree
+    void reset_stats() {
+        counters.reset();
+    }
+
+    // the pair with the smallest key
+    iterator begin();
+    // past the pair with the largest key
+    iterator end() {
+        return iterator(this, NULL, 0);
+    }
+    // the first pair whose key is not less than key
+    iterator lower_bound(const Key& key);
+    // the first pair whose key is greater than key
+    iterator upper_bound(const Key& key);
+    // the same with a transparent comparator, see find
+    template <typename K, typename C = Compare, typename = typename C::is_transparent>
+    iterator lower_bound(const K& key) {
+        Leaf* leaf = leaf_search(key);
+        return iterator(this, leaf, leaf_lower_bound(leaf, key));
+    }
+    template <typename K, typename C = Compare, typename = typename C::is_transparent>
+    iterator upper_bound(const K& key) {
+        Leaf* leaf = leaf_search(key);
+        return iterator(this, leaf, leaf_upper_bound(leaf, key));
+    }
+    // the pairs whose keys are in [lo, hi), found with one descent
+    range_type range(const Key& lo, const Key& hi);
 
 // private helper functions
 private:
-    // return the leaf where the key possibly exists
-    Leaf* leaf_search(int key, Node* curr_node);
-    // sort the entries (key-value pairs or key-reference pairs) in the node by key
-    void sort_entry_by_key(Node* curr_node);
-    // return the min key stored in this subtree
-    int min_key_in_subtree(Node* curr_node);
+    // The lookup helpers take the key as any type K that comp compares with
+    // Key, which is Key itself unless a heterogeneous lookup is asked for.
+    // keys are the same if neither is less than the other
+    template <typename K>
+    bool key_equal(const K& a, const Key& b) {
+        return !comp(a, b) && !comp(b, a);
+    }
+    // index of the first key-value pair in the leaf whose key is not less than key
+    template <typename K>
+    int leaf_lower_bound(Leaf* leaf, const K& key) {
+        return node_lower_bound<Leaf::key_stride>(&leaf->key(0), leaf->size, key, comp);
+    }
+    // index of the first key-value pair in the leaf whose key is greater than key
+    template <typename K>
+    int leaf_upper_bound(Leaf* leaf, const K& key) {
+        return node_upper_bound<Leaf::key_stride>(&leaf->key(0), leaf->size, key, comp);
+    }
+    // index of the reference to follow for key, i.e. the first seperator greater
+    // than key, or the dummy reference at child(size) if there is none
+    template <typename K>
+    int child_index(InternalNode* node, const K& key) {
+        return node_upper_bound<InternalNode::key_stride>(&node->key(0), node->size, key, comp);
+    }
+    // return the leaf where the key possibly exists, record the path to it if asked
+    template <typename K>
+    Leaf* leaf_search(const K& key, Path* path = NULL);
+    // the pair with the given key, end() if there is none
+    template <typename K>
+    iterator find_key(const K& key) {
+        Leaf* leaf = leaf_search(key);
+        int i = leaf_lower_bound(leaf, key);
+        if (i < leaf->size && key_equal(key, leaf->key(i))) {
+            return iterator(this, leaf, i);
+        }
+        return end();
+    }
+    // Store a new pair at index i of the leaf at the end of the path, with the
+    // value constructed from args, and split the leaf if it overflows.
+    // Return where the pair ended up.
+    template <typename... Args>
+    iterator insert_at(Leaf* leaf, int i, Path& path, const Key& key, Args&&... args);
+    // The fence keys of the node below path.nodes[level] are the seperators
+    // around the reference followed: its keys are in [low_fence, high_fence).
+    // They are in path.nodes[level], or in an ancestor if the reference is the
+    // first (last) one; NULL if there is no bound on that side. Only nodes on
+    // the path are read, and the walk up rarely goes beyond one level.
+    Key* low_fence(Path& path, int level) {
+        while (level >= 0 && path.index[level] == 0) --level;
+        return level < 0 ? NULL : &path.nodes[level]->key(path.index[level] - 1);
+    }
+    Key* high_fence(Path& path, int level) {
+        while (level >= 0 && path.index[level] == path.nodes[level]->size) --level;
+        return level < 0 ? NULL : &path.nodes[level]->key(path.index[level]);
+    }
+    // the seperator between two neighbouring leaves, see SeperatorPolicy
+    Key seperator(const Key& left_max, const Key& right_min) {
+        return SeperatorPolicy<Key, Compare>::between(left_max, right_min);
+    }
+    // the leftmost (rightmost) leaf, where the smallest (largest) keys are
+    Leaf* leftmost_leaf();
+    Leaf* rightmost_leaf();
+    // create (destroy) a node through the allocator, counted in the statistics
+    Leaf* allocate_leaf() {
+        counters.add(STAT_LEAF_ALLOCATIONS);
+        return alloc.new_leaf();
+    }
+    InternalNode* allocate_internal() {
+        counters.add(STAT_INTERNAL_ALLOCATIONS);
+        return alloc.new_internal();
+    }
+    void free_leaf(Leaf* leaf) {
+        counters.add(STAT_NODE_FREES);
+        alloc.delete_leaf(leaf);
+    }
+    void free_internal(InternalNode* node) {
+        counters.add(STAT_NODE_FREES);
+        alloc.delete_internal(node);
+    }
+
+    // In the functions below, level is the position of the parent of the
+    // current node on the path, -1 if the current node is the root.
 
     // split the current full leaf and insert a value into its parent
-    void split_leaf(Leaf* curr_leaf);
+    void split_leaf(Leaf* curr_leaf, Path& path);
     // Used in split: insert a key into a node's parent and link to the newly split nodes (right_half)
-    void parent_insert(Node* curr_node, int key, Node* right_half);
+    void parent_insert(Node* curr_node, const Key& key, Node* right_half, Path& path, int level);
     // split the current full internal node and insert a value into its parent
-    void split_internal(InternalNode* curr_node);
+    void split_internal(InternalNode* curr_node, Path& path, int level);
     // recusively print the nodes by level
-    void print_recusive(vector<Node*> nodeVec);
-    // get the KeyReferencePair pointed to the current node from its parent
-    KeyReferencePair* get_key_ref_pair_from_parent(Node* curr_node);
+    void print_recusive(vector<Node*> nodeVec, vector<Node*> parentVec);
+    // print a node of either type
+    void print_node(Node* curr_node, Node* parent) {
+        if (LEAF == curr_node->type) {
+            ((Leaf*)curr_node)->print(parent);
+        } else {
+            ((InternalNode*)curr_node)->print(parent);
+        }
+    }
+    // Rebalancing moves entries between the current node and a sibling, which
+    // moves the seperator between them, i.e. one of its fence keys. That's the
+    // seperator in their first common ancestor, reached through the path in
+    // O(1). It also gives the seperators for the entries moved within internal
+    // nodes: a seperator is only a bound, the rotated one stays valid, so no
+    // subtree needs to be descended for its smallest key.
+
+    // deletes are relaxed, see set_merge_threshold
+    bool relaxed() const {
+        return min_leaf_pairs < Order / 2;
+    }
+    // an internal node that needs to borrow or merge, with relaxed deletes
+    // only a non-root node with a single reference left
+    bool internal_deficient(InternalNode* node, bool is_root) {
+        if (is_root || !relaxed()) return node->isDeficient(is_root);
+        return node->size == 0;
+    }
+    // Merge rather than borrow if the sibling can't spare an entry without
+    // becoming deficient itself, or, with relaxed deletes, whenever the two
+    // nodes fit into one: an underfull node filled up by one borrowed entry is
+    // soon back for more.
+    bool merge_leaves(Leaf* curr_leaf, Leaf* sibling) {
+        bool fits = curr_leaf->size + sibling->size <= Order - 1;
+        return fits && (relaxed() || sibling->size <= Order / 2);
+    }
+    // the same for internal nodes, counting references
+    bool merge_internals(InternalNode* curr_node, InternalNode* sibling) {
+        bool fits = curr_node->size + 1 + sibling->size + 1 <= Order;
+        return fits && (relaxed() || sibling->size + 1 <= Order / 2);
+    }
 
     // borrow from or merge to the left(right) sibling leaf
-    void borrow_merge_leaf(Leaf* curr_leaf);
+    void borrow_merge_leaf(Leaf* curr_leaf, Path& path, int level);
     // the current leaf borrows a key-value pair from its sibling
-    void borrow_leaf(Leaf* curr_leaf, Leaf* sibling, bool fromLeft);
+    void borrow_leaf(Leaf* curr_leaf, Leaf* sibling, bool fromLeft, Path& path, int level);
     // the current leaf merges to its sibling
-    void merge_leaf(Leaf* curr_leaf, Leaf* sibling, bool toLeft);
+    void merge_leaf(Leaf* curr_leaf, Leaf* sibling, bool toLeft, Path& path, int level);
 
     // borrow from or merge to the left(right) sibling internal node
-    void borrow_merge_internal(InternalNode* curr_node);
+    void borrow_merge_internal(InternalNode* curr_node, Path& path, int level);
     // the current node borrows a key-reference pair from its sibling
-    void borrow_internal(InternalNode* curr_leaf, InternalNode* sibling, bool fromLeft);
+    void borrow_internal(InternalNode* curr_leaf, InternalNode* sibling, bool fromLeft, Path& path, int level);
     // the current node merges to its sibling
-    void merge_internal(InternalNode* curr_leaf, InternalNode* sibling, bool toLeft);
+    void merge_internal(InternalNode* curr_leaf, InternalNode* sibling, bool toLeft, Path& path, int level);
+    // the root has a single reference left, make that child the new root
+    void collapse_root(Node* new_root);
+    // free every node in O(n), the tree is left without nodes
+    void destroy_nodes();
+    // return true if [first, last) is sorted by key, then n is the # of distinct keys
+    template <typename ForwardIt>
+    bool count_sorted_keys(ForwardIt first, ForwardIt last, size_t& n);
+    // stable sort of key-value pairs by key, so repeated keys keep their order
+    void sort_pairs(vector<pair<Key, Value> >& pairs) {
+        stable_sort(pairs.begin(), pairs.end(), [this](const pair<Key, Value>& a, const pair<Key, Value>& b) {
+            return comp(a.first, b.first);
+        });
+    }
+    // build the tree bottom-up from the n distinct keys in the sorted [first, last)
+    template <typename ForwardIt>
+    void bulk_build(ForwardIt first, ForwardIt last, size_t n, double fill_factor);
+    // insert_batch for sorted input
+    template <typename ForwardIt>
+    size_t insert_sorted_batch(ForwardIt first, ForwardIt last);
+    // merge the sorted pairs [first, last) into the leaf, return the # of new keys
+    // The result is left in merged, the leaf is unchanged.
+    template <typename ForwardIt>
+    size_t merge_into_leaf(Leaf* leaf, ForwardIt first, ForwardIt last, vector<pair<Key, Value> >& merged);
+    // # of nodes to spread n entries over, so that each holds about target
+    // entries and none holds fewer than min_size unless there is only one node
+    static size_t bulk_node_count(size_t n, size_t target, size_t min_size) {
+        size_t count = (n + target - 1) / target;
+        // as target >= min_size, one node less is always enough
+        if (count > 1 && n / count < min_size) --count;
+        return count;
+    }
+    // the # of entries per node for a fill factor, within [min_size, max_size]
+    static size_t bulk_target(double fill_factor, size_t min_size, size_t max_size) {
+        size_t target = (size_t)(fill_factor * max_size + 0.5);
+        if (target < min_size) target = min_size;
+        if (target > max_size) target = max_size;
+        return target;
+    }
 
 };
 
 // at the beginning the root should be only a leaf
-SeqBPlusTree::SeqBPlusTree() {
+template <typename Key, typename Value, int Order, typename Compare, NodeLayout Layout,
+          template <typename, typename> class NodeAllocator>
+SeqBPlusTree<Key, Value, Order, Compare, Layout, NodeAllocator>::SeqBPlusTree(const Compare& comp) : comp(comp) {
     // cout << "constructing SeqBPlusTree" << endl;
-    root = new Leaf();
+    root = allocate_leaf();
     depth = 0;
     node_count = 1;
     id_accumulator = 1;
     root->id = 1;
+    min_leaf_pairs = Order / 2;
     // cout << "construction end" << endl;
 }
 
-int SeqBPlusTree::search(int key) {
-    Leaf* leaf = leaf_search(key, root);
-    for (int i = 0; i < leaf->size; ++i) {
-        if (key == leaf->key_value[i].key) {
-            return leaf->key_value[i].value;
+template <typename Key, typename Value, int Order, typename Compare, NodeLayout Layout,
+          template <typename, typename> class NodeAllocator>
+template <typename ForwardIt>
+SeqBPlusTree<Key, Value, Order, Compare, Layout, NodeAllocator>::SeqBPlusTree(ForwardIt first, ForwardIt last,
+                                                                             double fill_factor, const Compare& comp)
+    : SeqBPlusTree(comp) {
+    bulk_load(first, last, fill_factor);
+}
+
+template <typename Key, typename Value, int Order, typename Compare, NodeLayout Layout,
+          template <typename, typename> class NodeAllocator>
+SeqBPlusTree<Key, Value, Order, Compare, Layout, NodeAllocator>::~SeqBPlusTree() {
+    destroy_nodes();
+}
+
+template <typename Key, typename Value, int Order, typename Compare, NodeLayout Layout,
+          template <typename, typename> class NodeAllocator>
+SeqBPlusTree<Key, Value, Order, Compare, Layout, NodeAllocator>::SeqBPlusTree(SeqBPlusTree&& other)
+    : root(other.root), depth(other.depth), node_count(other.node_count),
+      id_accumulator(other.id_accumulator), min_leaf_pairs(other.min_leaf_pairs),
+      compact_cursor(std::move(other.compact_cursor)), comp(other.comp), alloc(std::move(other.alloc)),
+      counters(std::move(other.counters)) {
+    // leave other as a valid empty tree, its nodes are ours now
+    other.root = NULL;
+    other.node_count = 0;
+    other.clear();
+}
+
+template <typename Key, typename Value, int Order, typename Compare, NodeLayout Layout,
+          template <typename, typename> class NodeAllocator>
+SeqBPlusTree<Key, Value, Order, Compare, Layout, NodeAllocator>&
+SeqBPlusTree<Key, Value, Order, Compare, Layout, NodeAllocator>::operator=(SeqBPlusTree&& other) {
+    if (this == &other) return *this;
+    destroy_nodes();
+    root = other.root;
+    depth = other.depth;
+    node_count = other.node_count;
+    id_accumulator = other.id_accumulator;
+    min_leaf_pairs = other.min_leaf_pairs;
+    compact_cursor = std::move(other.compact_cursor);
+    comp = other.comp;
+    alloc = std::move(other.alloc);
+    counters = std::move(other.counters);
+    // leave other as a valid empty tree, its nodes are ours now
+    other.root = NULL;
+    other.node_count = 0;
+    other.clear();
+    return *this;
+}
+
+template <typename Key, typename Value, int Order, typename Compare, NodeLayout Layout,
+          template <typename, typename> class NodeAllocator>
+void SeqBPlusTree<Key, Value, Order, Compare, Layout, NodeAllocator>::clear() {
+    destroy_nodes();
+    counters.reset();
+    root = allocate_leaf();
+    depth = 0;
+    node_count = 1;
+    id_accumulator = 1;
+    root->id = 1;
+    compact_cursor.clear();
+}
+
+template <typename Key, typename Value, int Order, typename Compare, NodeLayout Layout,
+          template <typename, typename> class NodeAllocator>
+Value SeqBPlusTree<Key, Value, Order, Compare, Layout, NodeAllocator>::search(const Key& key, const Value& not_found) {
+    Leaf* leaf = leaf_search(key);
+    int i = leaf_lower_bound(leaf, key);
+    if (i < leaf->size && key_equal(key, leaf->key(i))) {
+        return leaf->value(i);
+    }
+    return not_found;
+}
+
+// The lookups are taken SEARCH_BATCH_GROUP at a time and moved down the tree
+// together, one level per round. Every lookup picks its child in the current
+// node and prefetches it, so by the time the round comes back to it for the
+// next level the node is likely in cache. One lookup would instead stall on
+// every level waiting for the node from memory.
+// All leaves are at the same depth, so the lookups reach them in the same round.
+template <typename Key, typename Value, int Order, typename Compare, NodeLayout Layout,
+          template <typename, typename> class NodeAllocator>
+void SeqBPlusTree<Key, Value, Order, Compare, Layout, NodeAllocator>::search_batch(const Key* keys, size_t n, Value* out, const Value& not_found) {
+    Node* curr_nodes[SEARCH_BATCH_GROUP];
+    for (size_t base = 0; base < n; base += SEARCH_BATCH_GROUP) {
+        int group = n - base < (size_t)SEARCH_BATCH_GROUP ? (int)(n - base) : SEARCH_BATCH_GROUP;
+        for (int q = 0; q < group; ++q) {
+            curr_nodes[q] = root;
+        }
+        counters.add_descents(group, (uint64_t) group * (depth + 1));
+        for (int level = 0; level < depth; ++level) {
+            bool next_is_leaf = level == depth - 1;
+            for (int q = 0; q < group; ++q) {
+                InternalNode* curr_internal = (InternalNode*) curr_nodes[q];
+                Node* next_node = curr_internal->child(child_index(curr_internal, keys[base + q]));
+                if (next_is_leaf) {
+                    prefetch_node((Leaf*) next_node);
+                } else {
+                    prefetch_node((InternalNode*) next_node);
+                }
+                curr_nodes[q] = next_node;
+            }
+        }
+        for (int q = 0; q < group; ++q) {
+            Leaf* leaf = (Leaf*) curr_nodes[q];
+            const Key& key = keys[base + q];
+            int i = leaf_lower_bound(leaf, key);
+            if (i < leaf->size && key_equal(key, leaf->key(i))) {
+                out[base + q] = leaf->value(i);
+            } else {
+                out[base + q] = not_found;
+            }
         }
     }
-    return -1;
 }
 
 // return true: insert a new key-value pair
 // return false: key already exists, replace the previous with the new value
-bool SeqBPlusTree::insert(int key, int value) {
-    Leaf* leaf = leaf_search(key, root);
-    for (int i = 0; i < leaf->size; ++i) {
-        if (key == leaf->key_value[i].key) {
-            leaf->key_value[i].value = value;
-            return false;
-        }
+template <typename Key, typename Value, int Order, typename Compare, NodeLayout Layout,
+          template <typename, typename> class NodeAllocator>
+bool SeqBPlusTree<Key, Value, Order, Compare, Layout, NodeAllocator>::insert(const Key& key, const Value& value) {
+    Path path;
+    Leaf* leaf = leaf_search(key, &path);
+    int i = leaf_lower_bound(leaf, key);
+    if (i < leaf->size && key_equal(key, leaf->key(i))) {
+        leaf->value(i) = value;
+        return false;
     }
-    // if the node is full, need to split after insertion
-    bool needSplit = leaf->isFull();
-    leaf->key_value[leaf->size].key = key;
-    leaf->key_value[leaf->size++].value = value;
-    sort_entry_by_key(leaf);
+    insert_at(leaf, i, path, key, value);
+    return true;
+}
 
-    if (needSplit) {
-        split_leaf(leaf);
+template <typename Key, typename Value, int Order, typename Compare, NodeLayout Layout,
+          template <typename, typename> class NodeAllocator>
+template <typename... Args>
+pair<typename SeqBPlusTree<Key, Value, Order, Compare, Layout, NodeAllocator>::iterator, bool>
+SeqBPlusTree<Key, Value, Order, Compare, Layout, NodeAllocator>::try_emplace(const Key& key, Args&&... args) {
+    Path path;
+    Leaf* leaf = leaf_search(key, &path);
+    int i = leaf_lower_bound(leaf, key);
+    if (i < leaf->size && key_equal(key, leaf->key(i))) {
+        return make_pair(iterator(this, leaf, i), false);
     }
+    return make_pair(insert_at(leaf, i, path, key, std::forward<Args>(args)...), true);
+}
 
-    return true;
+template <typename Key, typename Value, int Order, typename Compare, NodeLayout Layout,
+          template <typename, typename> class NodeAllocator>
+template <typename M>
+pair<typename SeqBPlusTree<Key, Value, Order, Compare, Layout, NodeAllocator>::iterator, bool>
+SeqBPlusTree<Key, Value, Order, Compare, Layout, NodeAllocator>::insert_or_assign(const Key& key, M&& value) {
+    Path path;
+    Leaf* leaf = leaf_search(key, &path);
+    int i = leaf_lower_bound(leaf, key);
+    if (i < leaf->size && key_equal(key, leaf->key(i))) {
+        leaf->value(i) = std::forward<M>(value);
+        return make_pair(iterator(this, leaf, i), false);
+    }
+    return make_pair(insert_at(leaf, i, path, key, std::forward<M>(value)), true);
 }
 
 // return true if the key-value pair is successfully removed
 // otherwise return false if the key doesn't exist
-bool SeqBPlusTree::remove(int key) {
-    Leaf* leaf = leaf_search(key, root);
-    if (leaf->size == 0) {
-        cerr << "Error: Trying to remove from an empty tree." << endl;
-        return false;
+template <typename Key, typename Value, int Order, typename Compare, NodeLayout Layout,
+          template <typename, typename> class NodeAllocator>
+bool SeqBPlusTree<Key, Value, Order, Compare, Layout, NodeAllocator>::remove(const Key& key) {
+    Path path;
+    Leaf* leaf = leaf_search(key, &path);
+    // nothing to remove, e.g. the tree is empty
+    if (leaf->size == 0) return false;
+
+    int i = leaf_lower_bound(leaf, key);
+    bool keyNotExist = i == leaf->size || !key_equal(key, leaf->key(i));
+    if (keyNotExist) return false;
+
+    // move the successive key-value forward
+    for (int j = i; j < leaf->size - 1; ++j) {
+        leaf->copy_entry(j, leaf, j+1);
     }
+    leaf->size--;
+    // cout << "Leaf ID: " << leaf->id << endl;
 
-    bool keyNotExist = true;
-    for (int i = 0; i < leaf->size; ++i) {
-        if (key == leaf->key_value[i].key) {
-            keyNotExist = false;
-            // move the successive key-value forward
-            for (int j = i; j < leaf->size - 1; ++j) {
-                leaf->key_value[j] = leaf->key_value[j+1];
+    // a leaf as the root has no sibling to borrow from or merge to,
+    // it is allowed to hold any number of key-value pairs
+    if (path.depth > 0 && leaf->size < min_leaf_pairs) {
+        borrow_merge_leaf(leaf, path, path.depth - 1);
+    }
+    return true;
+}
+
+template <typename Key, typename Value, int Order, typename Compare, NodeLayout Layout,
+          template <typename, typename> class NodeAllocator>
+void SeqBPlusTree<Key, Value, Order, Compare, Layout, NodeAllocator>::set_merge_threshold(int min_pairs) {
+    if (min_pairs < 1) min_pairs = 1;
+    if (min_pairs > Order / 2) min_pairs = Order / 2;
+    min_leaf_pairs = min_pairs;
+}
+
+// The pass walks the leaves from left to right, remembering where it is by the
+// smallest key of the current leaf: the leaves themselves may be freed between
+// two calls. A leaf less than half full borrows from or merges with a sibling
+// (see borrow_merge_leaf) until it's at least half full or gone, then the pass
+// moves on to its right sibling. The leaves behind the cursor stay at least
+// half full: a sibling on the left only lends what it can spare.
+// Internal nodes are rebalanced as the merges below them require.
+template <typename Key, typename Value, int Order, typename Compare, NodeLayout Layout,
+          template <typename, typename> class NodeAllocator>
+bool SeqBPlusTree<Key, Value, Order, Compare, Layout, NodeAllocator>::compact(size_t max_steps) {
+    if (compact_cursor.empty()) {
+        Leaf* first = leftmost_leaf();
+        if (depth == 0 || first->size == 0) return true;
+        compact_cursor.push_back(first->key(0));
+    }
+    for (size_t step = 0; step < max_steps; ++step) {
+        Path path;
+        Leaf* leaf = leaf_search(compact_cursor[0], &path);
+        if (path.depth > 0 && leaf->isDeficient()) {
+            // the merged leaf still holds the key, so the next step finds it again
+            borrow_merge_leaf(leaf, path, path.depth - 1);
+            continue;
+        }
+        Leaf* next = (Leaf*) leaf->right_sibling;
+        if (next == NULL) {
+            compact_cursor.clear();
+            return true;
+        }
+        compact_cursor[0] = next->key(0);
+    }
+    return false;
+}
+
+// Walk the tree level by level like destroy_nodes: the nodes on a level are
+// chained by right_sibling.
+template <typename Key, typename Value, int Order, typename Compare, NodeLayout Layout,
+          template <typename, typename> class NodeAllocator>
+TreeStats SeqBPlusTree<Key, Value, Order, Compare, Layout, NodeAllocator>::stats() const {
+    TreeStats result;
+    result.depth = depth;
+    Node* level = root;
+    while (level != NULL) {
+        Node* next_level = NULL;
+        if (INTERNAL == level->type) {
+            next_level = ((InternalNode*)level)->child(0);
+        }
+        for (Node* curr_node = level; curr_node != NULL; curr_node = curr_node->right_sibling) {
+            if (LEAF == curr_node->type) {
+                ++result.leaves;
+                result.pairs += curr_node->size;
+                ++result.leaf_fill[stats_fill_bucket(curr_node->size, Order - 1)];
+            } else {
+                // counting the dummy reference
+                ++result.internal_nodes;
+                ++result.internal_fill[stats_fill_bucket(curr_node->size + 1, Order)];
             }
-            leaf->size--;
-            // cout << "Leaf ID: " << leaf->id << endl;
-            break;
         }
+        level = next_level;
     }
+    counters.snapshot(result);
+    return result;
+}
 
-    if (keyNotExist) return false;
+template <typename Key, typename Value, int Order, typename Compare, NodeLayout Layout,
+          template <typename, typename> class NodeAllocator>
+typename SeqBPlusTree<Key, Value, Order, Compare, Layout, NodeAllocator>::iterator
+SeqBPlusTree<Key, Value, Order, Compare, Layout, NodeAllocator>::begin() {
+    return iterator(this, leftmost_leaf(), 0);
+}
 
-    if (leaf->isDeficient()) {
-        borrow_merge_leaf(leaf);
+// the first pair not less than key is in the leaf the key would be in, or it's
+// the first pair of the next leaf
+template <typename Key, typename Value, int Order, typename Compare, NodeLayout Layout,
+          template <typename, typename> class NodeAllocator>
+typename SeqBPlusTree<Key, Value, Order, Compare, Layout, NodeAllocator>::iterator
+SeqBPlusTree<Key, Value, Order, Compare, Layout, NodeAllocator>::lower_bound(const Key& key) {
+    Leaf* leaf = leaf_search(key);
+    return iterator(this, leaf, leaf_lower_bound(leaf, key));
+}
+
+template <typename Key, typename Value, int Order, typename Compare, NodeLayout Layout,
+          template <typename, typename> class NodeAllocator>
+typename SeqBPlusTree<Key, Value, Order, Compare, Layout, NodeAllocator>::iterator
+SeqBPlusTree<Key, Value, Order, Compare, Layout, NodeAllocator>::upper_bound(const Key& key) {
+    Leaf* leaf = leaf_search(key);
+    return iterator(this, leaf, leaf_upper_bound(leaf, key));
+}
+
+// Descend once for lo, then walk the leaf chain up to the first key not less
+// than hi, checking only the last key of each leaf on the way.
+template <typename Key, typename Value, int Order, typename Compare, NodeLayout Layout,
+          template <typename, typename> class NodeAllocator>
+typename SeqBPlusTree<Key, Value, Order, Compare, Layout, NodeAllocator>::range_type
+SeqBPlusTree<Key, Value, Order, Compare, Layout, NodeAllocator>::range(const Key& lo, const Key& hi) {
+    range_type result;
+    result.first = lower_bound(lo);
+    if (result.first == end() || !comp(result.first.key(), hi)) {
+        result.last = result.first;
+        return result;
     }
-    return true;
+    Leaf* leaf = result.first.leaf;
+    while (leaf->right_sibling != NULL && comp(leaf->key(leaf->size - 1), hi)) {
+        leaf = (Leaf*) leaf->right_sibling;
+    }
+    result.last = iterator(this, leaf, leaf_lower_bound(leaf, hi));
+    return result;
 }
 
-void SeqBPlusTree::print() {
-    vector<Node*> rootVec;
+template <typename Key, typename Value, int Order, typename Compare, NodeLayout Layout,
+          template <typename, typename> class NodeAllocator>
+template <typename ForwardIt>
+void SeqBPlusTree<Key, Value, Order, Compare, Layout, NodeAllocator>::bulk_load(ForwardIt first, ForwardIt last, double fill_factor) {
+    size_t n;
+    if (count_sorted_keys(first, last, n)) {
+        bulk_build(first, last, n, fill_factor);
+        return;
+    }
+    vector<pair<Key, Value> > pairs(first, last);
+    sort_pairs(pairs);
+    count_sorted_keys(pairs.begin(), pairs.end(), n);
+    bulk_build(pairs.begin(), pairs.end(), n, fill_factor);
+}
+
+template <typename Key, typename Value, int Order, typename Compare, NodeLayout Layout,
+          template <typename, typename> class NodeAllocator>
+template <typename ForwardIt>
+size_t SeqBPlusTree<Key, Value, Order, Compare, Layout, NodeAllocator>::insert_batch(ForwardIt first, ForwardIt last) {
+    size_t n;
+    if (count_sorted_keys(first, last, n)) {
+        return insert_sorted_batch(first, last);
+    }
+    vector<pair<Key, Value> > pairs(first, last);
+    sort_pairs(pairs);
+    return insert_sorted_batch(pairs.begin(), pairs.end());
+}
+
+template <typename Key, typename Value, int Order, typename Compare, NodeLayout Layout,
+          template <typename, typename> class NodeAllocator>
+void SeqBPlusTree<Key, Value, Order, Compare, Layout, NodeAllocator>::print() {
+    vector<Node*> rootVec, parentVec;
     rootVec.push_back(root);
-    print_recusive(rootVec);
+    parentVec.push_back(NULL);
+    print_recusive(rootVec, parentVec);
 }
 
 /*
  * Private helper functions
  */
-// return the leaf where the key possibly exists
-Leaf* SeqBPlusTree::leaf_search(int key, Node* curr_node) {
-    if (LEAF == curr_node->type) {
-        return (Leaf*) curr_node;
+// The value is constructed from args before the leaf is touched, so the leaf
+// stays as it was if that throws, then moved into the slot at i once the pairs
+// are shifted.
+template <typename Key, typename Value, int Order, typename Compare, NodeLayout Layout,
+          template <typename, typename> class NodeAllocator>
+template <typename... Args>
+typename SeqBPlusTree<Key, Value, Order, Compare, Layout, NodeAllocator>::iterator
+SeqBPlusTree<Key, Value, Order, Compare, Layout, NodeAllocator>::insert_at(Leaf* leaf, int i, Path& path,
+                                                                          const Key& key, Args&&... args) {
+    Value value(std::forward<Args>(args)...);
+    // if the node is full, need to split after insertion
+    bool needSplit = leaf->isFull();
+    // i is already the slot of the key, make room there
+    leaf->shift_right(i, leaf->size, 1);
+    leaf->value(i) = std::move(value);
+    leaf->key(i) = key;
+    leaf->size++;
+
+    if (needSplit) {
+        split_leaf(leaf, path);
+        // the leaf keeps the lower half
+        if (i >= leaf->size) {
+            i -= leaf->size;
+            leaf = (Leaf*) leaf->right_sibling;
+        }
     }
-    InternalNode* curr_internal = (InternalNode*) curr_node;
-    for (int i = 0; i < curr_internal->size; ++i) {
-        if (key < curr_internal->key_ref[i].key) {
-            return leaf_search(key, curr_internal->key_ref[i].reference);
+    return iterator(this, leaf, i);
+}
+
+// return the leaf where the key possibly exists
+// Descend from the root, if path is given push every internal node on the way
+// and the index of the reference followed in it.
+template <typename Key, typename Value, int Order, typename Compare, NodeLayout Layout,
+          template <typename, typename> class NodeAllocator>
+template <typename K>
+typename SeqBPlusTree<Key, Value, Order, Compare, Layout, NodeAllocator>::Leaf*
+SeqBPlusTree<Key, Value, Order, Compare, Layout, NodeAllocator>::leaf_search(const K& key, Path* path) {
+    Node* curr_node = root;
+    if (path) path->depth = 0;
+    while (LEAF != curr_node->type) {
+        InternalNode* curr_internal = (InternalNode*) curr_node;
+        // follow the first seperator greater than the key, if the key is lager
+        // than every seperator, the only possible location is in the dummy reference
+        int i = child_index(curr_internal, key);
+        if (path) {
+            path->nodes[path->depth] = curr_internal;
+            path->index[path->depth++] = i;
         }
+        curr_node = curr_internal->child(i);
     }
-    // if the key is lager than every seperator, the only possible location
-    // is in the dummy reference
-    return leaf_search(key, curr_internal->key_ref[curr_internal->size].reference);
+    counters.add_descents(1, depth + 1);
+    return (Leaf*) curr_node;
 }
 
-// sort the entries (key-value pairs or key-reference pairs) in the node by key
-void SeqBPlusTree::sort_entry_by_key(Node* curr_node) {
-    if (LEAF == curr_node->type) {
-        Leaf* curr_leaf = (Leaf*)curr_node;
-        sort(curr_leaf->key_value, curr_leaf->key_value + curr_leaf->size,
-            [](KeyValuePair a, KeyValuePair b) {
-                return a.key < b.key;
-            });
-    } else {
-        InternalNode* curr_internal = (InternalNode*)curr_node;
-        // need to +1 because there is a dummy key INT_MAX at key_ref[size]
-        sort(curr_internal->key_ref, curr_internal->key_ref + curr_internal->size+1,
-            [](KeyReferencePair a, KeyReferencePair b) {
-                return a.key < b.key;
-            });
+// the leftmost leaf, where the smallest keys are
+template <typename Key, typename Value, int Order, typename Compare, NodeLayout Layout,
+          template <typename, typename> class NodeAllocator>
+typename SeqBPlusTree<Key, Value, Order, Compare, Layout, NodeAllocator>::Leaf*
+SeqBPlusTree<Key, Value, Order, Compare, Layout, NodeAllocator>::leftmost_leaf() {
+    Node* curr_node = root;
+    while (LEAF != curr_node->type) {
+        curr_node = ((InternalNode*)curr_node)->child(0);
     }
-    return;
+    return (Leaf*) curr_node;
 }
 
-// return the min key stored in this subtree
-int SeqBPlusTree::min_key_in_subtree(Node* curr_node) {
+// the rightmost leaf, where the largest keys are
+template <typename Key, typename Value, int Order, typename Compare, NodeLayout Layout,
+          template <typename, typename> class NodeAllocator>
+typename SeqBPlusTree<Key, Value, Order, Compare, Layout, NodeAllocator>::Leaf*
+SeqBPlusTree<Key, Value, Order, Compare, Layout, NodeAllocator>::rightmost_leaf() {
+    Node* curr_node = root;
     while (LEAF != curr_node->type) {
-        curr_node = ((InternalNode*)curr_node)->key_ref[0].reference;
+        curr_node = ((InternalNode*)curr_node)->child(curr_node->size);
     }
-    return ((Leaf*)curr_node)->key_value[0].key;
+    return (Leaf*) curr_node;
 }
 
 // split the current full leaf and insert a value to its parrent
-void SeqBPlusTree::split_leaf(Leaf* curr_node) {
-    if (curr_node == NULL || LEAF != curr_node->type || !curr_node->isFull()) {
-        cerr << "Not a valid leaf or the leaf is not full." << endl;
-        return;
-    }
+template <typename Key, typename Value, int Order, typename Compare, NodeLayout Layout,
+          template <typename, typename> class NodeAllocator>
+void SeqBPlusTree<Key, Value, Order, Compare, Layout, NodeAllocator>::split_leaf(Leaf* curr_node, Path& path) {
+    assert(curr_node != NULL && LEAF == curr_node->type && curr_node->isFull());
 
-    Leaf* right_half = new Leaf();
+    counters.add_split(0);
+    Leaf* right_half = allocate_leaf();
     for (int i = curr_node->size/2, j = 0; i < curr_node->size; ++i, ++j) {
-        right_half->key_value[j] = curr_node->key_value[i];
+        right_half->copy_entry(j, curr_node, i);
         right_half->size++;
     }
     right_half->id = ++id_accumulator;
     ++node_count;
 
-    int medianKey = curr_node->key_value[curr_node->size/2].key;
+    Key medianKey = seperator(curr_node->key(curr_node->size/2 - 1), curr_node->key(curr_node->size/2));
     curr_node->size = curr_node->size/2;
 
     // update siblings, from right to left
@@ -372,72 +1274,76 @@ void SeqBPlusTree::split_leaf(Leaf* curr_node) {
     right_half->left_sibling  = curr_node;
     curr_node->right_sibling  = right_half;
 
-    parent_insert(curr_node, medianKey, right_half);
+    parent_insert(curr_node, medianKey, right_half, path, path.depth - 1);
 
     return;
 }
 
 // Used in split: insert a key into a node's parent and link to the newly split nodes (right_half)
-void SeqBPlusTree::parent_insert(Node* curr_node, int key, Node* right_half) {
-    InternalNode* parent = (InternalNode*) curr_node->parent;
+template <typename Key, typename Value, int Order, typename Compare, NodeLayout Layout,
+          template <typename, typename> class NodeAllocator>
+void SeqBPlusTree<Key, Value, Order, Compare, Layout, NodeAllocator>::parent_insert(Node* curr_node, const Key& key, Node* right_half, Path& path, int level) {
+    InternalNode* parent;
+    int i;
     // if the split node is root, we need to add a new root
-    if (parent == NULL) {
-        parent = new InternalNode();
+    if (level < 0) {
+        counters.add(STAT_ROOT_GROWTHS);
+        parent = allocate_internal();
         depth++;
         parent->id = ++id_accumulator;
         node_count++;
         root = parent;
+        i = 0;
+    } else {
+        parent = path.nodes[level];
+        i = path.index[level];
     }
     // if parent is full, we need to split the parent afterwards
     bool parent_split = parent->isFull();
 
-    // ++ first because there is a dummy key INT_MAX at key_ref[size]
-    parent->key_ref[++(parent->size)].key 	= key;
-    parent->key_ref[parent->size].reference = curr_node;
-    sort_entry_by_key(parent);
-    // Search for the first key-reference pair whose key is greater than the
-    // inserted key, this pair is also pointed to the current node
-    // Now redirect it to the right.
-    // Need to use <= because also need to check the dummy key INT_MAX at key_ref[size]
-    for (int i = 0; i <= parent->size; ++i) {
-        if (key < parent->key_ref[i].key) {
-            parent->key_ref[i].reference = right_half;
-            break;
-        }
+    // i is the reference to the current node (maybe the dummy one at child(size)).
+    // Shift it and everything after it one slot right, including the dummy
+    // reference which has no key, then the new seperator takes its place and
+    // points to the current node, while the shifted reference is redirected
+    // to the right.
+    if (parent->size > 0) {
+        parent->child(parent->size + 1) = parent->child(parent->size);
+        parent->shift_right(i, parent->size, 1);
     }
-    curr_node->parent  = parent;
-    right_half->parent = parent;
+    parent->key(i)     = key;
+    parent->child(i)   = curr_node;
+    parent->child(i+1) = right_half;
+    parent->size++;
 
     // if parent is full, we need to split the parent
     if (parent_split) {
-        split_internal(parent);
+        split_internal(parent, path, level - 1);
     }
 
     return;
 }
 
 // split the current full internal node and insert a value into its parent
-void SeqBPlusTree::split_internal(InternalNode* curr_node) {
-    if (curr_node == NULL || !curr_node->isFull()) {
-        cerr << "Not a valid node or the node is not full." << endl;
-        return;
-    }
-
-    InternalNode* right_half = new InternalNode();
-    // Need to use <= because we also want to copy the dummy key INT_MAX at key_ref[size]
+template <typename Key, typename Value, int Order, typename Compare, NodeLayout Layout,
+          template <typename, typename> class NodeAllocator>
+void SeqBPlusTree<Key, Value, Order, Compare, Layout, NodeAllocator>::split_internal(InternalNode* curr_node, Path& path, int level) {
+    assert(curr_node != NULL && curr_node->isFull());
+
+    // the node is at path.nodes[level + 1], its height counts from the leaves
+    counters.add_split(depth - level - 1);
+    InternalNode* right_half = allocate_internal();
+    // Need to use <= because we also want to copy the dummy reference at child(size)
     for (int i = curr_node->size/2 + 1, j = 0; i <= curr_node->size; ++i, ++j) {
-        right_half->key_ref[j] = curr_node->key_ref[i];
+        right_half->copy_entry(j, curr_node, i);
         right_half->size++;
-        Node* child = curr_node->key_ref[i].reference;
-        child->parent = right_half;
     }
-    right_half->size--; // -1 because there is a dummy key INT_MAX at key_ref[size]
+    right_half->size--; // -1 because there is a dummy reference at child(size)
     right_half->id = ++id_accumulator;
     ++node_count;
 
-    int medianKey = curr_node->key_ref[curr_node->size/2].key;
+    // the reference of the median key becomes the dummy one of the left half
+    Key medianKey = curr_node->key(curr_node->size/2);
     curr_node->size = curr_node->size / 2;
-    curr_node->key_ref[curr_node->size].key = INT_MAX;
 
     // update siblings, from right to left
     if (NULL != curr_node->right_sibling) {
@@ -447,53 +1353,37 @@ void SeqBPlusTree::split_internal(InternalNode* curr_node) {
     right_half->left_sibling  = curr_node;
     curr_node->right_sibling  = right_half;
 
-    parent_insert(curr_node, medianKey, right_half);
+    parent_insert(curr_node, medianKey, right_half, path, level);
 
     return;
 }
 
 // recusively print the nodes by level
-void SeqBPlusTree::print_recusive(vector<Node*> nodeVec) {
-    vector<Node*> nextLevel;
+template <typename Key, typename Value, int Order, typename Compare, NodeLayout Layout,
+          template <typename, typename> class NodeAllocator>
+void SeqBPlusTree<Key, Value, Order, Compare, Layout, NodeAllocator>::print_recusive(vector<Node*> nodeVec, vector<Node*> parentVec) {
+    vector<Node*> nextLevel, nextParents;
     bool hit_leaves = LEAF == nodeVec.front()->type;
     for (int i = 0; i < nodeVec.size(); ++i) {
-        nodeVec.at(i)->print();
+        print_node(nodeVec.at(i), parentVec.at(i));
         // cout << " ";
         cout << endl;
         if (hit_leaves) continue;
         for(int j = 0; j <= nodeVec.at(i)->size; ++j) {
-            nextLevel.push_back( ((InternalNode*)nodeVec.at(i))->key_ref[j].reference);
+            nextLevel.push_back( ((InternalNode*)nodeVec.at(i))->child(j));
+            nextParents.push_back(nodeVec.at(i));
         }
     }
     cout << endl;
     if (hit_leaves) return;
-    print_recusive(nextLevel);
-}
-
-KeyReferencePair* SeqBPlusTree::get_key_ref_pair_from_parent(Node* curr_node) {
-    if (curr_node == NULL) {
-        cerr << "Not a valid node." << endl;
-        return NULL;
-    }
-    InternalNode* parent = (InternalNode*) curr_node->parent;
-    if (parent == NULL) {
-        cerr << "Parent is NULL." << endl;
-        return NULL;
-
-    }
-
-    for (int i = 0; i <= parent->size; ++i) {
-        if (curr_node == parent->key_ref[i].reference) {
-            return &parent->key_ref[i];
-        }
-    }
-    return NULL;
+    print_recusive(nextLevel, nextParents);
 }
 
 // Borrow from or merge to the left(right) sibling
 // The rule is as follows:
 // If the left sibling exists, first try to borrow the largest key-value pair from it.
-// If the sibling is also close to deficient, merge the two leaves by appending the
+// If the sibling is also close to deficient (or, with relaxed deletes, whenever
+// both fit into one leaf, see merge_leaves), merge the two leaves by appending the
 // key-values from the current leaf to that sibling. Then delete the current leaf
 // and shift other leaves with the same parent left and update the parent accordingly.
 // Note the two leaves may not be in the same subtree, borrowing or merging may
@@ -501,23 +1391,25 @@ KeyReferencePair* SeqBPlusTree::get_key_ref_pair_from_parent(Node* curr_node) {
 // If the left sibling doesn't exist, i.e. the current leaf is the leftmost one,
 // do the same process to the right sibling, except that we borrow the smallest
 // key-value pair from the right sibling.
-void SeqBPlusTree::borrow_merge_leaf(Leaf* curr_leaf) {
+template <typename Key, typename Value, int Order, typename Compare, NodeLayout Layout,
+          template <typename, typename> class NodeAllocator>
+void SeqBPlusTree<Key, Value, Order, Compare, Layout, NodeAllocator>::borrow_merge_leaf(Leaf* curr_leaf, Path& path, int level) {
     Leaf* left_sib = (Leaf*)curr_leaf->left_sibling;
     if (left_sib) { // left sibling exists
         // if the left sibling is not close to deficient, we can borrow one
-        if ( ! (left_sib->isDeficient() || left_sib->isNearDeficient() ) ) {
-            borrow_leaf(curr_leaf, left_sib, true);
+        if (!merge_leaves(curr_leaf, left_sib)) {
+            borrow_leaf(curr_leaf, left_sib, true, path, level);
         }
         else {
-            merge_leaf(curr_leaf, left_sib, true);
+            merge_leaf(curr_leaf, left_sib, true, path, level);
         }
     } else { // left sibling doesn't exist, turn to right
         Leaf* right_sib = (Leaf*)curr_leaf->right_sibling;
-        if ( ! (right_sib->isDeficient() || right_sib->isNearDeficient() ) ) {
-            borrow_leaf(curr_leaf, right_sib, false);
+        if (!merge_leaves(curr_leaf, right_sib)) {
+            borrow_leaf(curr_leaf, right_sib, false, path, level);
         }
         else {
-            merge_leaf(curr_leaf, right_sib, false);
+            merge_leaf(curr_leaf, right_sib, false, path, level);
         }
     }
     return;
@@ -528,120 +1420,93 @@ void SeqBPlusTree::borrow_merge_leaf(Leaf* curr_leaf) {
 // sibling, borrow the smallest. Then update the reference to the current leaf
 // but no need to update the reference to the sibling as the remaining keys are
 // smaller than the key in the key-reference pair from the parent.
-void SeqBPlusTree::borrow_leaf(Leaf* curr_leaf, Leaf* sibling, bool fromLeft) {
-    int borrowed_key = -1;
+template <typename Key, typename Value, int Order, typename Compare, NodeLayout Layout,
+          template <typename, typename> class NodeAllocator>
+void SeqBPlusTree<Key, Value, Order, Compare, Layout, NodeAllocator>::borrow_leaf(Leaf* curr_leaf, Leaf* sibling, bool fromLeft, Path& path, int level) {
+    counters.add(STAT_LEAF_BORROWS);
     if (fromLeft) { // borrow from left sibling
-        curr_leaf->key_value[curr_leaf->size++] = sibling->key_value[--(sibling->size)];
-        borrowed_key = curr_leaf->key_value[curr_leaf->size-1].key;
-        sort_entry_by_key(curr_leaf);
+        // the borrowed pair is smaller than any in curr_leaf
+        curr_leaf->shift_right(0, curr_leaf->size++, 1);
+        curr_leaf->copy_entry(0, sibling, --(sibling->size));
     }
     else { // borrow from right sibling
-        curr_leaf->key_value[curr_leaf->size++] = sibling->key_value[0];
-        borrowed_key = curr_leaf->key_value[curr_leaf->size-1].key;
+        curr_leaf->copy_entry(curr_leaf->size++, sibling, 0);
         // move sibling's successive key-value forward
         for (int i = 0; i < sibling->size - 1; ++i) {
-            sibling->key_value[i] = sibling->key_value[i+1];
+            sibling->copy_entry(i, sibling, i+1);
         }
         sibling->size--;
     }
     // Also need to update the reference in the firsr common ancestor because
     // borrowing may affect branching at that node. Note the borrowed key will
     // become the minimum key (from left) or the maximum key (from right) in the
-    // subtree where curr_leaf lies.
+    // subtree where curr_leaf lies, so it moves the low (high) fence key.
     if (fromLeft) {
-        Node *last_leaf_iter = curr_leaf, *last_sib_iter = sibling;
-        Node *leaf_iter = curr_leaf->parent, *sib_iter = sibling->parent;
-        while (leaf_iter != sib_iter) {
-            last_leaf_iter = leaf_iter;
-            leaf_iter = leaf_iter->parent;
-            last_sib_iter = sib_iter;
-            sib_iter = sib_iter->parent;
-        }
-        KeyReferencePair* key_ref_to_sib_in_ancestor =
-            get_key_ref_pair_from_parent(last_sib_iter);
-        key_ref_to_sib_in_ancestor->key = borrowed_key;
+        *low_fence(path, level) = seperator(sibling->key(sibling->size - 1), curr_leaf->key(0));
     }
     else {
         // Borrowing from right only happens if curr_leaf is the leftmost one,
         // and the branching factor is at least two, so it must share the same
         // parent with its right sibling.
-        KeyReferencePair* key_ref_to_curr_in_parent =
-            get_key_ref_pair_from_parent(curr_leaf);
-        key_ref_to_curr_in_parent->key = sibling->key_value[0].key;
+        *high_fence(path, level) = seperator(curr_leaf->key(curr_leaf->size - 1), sibling->key(0));
     }
 
     return;
 }
 
 // the current leaf merges with its sibling
-void SeqBPlusTree::merge_leaf(Leaf* curr_leaf, Leaf* sibling, bool toLeft) {
-    InternalNode* parent = (InternalNode*)curr_leaf->parent;
+template <typename Key, typename Value, int Order, typename Compare, NodeLayout Layout,
+          template <typename, typename> class NodeAllocator>
+void SeqBPlusTree<Key, Value, Order, Compare, Layout, NodeAllocator>::merge_leaf(Leaf* curr_leaf, Leaf* sibling, bool toLeft, Path& path, int level) {
+    counters.add(STAT_LEAF_MERGES);
+    InternalNode* parent = path.nodes[level];
     if (toLeft) { // merge to left sibling
         Leaf* left_sib = sibling;
-        KeyReferencePair* key_ref_to_curr_in_parent =
-            get_key_ref_pair_from_parent(curr_leaf);
-        bool curr_parent_is_dummy = INT_MAX == key_ref_to_curr_in_parent->key;
+        int idx = path.index[level];
+        bool curr_parent_is_dummy = idx == parent->size;
 
         for (int i = 0; i < curr_leaf->size; ++i) {
-            left_sib->key_value[left_sib->size + i] = curr_leaf->key_value[i];
+            left_sib->copy_entry(left_sib->size + i, curr_leaf, i);
         }
         left_sib->size += curr_leaf->size;
 
-        // find the key_ref pair in the parent of curr_leaf and remove it by
-        // moving its successive key-ref pairs forward.
-        // Use <= because also need to check the dummy key INT_MAX at key_ref[size]
-        int idx;
-        for (idx = 0; idx <= parent->size; ++idx) {
-            if (parent->key_ref[idx].reference == curr_leaf) break;
-        }
-        for (int i = idx; i < parent->size; ++i) {
-            parent->key_ref[i] = parent->key_ref[i+1];
-        }
-        parent->size--;
-
-        // Also redirect siblings.
-        left_sib->right_sibling = curr_leaf->right_sibling;
-        if (NULL != curr_leaf->right_sibling)
-            curr_leaf->right_sibling->left_sibling = left_sib;
-
         // The effect of merging to left is the same as borrowing from left so
         // we need to update the reference in the first common ancestor.
-        Node *last_leaf_iter = curr_leaf, *last_sib_iter = left_sib;
-        Node *leaf_iter = curr_leaf->parent, *sib_iter = left_sib->parent;
-        while (leaf_iter != sib_iter) {
-            last_leaf_iter = leaf_iter;
-            leaf_iter = leaf_iter->parent;
-            last_sib_iter = sib_iter;
-            sib_iter = sib_iter->parent;
-        }
-        KeyReferencePair* key_ref_to_sib_in_ancestor =
-            get_key_ref_pair_from_parent(last_sib_iter);
         // curr_leaf may be the rightmost one under its parent so its left sibling
         // must share the same parent with it and after merging the left sibling
-        // will become the rightmost one.
-        if (curr_parent_is_dummy) {
-            key_ref_to_sib_in_ancestor->key = INT_MAX;
-        }
-        else {
+        // will become the rightmost one, i.e. the dummy reference whose key is unused.
+        if (!curr_parent_is_dummy) {
             // Merging to the left sibling is the same as the left sibling borrowing
-            // from curr_leaf. Note the smallest key in the right after merging is
-            // the first key in the right sibling of curr_leaf.
+            // from curr_leaf. The merged leaf now reaches up to the high fence
+            // key of curr_leaf, which becomes its seperator from the right sibling.
+            // Copy it before it's removed from the parent below.
             // Also note if the left sibling and curr_leaf don't share the same parent,
             // the left sibling must be the rightmost one in its subtree whereas the
             // curr_node is the leftmost one. So the reference to the left sibling is
-            // the dummy one with key INT_MAX.
-            Leaf* right_sib = (Leaf*) curr_leaf->right_sibling;
-            int min_key_right = right_sib->key_value[0].key;
-            key_ref_to_sib_in_ancestor->key = min_key_right;
+            // the dummy one.
+            *low_fence(path, level) = *high_fence(path, level);
+        }
+
+        // remove the key_ref pair in the parent of curr_leaf by moving its
+        // successive key-ref pairs forward.
+        for (int i = idx; i < parent->size; ++i) {
+            parent->copy_entry(i, parent, i+1);
         }
+        parent->size--;
+
+        // Also redirect siblings.
+        left_sib->right_sibling = curr_leaf->right_sibling;
+        if (NULL != curr_leaf->right_sibling)
+            curr_leaf->right_sibling->left_sibling = left_sib;
     }
     else { // merge to right sibling
         Leaf* right_sib = sibling;
+        // the pairs of curr_leaf are smaller than any in right_sib, put them in front
+        right_sib->shift_right(0, right_sib->size, curr_leaf->size);
         for (int i = 0; i < curr_leaf->size; ++i) {
-            right_sib->key_value[right_sib->size + i] = curr_leaf->key_value[i];
+            right_sib->copy_entry(i, curr_leaf, i);
         }
         right_sib->size += curr_leaf->size;
-        sort_entry_by_key(right_sib);
 
         // As merge to right only happens if the curr_leaf is the leftmost one,
         // and the branching factor is at least two, so it must share the same
@@ -649,7 +1514,7 @@ void SeqBPlusTree::merge_leaf(Leaf* curr_leaf, Leaf* sibling, bool toLeft) {
         // modify any reference above, only needs to modify the references in
         // the parent.
         for (int i = 0; i < parent->size; ++i) {
-            parent->key_ref[i] = parent->key_ref[i+1];
+            parent->copy_entry(i, parent, i+1);
         }
         parent->size--;
 
@@ -658,10 +1523,14 @@ void SeqBPlusTree::merge_leaf(Leaf* curr_leaf, Leaf* sibling, bool toLeft) {
     }
 
     node_count--;
-    delete curr_leaf;
+    free_leaf(curr_leaf);
 
-    if (parent->isDeficient()) {
-        borrow_merge_internal(parent);
+    if (internal_deficient(parent, level == 0)) {
+        if (level == 0) {
+            collapse_root(sibling);
+        } else {
+            borrow_merge_internal(parent, path, level - 1);
+        }
     }
 }
 
@@ -669,7 +1538,8 @@ void SeqBPlusTree::merge_leaf(Leaf* curr_leaf, Leaf* sibling, bool toLeft) {
 // The rule is as follows:
 // If the left sibling exists, first try to borrow the largest key-reference pair
 // from it. This borrowing will cause inserting a new key-reference to the current node.
-// If the sibling is also close to deficient, merge the two nodes by appending the
+// If the sibling is also close to deficient (or, with relaxed deletes, whenever
+// both fit into one node), merge the two nodes by appending the
 // key-references from the current node to that sibling. Then delete the current node
 // and update the references in the parent accordingly.
 // Note the two internal nodes may not be in the same subtree, borrowing or merging
@@ -677,23 +1547,25 @@ void SeqBPlusTree::merge_leaf(Leaf* curr_leaf, Leaf* sibling, bool toLeft) {
 // If the left sibling doesn't exist, i.e. the current node is the leftmost, do the
 // same process to the right sibling, except that we try borrowing the smallest
 // key-reference pair.
-void SeqBPlusTree::borrow_merge_internal(InternalNode* curr_node) {
+template <typename Key, typename Value, int Order, typename Compare, NodeLayout Layout,
+          template <typename, typename> class NodeAllocator>
+void SeqBPlusTree<Key, Value, Order, Compare, Layout, NodeAllocator>::borrow_merge_internal(InternalNode* curr_node, Path& path, int level) {
     InternalNode* left_sib = (InternalNode*) curr_node->left_sibling;
     if (left_sib) { // left sibling exists
         // if the left sibling is not close to deficient, we can borrow one
-        if ( ! (left_sib->isDeficient() || left_sib->isNearDeficient() ) ) {
-            borrow_internal(curr_node, left_sib, true);
+        if (!merge_internals(curr_node, left_sib)) {
+            borrow_internal(curr_node, left_sib, true, path, level);
         }
         else {
-            merge_internal(curr_node, left_sib, true);
+            merge_internal(curr_node, left_sib, true, path, level);
         }
     } else { // left sibling doesn't exist, turn to right
         InternalNode* right_sib = (InternalNode*) curr_node->right_sibling;
-        if ( ! (right_sib->isDeficient() || right_sib->isNearDeficient() ) ) {
-            borrow_internal(curr_node, right_sib, false);
+        if (!merge_internals(curr_node, right_sib)) {
+            borrow_internal(curr_node, right_sib, false, path, level);
         }
         else {
-            merge_internal(curr_node, right_sib, false);
+            merge_internal(curr_node, right_sib, false, path, level);
         }
     }
     return;
@@ -704,89 +1576,95 @@ void SeqBPlusTree::borrow_merge_internal(InternalNode* curr_node) {
 // sibling, borrow the smallest. Then update the reference to the current leaf
 // but no need to update the reference to the sibling as the remaining keys are
 // smaller than the key in the key-reference pair from the parent.
-void SeqBPlusTree::borrow_internal(InternalNode* curr_node, InternalNode* sibling, bool fromLeft) {
+template <typename Key, typename Value, int Order, typename Compare, NodeLayout Layout,
+          template <typename, typename> class NodeAllocator>
+void SeqBPlusTree<Key, Value, Order, Compare, Layout, NodeAllocator>::borrow_internal(InternalNode* curr_node, InternalNode* sibling, bool fromLeft, Path& path, int level) {
+    counters.add(STAT_INTERNAL_BORROWS);
     Node* borrowed_node = NULL;
     if (fromLeft) { // borrow from left sibling
         InternalNode* left_sibling = sibling;
-        borrowed_node = left_sibling->key_ref[left_sibling->size].reference;
-        // ++ first because there is a dummy key INT_MAX at key_ref[size]
-        curr_node->key_ref[++curr_node->size] = left_sibling->key_ref[left_sibling->size--];
-        // borrowed one is a dummy reference with key = INT_MAX, so need to modify
-        // its key to the smallest key in the first reference
-        curr_node->key_ref[curr_node->size].key = min_key_in_subtree(curr_node);
-        sort_entry_by_key(curr_node);
-        // set the key of the last key-reference pair to INT_MAX
-        left_sibling->key_ref[left_sibling->size].key = INT_MAX;
+        borrowed_node = left_sibling->child(left_sibling->size);
+        // The borrowed reference becomes the first one and its seperator is the
+        // low fence key, which bounds the previous first reference from the
+        // left. Shift the key-reference pairs right to make room, <= because
+        // the dummy at child(size) moves too.
+        for (int i = curr_node->size; i >= 0; --i) {
+            curr_node->copy_entry(i+1, curr_node, i);
+        }
+        curr_node->key(0)       = *low_fence(path, level);
+        curr_node->child(0) = borrowed_node;
+        curr_node->size++;
 
         // Also need to update the reference in the first common ancestor because
-        // borrowing may affect branching at that node. Note the borrowed key will
-        // become the minimum key in the subtree where curr_node lies.
-        Node *last_node_iter = curr_node, *last_sib_iter = left_sibling;
-        Node *node_iter = curr_node->parent, *sib_iter = left_sibling->parent;
-        while (node_iter != sib_iter) {
-            last_node_iter = node_iter;
-            node_iter = node_iter->parent;
-            last_sib_iter = sib_iter;
-            sib_iter = sib_iter->parent;
-        }
-        KeyReferencePair* key_ref_to_sib_in_ancestor = get_key_ref_pair_from_parent(last_sib_iter);
-        key_ref_to_sib_in_ancestor->key = min_key_in_subtree(curr_node);
+        // borrowing may affect branching at that node. The seperator in front of
+        // the borrowed reference now seperates the two nodes.
+        *low_fence(path, level) = left_sibling->key(left_sibling->size - 1);
+        // the last key-reference pair in the left sibling becomes the dummy one
+        left_sibling->size--;
     }
     else { // borrow from right sibling
         InternalNode* right_sibling = sibling;
-        borrowed_node = right_sibling->key_ref[0].reference;
-        // ++ first because there is a dummy key INT_MAX at key_ref[size]
-        curr_node->key_ref[++curr_node->size] = right_sibling->key_ref[0];
+        borrowed_node = right_sibling->child(0);
+        // the borrowed reference becomes the dummy one, the previous dummy
+        // reference now needs a seperator, which is the high fence key
+        curr_node->size++;
+        curr_node->key(curr_node->size - 1) = *high_fence(path, level);
+        curr_node->child(curr_node->size) = borrowed_node;
+
+        // Borrowing from right only happens if curr_node is the leftmost one, and
+        // the branching factor is at least two, so it must share the same parent
+        // with its right sibling. So we only need to update the reference in parent,
+        // with the seperator behind the borrowed reference.
+        *high_fence(path, level) = right_sibling->key(0);
         // delete the borrowed key-reference pair by moving sibling's successive
         // key-reference pairs forward
         for (int i = 0; i < right_sibling->size; ++i) {
-            right_sibling->key_ref[i] = right_sibling->key_ref[i+1];
+            right_sibling->copy_entry(i, right_sibling, i+1);
         }
         right_sibling->size--;
-        // the remaining key-reference pairs in the current node contains a dummy
-        // reference with key = INT_MAX, so need to modify its key to the smallest
-        // key in the borrowed reference
-        int min_key_in_borrowed = min_key_in_subtree(curr_node->key_ref[curr_node->size].reference);
-        curr_node->key_ref[curr_node->size-1].key = min_key_in_borrowed;
-        curr_node->key_ref[curr_node->size].key   = INT_MAX;
-
-        // Borrowing from right only happens if curr_node is the leftmost one, and
-        // the branching factor is at least two, so it must share the same parent
-        // with its right sibling. So we only need to update the reference in parent.
-        KeyReferencePair* key_ref_in_parent = get_key_ref_pair_from_parent(curr_node);
-        key_ref_in_parent->key = min_key_in_subtree(curr_node->right_sibling);
     }
-    borrowed_node->parent = curr_node;
     return;
 }
 
 // the current node merges with its sibling
-void SeqBPlusTree::merge_internal(InternalNode* curr_node, InternalNode* sibling, bool toLeft) {
-    InternalNode* parent = (InternalNode*)curr_node->parent;
-    KeyReferencePair* key_ref_to_curr_in_parent = get_key_ref_pair_from_parent(curr_node);
-    bool curr_parent_is_dummy = INT_MAX == key_ref_to_curr_in_parent->key;
+template <typename Key, typename Value, int Order, typename Compare, NodeLayout Layout,
+          template <typename, typename> class NodeAllocator>
+void SeqBPlusTree<Key, Value, Order, Compare, Layout, NodeAllocator>::merge_internal(InternalNode* curr_node, InternalNode* sibling, bool toLeft, Path& path, int level) {
+    counters.add(STAT_INTERNAL_MERGES);
+    InternalNode* parent = path.nodes[level];
+    int idx = path.index[level];
+    bool curr_parent_is_dummy = idx == parent->size;
     if (toLeft) { // merge to left sibling
         InternalNode* left_sib = sibling;
-        // +1 because there is a dummy key INT_MAX at key_ref[size]
+        // +1 because there is a dummy reference at child(size)
         for (int i = 0; i <= curr_node->size; ++i) {
-            left_sib->key_ref[left_sib->size + 1 + i] = curr_node->key_ref[i];
-            left_sib->key_ref[left_sib->size + 1 + i].reference->parent = left_sib;
+            left_sib->copy_entry(left_sib->size + 1 + i, curr_node, i);
         }
-        // There may be two dummy keys equal INT_MAX after merging.
-        // As the left side is always smaller, edit the dummy key in the left sibling
-        left_sib->key_ref[left_sib->size].key =
-            min_key_in_subtree(curr_node->key_ref[0].reference);
+        // The dummy reference of the left sibling is now in the middle.
+        // The low fence key of curr_node seperates the two sides.
+        left_sib->key(left_sib->size) = *low_fence(path, level);
         left_sib->size += curr_node->size + 1;
 
-        // find the key_ref pair in the parent of curr_node and remove it by
-        // moving its successive key-ref pairs forward.
-        // Use <= because also need to check the dummy key INT_MAX at key_ref[size]
-        int idx;
-        for (idx = 0; idx <= parent->size; ++idx) {
-            if (parent->key_ref[idx].reference == curr_node) break;
+        // The effect of merging is the same as borrowing so we need to update the
+        // reference in the first common ancestor.
+        // If curr_node was the dummy reference, the left sibling becomes the dummy
+        // one and its key is unused.
+        if (!curr_parent_is_dummy) {
+            // Merging to the left sibling is the same as the left sibling borrowing
+            // from curr_node. The merged node now reaches up to the high fence
+            // key of curr_node, which becomes its seperator from the right sibling.
+            // Copy it before it's removed from the parent below.
+            // Also note if the left sibling and curr_node don't share the same parent,
+            // the left sibling must be the rightmost one in its subtree whereas the
+            // curr_node is the leftmost one. So the reference to the left sibling is
+            // the dummy one.
+            *low_fence(path, level) = *high_fence(path, level);
         }
+
+        // remove the key_ref pair in the parent of curr_node by moving its
+        // successive key-ref pairs forward.
         for (int i = idx; i < parent->size; ++i) {
-            parent->key_ref[i] = parent->key_ref[i+1];
+            parent->copy_entry(i, parent, i+1);
         }
         parent->size--;
 
@@ -794,55 +1672,30 @@ void SeqBPlusTree::merge_internal(InternalNode* curr_node, InternalNode* sibling
         left_sib->right_sibling = curr_node->right_sibling;
         if (NULL != curr_node->right_sibling)
             curr_node->right_sibling->left_sibling = left_sib;
-
-        // The effect of merging is the same as borrowing so we need to update the
-        // reference in the first common ancestor.
-        Node *last_node_iter = curr_node, *last_sib_iter = left_sib;
-        Node *node_iter = curr_node->parent, *sib_iter = left_sib->parent;
-        while (node_iter != sib_iter) {
-            last_node_iter = node_iter;
-            node_iter = node_iter->parent;
-            last_sib_iter = sib_iter;
-            sib_iter = sib_iter->parent;
-        }
-        KeyReferencePair* key_ref_to_sib_in_ancestor =
-            get_key_ref_pair_from_parent(last_sib_iter);
-        if (curr_parent_is_dummy) {
-            key_ref_to_sib_in_ancestor->key = INT_MAX;
-        }
-        else {
-            // Merging to the left sibling is the same as the left sibling borrowing
-            // from curr_node. Note the smallest key in the right after merging is
-            // the first key in the right sibling of curr_node.
-            // Also note if the left sibling and curr_node don't share the same parent,
-            // the left sibling must be the rightmost one in its subtree whereas the
-            // curr_node is the leftmost one. So the reference to the left sibling is
-            // the dummy one with key INT_MAX.
-            InternalNode* right_sib = (InternalNode*) curr_node->right_sibling;
-            int min_key_right = min_key_in_subtree(right_sib->key_ref[0].reference);
-            key_ref_to_sib_in_ancestor->key = min_key_right;
-        }
     }
     else { // merge to right sibling
         InternalNode* right_sib = sibling;
-        // +1 because there is a dummy key INT_MAX at key_ref[size]
+        // The key-reference pairs from curr_node are all smaller, so shift the
+        // ones in the right sibling right to make room for them.
+        // +1 because there is a dummy reference at child(size)
+        int shift = curr_node->size + 1;
+        for (int i = right_sib->size; i >= 0; --i) {
+            right_sib->copy_entry(i + shift, right_sib, i);
+        }
         for (int i = 0; i <= curr_node->size; ++i) {
-            right_sib->key_ref[right_sib->size + 1 + i] = curr_node->key_ref[i];
-            right_sib->key_ref[right_sib->size + 1 + i].reference->parent = right_sib;
+            right_sib->copy_entry(i, curr_node, i);
         }
-        right_sib->size += curr_node->size + 1;
-        // There may be two dummy keys equal INT_MAX after merging.
-        // As the right side is always larger, edit the dummy key from the curr_node
-        right_sib->key_ref[right_sib->size].key =
-            min_key_in_subtree(right_sib->key_ref[0].reference);
-        sort_entry_by_key(right_sib);
+        // The dummy reference from curr_node is now in the middle.
+        // The high fence key of curr_node seperates the two sides.
+        right_sib->key(curr_node->size) = *high_fence(path, level);
+        right_sib->size += shift;
 
         // As merge to right only happens if the curr_node is the leftmost one,
         // and the branching factor is at least two, so it must share the same
         // parent with its right sibling.
         // So only need to modify the references in the parent.
         for (int i = 0; i < parent->size; ++i) {
-            parent->key_ref[i] = parent->key_ref[i+1];
+            parent->copy_entry(i, parent, i+1);
         }
         parent->size--;
 
@@ -851,22 +1704,294 @@ void SeqBPlusTree::merge_internal(InternalNode* curr_node, InternalNode* sibling
     }
 
     node_count--;
-    delete curr_node;
-
-    if (parent->isDeficient()) {
-        if (parent->isRoot()) {
-            Node* oldRoot = root;
-            root = sibling;
-            sibling->parent = NULL;
-            node_count--;
-            depth--;
-            delete oldRoot;
+    free_internal(curr_node);
+
+    if (internal_deficient(parent, level == 0)) {
+        if (level == 0) {
+            collapse_root(sibling);
         } else {
-            borrow_merge_internal(parent);
+            borrow_merge_internal(parent, path, level - 1);
         }
     }
 
     return;
 }
 
+// the root has a single reference left, make that child the new root
+template <typename Key, typename Value, int Order, typename Compare, NodeLayout Layout,
+          template <typename, typename> class NodeAllocator>
+void SeqBPlusTree<Key, Value, Order, Compare, Layout, NodeAllocator>::collapse_root(Node* new_root) {
+    counters.add(STAT_ROOT_COLLAPSES);
+    InternalNode* oldRoot = (InternalNode*) root;
+    root = new_root;
+    node_count--;
+    depth--;
+    free_internal(oldRoot);
+}
+
+// Free every node in O(n).
+// If neither keys nor values need a destructor and the allocator can drop all
+// of its memory at once, that's all we need. Otherwise walk the tree level by
+// level: the first node of the next level is the first child of the first node
+// of this level, and the nodes on a level are chained by right_sibling.
+template <typename Key, typename Value, int Order, typename Compare, NodeLayout Layout,
+          template <typename, typename> class NodeAllocator>
+void SeqBPlusTree<Key, Value, Order, Compare, Layout, NodeAllocator>::destroy_nodes() {
+    counters.add(STAT_NODE_FREES, node_count);
+    bool trivial = is_trivially_destructible<Key>::value && is_trivially_destructible<Value>::value;
+    if (root != NULL && !(trivial && NodeAllocator<Leaf, InternalNode>::can_release)) {
+        Node* level = root;
+        while (level != NULL) {
+            Node* next_level = NULL;
+            if (INTERNAL == level->type) {
+                next_level = ((InternalNode*)level)->child(0);
+            }
+            Node* curr_node = level;
+            while (curr_node != NULL) {
+                Node* right = curr_node->right_sibling;
+                if (LEAF == curr_node->type) {
+                    alloc.delete_leaf((Leaf*)curr_node);
+                } else {
+                    alloc.delete_internal((InternalNode*)curr_node);
+                }
+                curr_node = right;
+            }
+            level = next_level;
+        }
+    }
+    alloc.release();
+    root = NULL;
+    depth = 0;
+    node_count = 0;
+}
+
+// return true if [first, last) is sorted by key, then n is the # of distinct keys
+template <typename Key, typename Value, int Order, typename Compare, NodeLayout Layout,
+          template <typename, typename> class NodeAllocator>
+template <typename ForwardIt>
+bool SeqBPlusTree<Key, Value, Order, Compare, Layout, NodeAllocator>::count_sorted_keys(ForwardIt first, ForwardIt last, size_t& n) {
+    n = 0;
+    if (first == last) return true;
+    n = 1;
+    ForwardIt prev = first;
+    for (ForwardIt it = ++first; it != last; prev = it, ++it) {
+        if (comp(it->first, prev->first)) return false;
+        if (comp(prev->first, it->first)) ++n;
+    }
+    return true;
+}
+
+// Build the tree bottom-up from the n distinct keys in the sorted [first, last).
+// The leaves are filled left to right in one pass over the input, then every
+// level of internal nodes is built over the one below until a single node is
+// left, which becomes the root. The entries of a level are spread evenly over
+// its nodes, so every node is at least half full like after inserts.
+// The seperator in front of a reference is the one between the leaf on its
+// left and the first leaf of its subtree, see SeperatorPolicy.
+template <typename Key, typename Value, int Order, typename Compare, NodeLayout Layout,
+          template <typename, typename> class NodeAllocator>
+template <typename ForwardIt>
+void SeqBPlusTree<Key, Value, Order, Compare, Layout, NodeAllocator>::bulk_build(ForwardIt first, ForwardIt last, size_t n, double fill_factor) {
+    clear();
+    if (n == 0) return;
+
+    // a leaf holds at most Order-1 key-value pairs, reuse the empty root as the first one
+    size_t leaf_num = bulk_node_count(n, bulk_target(fill_factor, Order / 2, Order - 1), Order / 2);
+    vector<Node*> level;
+    vector<Key> min_keys; // the seperator in front of each node on the level
+    level.reserve(leaf_num);
+    min_keys.reserve(leaf_num);
+    Leaf* curr_leaf = (Leaf*) root;
+    level.push_back(curr_leaf);
+    size_t quota = n / leaf_num + (0 < n % leaf_num);
+    Leaf* last_leaf = NULL; // where the previous key went
+    int last_idx = 0;
+    for (; first != last; ++first) {
+        // the input is sorted, a key not greater than the previous one repeats it
+        if (last_leaf && !comp(last_leaf->key(last_idx), first->first)) {
+            last_leaf->value(last_idx) = first->second;
+            continue;
+        }
+        if (curr_leaf->size == (int)quota) {
+            Leaf* next_leaf = allocate_leaf();
+            next_leaf->id = ++id_accumulator;
+            ++node_count;
+            curr_leaf->right_sibling = next_leaf;
+            next_leaf->left_sibling  = curr_leaf;
+            curr_leaf = next_leaf;
+            quota = n / leaf_num + (level.size() < n % leaf_num);
+            level.push_back(curr_leaf);
+        }
+        curr_leaf->key(curr_leaf->size)   = first->first;
+        curr_leaf->value(curr_leaf->size) = first->second;
+        last_leaf = curr_leaf;
+        last_idx  = curr_leaf->size++;
+    }
+    // past the first leaf, the seperator from the previous one stands in for
+    // the smallest key: it's just as good at routing
+    min_keys.push_back(((Leaf*)level[0])->key(0));
+    for (size_t i = 1; i < level.size(); ++i) {
+        Leaf* prev = (Leaf*)level[i - 1];
+        min_keys.push_back(seperator(prev->key(prev->size - 1), ((Leaf*)level[i])->key(0)));
+    }
+
+    // an internal node has at most Order references, at least Order/2 unless it's the root
+    size_t ref_target = bulk_target(fill_factor, Order / 2, Order);
+    while (level.size() > 1) {
+        size_t m = level.size();
+        size_t node_num = bulk_node_count(m, ref_target, Order / 2);
+        vector<Node*> upper;
+        vector<Key> upper_min_keys;
+        upper.reserve(node_num);
+        upper_min_keys.reserve(node_num);
+        InternalNode* prev_node = NULL;
+        for (size_t i = 0, c = 0; i < node_num; ++i) {
+            size_t refs = m / node_num + (i < m % node_num);
+            InternalNode* curr_node = allocate_internal();
+            curr_node->id = ++id_accumulator;
+            ++node_count;
+            upper_min_keys.push_back(min_keys[c]);
+            // the last reference is the dummy one at child(size)
+            for (size_t j = 0; j < refs; ++j, ++c) {
+                if (j > 0) curr_node->key(j - 1) = min_keys[c];
+                curr_node->child(j) = level[c];
+            }
+            curr_node->size = refs - 1;
+            if (prev_node) {
+                prev_node->right_sibling = curr_node;
+                curr_node->left_sibling  = prev_node;
+            }
+            prev_node = curr_node;
+            upper.push_back(curr_node);
+        }
+        level.swap(upper);
+        min_keys.swap(upper_min_keys);
+        depth++;
+    }
+    root = level[0];
+}
+
+// insert_batch for sorted input
+// Descend for the first pair left, the leaf found takes every following pair
+// up to its fence: the seperator right of it in the lowest ancestor where it
+// isn't under the dummy reference (none for the rightmost leaf). Merge those
+// pairs into the leaf, and if the result doesn't fit, spread it evenly over as
+// few leaves as needed and link each new leaf into the parent in turn.
+template <typename Key, typename Value, int Order, typename Compare, NodeLayout Layout,
+          template <typename, typename> class NodeAllocator>
+template <typename ForwardIt>
+size_t SeqBPlusTree<Key, Value, Order, Compare, Layout, NodeAllocator>::insert_sorted_batch(ForwardIt first, ForwardIt last) {
+    size_t inserted = 0;
+    vector<pair<Key, Value> > merged;
+    Path path;
+    while (first != last) {
+        Leaf* leaf = leaf_search(first->first, &path);
+        // the pairs before the high fence key go to this leaf
+        ForwardIt run_end = first;
+        int run_length = 0;
+        Key* fence = high_fence(path, path.depth - 1);
+        if (fence == NULL) {
+            for (; run_end != last; ++run_end) ++run_length;
+        } else {
+            for (; run_end != last && comp(run_end->first, *fence); ++run_end) ++run_length;
+        }
+
+        // few pairs for this leaf: shift each one in place, like insert
+        if (leaf->size + run_length <= Order - 1) {
+            for (; first != run_end; ++first) {
+                int i = leaf_lower_bound(leaf, first->first);
+                if (i < leaf->size && key_equal(first->first, leaf->key(i))) {
+                    leaf->value(i) = first->second;
+                    continue;
+                }
+                leaf->shift_right(i, leaf->size, 1);
+                leaf->key(i) = first->first;
+                leaf->value(i) = first->second;
+                leaf->size++;
+                ++inserted;
+            }
+            continue;
+        }
+        inserted += merge_into_leaf(leaf, first, run_end, merged);
+        first = run_end;
+
+        // a leaf holds at most Order-1 pairs, and at least Order/2 after the split
+        size_t total = merged.size();
+        size_t leaf_num = (total + Order - 2) / (Order - 1);
+        Leaf* curr_leaf = leaf;
+        for (size_t i = 0, c = 0; i < leaf_num; ++i) {
+            size_t quota = total / leaf_num + (i < total % leaf_num);
+            if (i > 0) {
+                Leaf* new_leaf = allocate_leaf();
+                new_leaf->id = ++id_accumulator;
+                ++node_count;
+                if (NULL != curr_leaf->right_sibling) {
+                    curr_leaf->right_sibling->left_sibling = new_leaf;
+                }
+                new_leaf->right_sibling = curr_leaf->right_sibling;
+                new_leaf->left_sibling  = curr_leaf;
+                curr_leaf->right_sibling = new_leaf;
+                curr_leaf = new_leaf;
+            }
+            for (size_t j = 0; j < quota; ++j, ++c) {
+                curr_leaf->key(j)   = merged[c].first;
+                curr_leaf->value(j) = merged[c].second;
+            }
+            curr_leaf->size = quota;
+        }
+
+        // Link the new leaves into the parent from left to right. The path
+        // still leads to the left neighbour of the next one unless the parent
+        // got split (or a new root was added), then descend again.
+        Leaf* left_leaf = leaf;
+        for (size_t i = 1; i < leaf_num; ++i) {
+            Leaf* new_leaf = (Leaf*) left_leaf->right_sibling;
+            counters.add_split(0);
+            bool stale = path.depth == 0 || path.nodes[path.depth - 1]->isFull();
+            parent_insert(left_leaf, seperator(left_leaf->key(left_leaf->size - 1), new_leaf->key(0)),
+                          new_leaf, path, path.depth - 1);
+            if (stale) {
+                leaf_search(new_leaf->key(0), &path);
+            } else {
+                path.index[path.depth - 1]++;
+            }
+            left_leaf = new_leaf;
+        }
+    }
+    return inserted;
+}
+
+// merge the sorted pairs [first, last) into the leaf, return the # of new keys
+// A pair with a key already in the leaf (or repeated in the input) replaces
+// the value.
+template <typename Key, typename Value, int Order, typename Compare, NodeLayout Layout,
+          template <typename, typename> class NodeAllocator>
+template <typename ForwardIt>
+size_t SeqBPlusTree<Key, Value, Order, Compare, Layout, NodeAllocator>::merge_into_leaf(Leaf* leaf, ForwardIt first, ForwardIt last,
+                                                                                       vector<pair<Key, Value> >& merged) {
+    size_t inserted = 0;
+    int i = 0;
+    merged.clear();
+    for (; first != last; ++first) {
+        const Key& key = first->first;
+        while (i < leaf->size && comp(leaf->key(i), key)) {
+            merged.push_back(make_pair(leaf->key(i), leaf->value(i)));
+            ++i;
+        }
+        if (!merged.empty() && !comp(merged.back().first, key)) {
+            merged.back().second = first->second;
+        } else if (i < leaf->size && !comp(key, leaf->key(i))) {
+            merged.push_back(make_pair(leaf->key(i), first->second));
+            ++i;
+        } else {
+            merged.push_back(make_pair(key, first->second));
+            ++inserted;
+        }
+    }
+    for (; i < leaf->size; ++i) {
+        merged.push_back(make_pair(leaf->key(i), leaf->value(i)));
+    }
+    return inserted;
+}
+
 #endif /* Sequential_hpp */
@@ -0,0 +1,280 @@
+#ifndef Sharded_hpp
+#define Sharded_hpp
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <queue>
+#include <utility>
+#include <vector>
+
+#include "Sequential.hpp"
+
+using namespace std;
+
+/*
+ * Partitioners decide which shard of a ShardedBPlusTree owns a key.
+ * shards():       # of shards
+ * shard_of(key):  the shard owning key, in [0, shards())
+ * ordered:        true if every key of shard i is less than every key of
+ *                 shard i+1, then a range scan doesn't have to merge
+ */
+
+// shard i holds the keys in [bounds[i-1], bounds[i]), shard 0 everything
+// below bounds[0] and the last shard everything from bounds.back() on
+template <typename Key, typename Compare = less<Key> >
+class RangePartitioner {
+private:
+    vector<Key> bounds; // sorted
+    Compare comp;
+
+public:
+    static const bool ordered = true;
+
+    RangePartitioner(const vector<Key>& bounds, const Compare& comp = Compare())
+        : bounds(bounds), comp(comp) {
+        sort(this->bounds.begin(), this->bounds.end(), comp);
+    }
+
+    size_t shards() const {
+        return bounds.size() + 1;
+    }
+    size_t shard_of(const Key& key) const {
+        return upper_bound(bounds.begin(), bounds.end(), key, comp) - bounds.begin();
+    }
+};
+
+// spreads the keys evenly whatever their distribution, but a range scan has
+// to look into every shard
+template <typename Key, typename Hash = hash<Key> >
+class HashPartitioner {
+private:
+    size_t n;
+    Hash hasher;
+
+public:
+    static const bool ordered = false;
+
+    HashPartitioner(size_t n, const Hash& hasher = Hash()) : n(n > 0 ? n : 1), hasher(hasher) {}
+
+    size_t shards() const {
+        return n;
+    }
+    size_t shard_of(const Key& key) const {
+        // std::hash is the identity for integers, mix the bits so that keys
+        // with a common stride don't land on a few shards
+        uint64_t h = (uint64_t)hasher(key) * 0x9E3779B97F4A7C15ULL;
+        return (size_t)((h >> 32) % n);
+    }
+};
+
+/*
+ * Sharded B+ Tree: a front-end over independent SeqBPlusTree shards
+ * Partitioner: RangePartitioner or HashPartitioner (see above)
+ * Order, Compare: as in SeqBPlusTree, for every shard
+ *
+ * Each shard has its own lock, so operations on different shards never wait
+ * for each other and writes scale with the # of shards as long as the keys
+ * spread over them.
+ * range() locks one shard at a time, so it sees every shard at a consistent
+ * point but not all shards at the same point.
+ */
+template <typename Key, typename Value, typename Partitioner = HashPartitioner<Key>,
+          int Order = ORDER, typename Compare = less<Key> >
+class ShardedBPlusTree {
+private:
+    typedef SeqBPlusTree<Key, Value, Order, Compare> Tree;
+
+    // a cache line apart, so that threads on different shards don't share one
+    struct alignas(CACHE_LINE_SIZE) Shard {
+        mutex lock;
+        Tree tree;
+
+        Shard(const Compare& comp) : tree(comp) {}
+
+        // plain new only guarantees the alignment of max_align_t before C++17
+        static void* operator new(size_t size) {
+            void* p = NULL;
+            if (posix_memalign(&p, CACHE_LINE_SIZE, size) != 0) throw bad_alloc();
+            return p;
+        }
+        static void operator delete(void* p) {
+            free(p);
+        }
+    };
+
+    Partitioner partitioner;
+    vector<Shard*> shards;
+    Compare comp;
+
+public:
+    ShardedBPlusTree(const Partitioner& partitioner, const Compare& comp = Compare());
+    ~ShardedBPlusTree();
+    ShardedBPlusTree(const ShardedBPlusTree&) = delete;
+    ShardedBPlusTree& operator=(const ShardedBPlusTree&) = delete;
+
+    // search for the value relative to the given key, return not_found if not exists
+    Value search(const Key& key, const Value& not_found);
+    // return true: successfully insert a new key-value pair
+    // return false: key already exists, replace the previous with the new value
+    bool insert(const Key& key, const Value& value);
+    // insert the key-value pairs [first, last), each shard takes its part with
+    // one insert_batch under one lock, return the # of keys that were new
+    template <typename ForwardIt>
+    size_t insert_batch(ForwardIt first, ForwardIt last);
+    // return true if the key-value pair is successfully removed
+    // otherwise return false if the key doesn't exist
+    bool remove(const Key& key);
+    // the key-value pairs with keys in [lo, hi), in key order
+    vector<pair<Key, Value> > range(const Key& lo, const Key& hi);
+
+    size_t shard_count() const {
+        return shards.size();
+    }
+    // the statistics of every shard added up, see SeqBPlusTree::stats
+    // Each shard is locked while it's measured, one at a time.
+    TreeStats stats();
+
+// private helper functions
+private:
+    Shard& shard_of(const Key& key) {
+        return *shards[partitioner.shard_of(key)];
+    }
+    // append the pairs of the shard with keys in [lo, hi) to out
+    void scan_shard(Shard& shard, const Key& lo, const Key& hi, vector<pair<Key, Value> >& out);
+    // merge the sorted runs into one sorted vector
+    vector<pair<Key, Value> > merge_runs(vector<vector<pair<Key, Value> > >& runs);
+};
+
+template <typename Key, typename Value, typename Partitioner, int Order, typename Compare>
+ShardedBPlusTree<Key, Value, Partitioner, Order, Compare>::ShardedBPlusTree(const Partitioner& partitioner,
+                                                                           const Compare& comp)
+    : partitioner(partitioner), comp(comp) {
+    for (size_t i = 0; i < partitioner.shards(); ++i) {
+        shards.push_back(new Shard(comp));
+    }
+}
+
+template <typename Key, typename Value, typename Partitioner, int Order, typename Compare>
+ShardedBPlusTree<Key, Value, Partitioner, Order, Compare>::~ShardedBPlusTree() {
+    for (size_t i = 0; i < shards.size(); ++i) {
+        delete shards[i];
+    }
+}
+
+template <typename Key, typename Value, typename Partitioner, int Order, typename Compare>
+Value ShardedBPlusTree<Key, Value, Partitioner, Order, Compare>::search(const Key& key, const Value& not_found) {
+    Shard& shard = shard_of(key);
+    lock_guard<mutex> guard(shard.lock);
+    return shard.tree.search(key, not_found);
+}
+
+template <typename Key, typename Value, typename Partitioner, int Order, typename Compare>
+bool ShardedBPlusTree<Key, Value, Partitioner, Order, Compare>::insert(const Key& key, const Value& value) {
+    Shard& shard = shard_of(key);
+    lock_guard<mutex> guard(shard.lock);
+    return shard.tree.insert(key, value);
+}
+
+template <typename Key, typename Value, typename Partitioner, int Order, typename Compare>
+template <typename ForwardIt>
+size_t ShardedBPlusTree<Key, Value, Partitioner, Order, Compare>::insert_batch(ForwardIt first, ForwardIt last) {
+    // keeps the input order within every shard, so sorted input stays sorted
+    vector<vector<pair<Key, Value> > > parts(shards.size());
+    for (ForwardIt it = first; it != last; ++it) {
+        parts[partitioner.shard_of(it->first)].push_back(*it);
+    }
+    size_t inserted = 0;
+    for (size_t i = 0; i < shards.size(); ++i) {
+        if (parts[i].empty()) continue;
+        lock_guard<mutex> guard(shards[i]->lock);
+        inserted += shards[i]->tree.insert_batch(parts[i].begin(), parts[i].end());
+    }
+    return inserted;
+}
+
+template <typename Key, typename Value, typename Partitioner, int Order, typename Compare>
+bool ShardedBPlusTree<Key, Value, Partitioner, Order, Compare>::remove(const Key& key) {
+    Shard& shard = shard_of(key);
+    lock_guard<mutex> guard(shard.lock);
+    return shard.tree.remove(key);
+}
+
+// With ordered partitions only the shards from the one owning lo up to the one
+// owning hi can hold keys in [lo, hi), and their pairs are already in order.
+// Otherwise every shard is scanned and the sorted runs are merged.
+template <typename Key, typename Value, typename Partitioner, int Order, typename Compare>
+vector<pair<Key, Value> > ShardedBPlusTree<Key, Value, Partitioner, Order, Compare>::range(const Key& lo, const Key& hi) {
+    vector<pair<Key, Value> > result;
+    if (!comp(lo, hi)) return result;
+    if (Partitioner::ordered) {
+        size_t first = partitioner.shard_of(lo);
+        size_t last = partitioner.shard_of(hi);
+        for (size_t i = first; i <= last && i < shards.size(); ++i) {
+            scan_shard(*shards[i], lo, hi, result);
+        }
+        return result;
+    }
+    vector<vector<pair<Key, Value> > > runs(shards.size());
+    for (size_t i = 0; i < shards.size(); ++i) {
+        scan_shard(*shards[i], lo, hi, runs[i]);
+    }
+    return merge_runs(runs);
+}
+
+template <typename Key, typename Value, typename Partitioner, int Order, typename Compare>
+TreeStats ShardedBPlusTree<Key, Value, Partitioner, Order, Compare>::stats() {
+    TreeStats result;
+    for (size_t i = 0; i < shards.size(); ++i) {
+        lock_guard<mutex> guard(shards[i]->lock);
+        result.add(shards[i]->tree.stats());
+    }
+    return result;
+}
+
+/*
+ * Private helper functions
+ */
+template <typename Key, typename Value, typename Partitioner, int Order, typename Compare>
+void ShardedBPlusTree<Key, Value, Partitioner, Order, Compare>::scan_shard(Shard& shard, const Key& lo, const Key& hi,
+                                                                          vector<pair<Key, Value> >& out) {
+    lock_guard<mutex> guard(shard.lock);
+    typename Tree::range_type r = shard.tree.range(lo, hi);
+    for (typename Tree::iterator it = r.begin(); it != r.end(); ++it) {
+        out.push_back(pair<Key, Value>(it.key(), it.value()));
+    }
+}
+
+// k-way merge with a heap of the run heads, the keys of different shards never
+// collide as every key has one owner
+template <typename Key, typename Value, typename Partitioner, int Order, typename Compare>
+vector<pair<Key, Value> > ShardedBPlusTree<Key, Value, Partitioner, Order, Compare>::merge_runs(
+        vector<vector<pair<Key, Value> > >& runs) {
+    size_t total = 0;
+    for (size_t i = 0; i < runs.size(); ++i) {
+        total += runs[i].size();
+    }
+    vector<pair<Key, Value> > result;
+    result.reserve(total);
+
+    // (run, position in the run), the top is the head with the smallest key
+    typedef pair<size_t, size_t> Head;
+    auto greater_head = [&runs, this](const Head& a, const Head& b) {
+        return comp(runs[b.first][b.second].first, runs[a.first][a.second].first);
+    };
+    priority_queue<Head, vector<Head>, decltype(greater_head)> heads(greater_head);
+    for (size_t i = 0; i < runs.size(); ++i) {
+        if (!runs[i].empty()) heads.push(Head(i, 0));
+    }
+    while (!heads.empty()) {
+        Head h = heads.top();
+        heads.pop();
+        result.push_back(runs[h.first][h.second]);
+        if (h.second + 1 < runs[h.first].size()) heads.push(Head(h.first, h.second + 1));
+    }
+    return result;
+}
+
+#endif /* Sharded_hpp */
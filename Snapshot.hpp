@@ -0,0 +1,522 @@
+#ifndef Snapshot_hpp
+#define Snapshot_hpp
+
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <functional>
+#include <iterator>
+#include <stdexcept>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <type_traits>
+#include <unistd.h>
+#include <vector>
+
+#include "NodeSearch.hpp"
+
+using namespace std;
+
+// default # of key-value pairs in a snapshot leaf
+const int SNAPSHOT_LEAF_FANOUT = 64;
+// default # of children of a snapshot internal node
+const int SNAPSHOT_INTERNAL_FANOUT = 64;
+// every level starts on a cache line of the mapping
+const size_t SNAPSHOT_ALIGN = 64;
+// most levels a snapshot can have, leaves included
+const int SNAPSHOT_MAX_LEVELS = 32;
+// first bytes of the file, to refuse files that aren't a snapshot
+const char SNAPSHOT_MAGIC[8] = {'B', 'P', 'T', 'S', 'N', 'A', 'P', '2'};
+
+// how the keys of the snapshot leaves are stored
+// SNAPSHOT_PLAIN_KEYS: every key in full
+// SNAPSHOT_DELTA_KEYS: frame of reference, the smallest key of the leaf in full
+//                      and every key as its distance from it in half the bits,
+//                      for integer keys ordered by less<Key>
+enum SnapshotKeyEncoding {
+    SNAPSHOT_PLAIN_KEYS = 0,
+    SNAPSHOT_DELTA_KEYS
+};
+
+/*
+ * Read-only snapshot of a tree, laid out to be used straight from mmap.
+ *
+ * The file holds no pointers and no offsets inside the nodes, so it works at
+ * whatever address it's mapped. Every level is an array of fixed-size nodes,
+ * the leaves first, the root last, and the header records where each level
+ * starts. Every node but the last of its level is full, so the children of
+ * node j are nodes j*InternalFanout .. j*InternalFanout+size on the level
+ * below, and the leaves follow each other in key order without sibling links.
+ * The keys of a node are contiguous, so the search kernels scan them as they
+ * do in SPLIT_LAYOUT nodes.
+ *
+ * A leaf provides:
+ *   Key key(int i);  int lower_bound(const Key& key, const Compare& comp);
+ *   bool fits(const Key& key);  whether the key can be appended to the leaf
+ *   void append(const Key& key, const Value& value);
+ * A leaf may end before it's full (see SNAPSHOT_DELTA_KEYS), only the internal
+ * nodes need to be full for the children to be found by position.
+ */
+template <typename Key, typename Value, int Fanout, SnapshotKeyEncoding Encoding>
+struct SnapshotLeaf;
+
+template <typename Key, typename Value, int Fanout>
+struct SnapshotLeaf<Key, Value, Fanout, SNAPSHOT_PLAIN_KEYS> {
+    int32_t size;
+    Key keys[Fanout];
+    Value values[Fanout];
+
+    Key key(int i) const { return keys[i]; }
+    template <typename Compare>
+    int lower_bound(const Key& key, const Compare& comp) const {
+        return node_lower_bound<sizeof(Key)>(keys, size, key, comp);
+    }
+    bool fits(const Key&) const { return size < Fanout; }
+    void append(const Key& key, const Value& value) {
+        keys[size] = key;
+        values[size++] = value;
+    }
+};
+
+// the deltas of a SNAPSHOT_DELTA_KEYS leaf, half as wide as the keys
+template <size_t KeyBytes>
+struct SnapshotDeltaBySize;
+template <> struct SnapshotDeltaBySize<8> { typedef int32_t type; };
+template <> struct SnapshotDeltaBySize<4> { typedef int16_t type; };
+
+template <typename Key>
+struct SnapshotDelta {
+    static_assert(is_integral<Key>::value && (sizeof(Key) == 4 || sizeof(Key) == 8),
+                  "delta encoded keys have to be 32 or 64-bit integers");
+    typedef typename SnapshotDeltaBySize<sizeof(Key)>::type type;
+};
+
+// Every key is stored as its distance from base, the first key of the leaf.
+// A leaf ends early when the next key is too far from base for a delta.
+// The distance is stored with its top bit flipped, so the deltas order as
+// signed integers and 32-bit deltas get the SIMD scan.
+template <typename Key, typename Value, int Fanout>
+struct SnapshotLeaf<Key, Value, Fanout, SNAPSHOT_DELTA_KEYS> {
+    typedef typename SnapshotDelta<Key>::type Delta;
+    typedef typename make_unsigned<Key>::type UKey;
+    typedef typename make_unsigned<Delta>::type UDelta;
+    static const UDelta sign_bit = (UDelta)1 << (8 * sizeof(Delta) - 1);
+
+    int32_t size;
+    Key base;
+    Delta deltas[Fanout];
+    Value values[Fanout];
+
+    Key key(int i) const {
+        return (Key)((UKey)base + ((UDelta)deltas[i] ^ sign_bit));
+    }
+    // the key's distance from base, if it fits in a delta
+    bool distance(const Key& key, UDelta& d) const {
+        if (key < base) return false;
+        UKey diff = (UKey)key - (UKey)base;
+        if (diff > (UKey)(UDelta)~(UDelta)0) return false;
+        d = (UDelta)diff;
+        return true;
+    }
+    template <typename Compare>
+    int lower_bound(const Key& key, const Compare&) const {
+        UDelta d;
+        if (!distance(key, d)) return key < base ? 0 : size;
+        return node_lower_bound<sizeof(Delta)>(deltas, size, (Delta)(d ^ sign_bit), less<Delta>());
+    }
+    bool fits(const Key& key) const {
+        UDelta d;
+        return size == 0 || (size < Fanout && distance(key, d));
+    }
+    void append(const Key& key, const Value& value) {
+        if (size == 0) base = key;
+        UDelta d = 0;
+        distance(key, d);
+        deltas[size] = (Delta)(d ^ sign_bit);
+        values[size++] = value;
+    }
+};
+
+template <typename Key, int Fanout>
+struct SnapshotInternal {
+    int32_t size;           // # of seperators, the node has size+1 children
+    Key keys[Fanout - 1];   // keys[i]: the smallest key under child i+1
+};
+
+struct SnapshotHeader {
+    char magic[8];
+    uint32_t key_size;
+    uint32_t value_size;
+    uint32_t leaf_fanout;
+    uint32_t internal_fanout;
+    uint32_t key_encoding;                       // SnapshotKeyEncoding
+    uint64_t pair_count;
+    uint32_t levels;                             // 0 for an empty snapshot
+    uint64_t level_offset[SNAPSHOT_MAX_LEVELS];  // from the start of the file, levels[0] are the leaves
+    uint64_t level_nodes[SNAPSHOT_MAX_LEVELS];
+    uint64_t file_size;
+};
+
+// round up to the next multiple of SNAPSHOT_ALIGN
+inline uint64_t snapshot_align(uint64_t offset) {
+    return (offset + SNAPSHOT_ALIGN - 1) / SNAPSHOT_ALIGN * SNAPSHOT_ALIGN;
+}
+
+/*
+ * Write the n key-value pairs in [first, last) as a snapshot to path.
+ * The pairs have to be sorted by key without repeats, like the ones of a
+ * SeqBPlusTree (see SeqBPlusTree::serialize); (*it).first and (*it).second
+ * are the key and the value. The file is written next to path and renamed
+ * over it once it's on the device, so readers never map a partial snapshot.
+ * I/O errors throw runtime_error.
+ */
+template <typename Key, typename Value, int LeafFanout = SNAPSHOT_LEAF_FANOUT,
+          int InternalFanout = SNAPSHOT_INTERNAL_FANOUT, SnapshotKeyEncoding Encoding = SNAPSHOT_PLAIN_KEYS,
+          typename ForwardIt>
+void write_snapshot(const string& path, ForwardIt first, ForwardIt last, uint64_t n) {
+    typedef SnapshotLeaf<Key, Value, LeafFanout, Encoding> Leaf;
+    typedef SnapshotInternal<Key, InternalFanout> InternalNode;
+    static_assert(is_trivially_copyable<Key>::value && is_trivially_copyable<Value>::value,
+                  "keys and values are stored in the file byte for byte");
+    static_assert(LeafFanout >= 1 && InternalFanout >= 2, "a snapshot node needs room for its entries");
+
+    string tmp_path = path + ".tmp";
+    FILE* out = fopen(tmp_path.c_str(), "wb");
+    if (out == NULL) throw runtime_error("cannot open " + tmp_path + ": " + strerror(errno));
+    // write len bytes at offset, a gap before it reads as zeros
+    auto write_at = [&](uint64_t offset, const void* data, size_t len) {
+        if (fseeko(out, (off_t)offset, SEEK_SET) != 0 || fwrite(data, 1, len, out) != len) {
+            fclose(out);
+            remove(tmp_path.c_str());
+            throw runtime_error("cannot write " + tmp_path + ": " + strerror(errno));
+        }
+    };
+
+    SnapshotHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC));
+    header.key_size = sizeof(Key);
+    header.value_size = sizeof(Value);
+    header.leaf_fanout = LeafFanout;
+    header.internal_fanout = InternalFanout;
+    header.key_encoding = Encoding;
+    header.pair_count = n;
+    uint64_t offset = snapshot_align(sizeof(SnapshotHeader));
+
+    // the leaves, filled one after another in a single pass over the input
+    vector<Key> min_keys; // the smallest key under each node of the level
+    if (n > 0) {
+        header.levels = 1;
+        header.level_offset[0] = offset;
+        min_keys.reserve((n + LeafFanout - 1) / LeafFanout);
+        Leaf leaf;
+        memset(&leaf, 0, sizeof(leaf));
+        for (; first != last; ++first) {
+            if (!leaf.fits((*first).first)) {
+                write_at(offset, &leaf, sizeof(leaf));
+                offset += sizeof(leaf);
+                memset(&leaf, 0, sizeof(leaf));
+            }
+            if (leaf.size == 0) min_keys.push_back((*first).first);
+            leaf.append((*first).first, (*first).second);
+        }
+        write_at(offset, &leaf, sizeof(leaf));
+        offset += sizeof(leaf);
+        header.level_nodes[0] = min_keys.size();
+    }
+
+    // every level of internal nodes over the one below until a single node is left
+    while (header.levels > 0 && header.level_nodes[header.levels - 1] > 1) {
+        if (header.levels == SNAPSHOT_MAX_LEVELS) {
+            fclose(out);
+            remove(tmp_path.c_str());
+            throw runtime_error("write_snapshot: too many levels, use larger fanouts");
+        }
+        uint64_t m = header.level_nodes[header.levels - 1];
+        uint64_t node_num = (m + InternalFanout - 1) / InternalFanout;
+        offset = snapshot_align(offset);
+        header.level_offset[header.levels] = offset;
+        header.level_nodes[header.levels] = node_num;
+        header.levels++;
+        vector<Key> upper_min_keys;
+        upper_min_keys.reserve(node_num);
+        for (uint64_t i = 0, c = 0; i < node_num; ++i) {
+            InternalNode node;
+            memset(&node, 0, sizeof(node));
+            uint64_t children = m - c < (uint64_t)InternalFanout ? m - c : InternalFanout;
+            upper_min_keys.push_back(min_keys[c]);
+            for (uint64_t j = 1; j < children; ++j) {
+                node.keys[j - 1] = min_keys[c + j];
+            }
+            node.size = (int32_t)children - 1;
+            c += children;
+            write_at(offset, &node, sizeof(node));
+            offset += sizeof(node);
+        }
+        min_keys.swap(upper_min_keys);
+    }
+
+    header.file_size = offset;
+    write_at(0, &header, sizeof(header));
+    // an empty snapshot ends before the aligned offset of its first level
+    bool synced = fflush(out) == 0 && ftruncate(fileno(out), (off_t)offset) == 0 && fsync(fileno(out)) == 0;
+    if (fclose(out) != 0 || !synced || rename(tmp_path.c_str(), path.c_str()) != 0) {
+        remove(tmp_path.c_str());
+        throw runtime_error("cannot write " + path + ": " + strerror(errno));
+    }
+}
+
+/*
+ * Serves lookups and range scans straight from a mapped snapshot.
+ * Opening maps the file and checks the header, nothing is read or copied
+ * beforehand: pages come in as lookups touch them, and processes mapping the
+ * same file share them in the page cache.
+ * Compare has to order the keys the way the writer did.
+ * The fanouts and the key encoding must be the ones the snapshot was written with.
+ */
+template <typename Key, typename Value, typename Compare = less<Key>,
+          int LeafFanout = SNAPSHOT_LEAF_FANOUT, int InternalFanout = SNAPSHOT_INTERNAL_FANOUT,
+          SnapshotKeyEncoding Encoding = SNAPSHOT_PLAIN_KEYS>
+class SnapshotReader {
+private:
+    typedef SnapshotLeaf<Key, Value, LeafFanout, Encoding> Leaf;
+    static_assert(Encoding == SNAPSHOT_PLAIN_KEYS || is_same<Compare, less<Key> >::value,
+                  "delta encoded keys are ordered by less<Key>");
+    typedef SnapshotInternal<Key, InternalFanout> InternalNode;
+
+    const char* base;
+    size_t length;
+    const SnapshotHeader* header;
+    const Leaf* leaves;
+    Compare comp;
+
+public:
+    /*
+     * Forward iterator over the key-value pairs in key order.
+     * The leaves are contiguous, so the next leaf is the next one in memory.
+     */
+    class iterator {
+    public:
+        typedef forward_iterator_tag iterator_category;
+        typedef pair<Key, Value> value_type;
+        typedef ptrdiff_t difference_type;
+        typedef void pointer;
+        typedef pair<Key, const Value&> reference;
+
+        iterator() : leaf(NULL), idx(0) {}
+
+        Key key() const { return leaf->key(idx); }
+        const Value& value() const { return leaf->values[idx]; }
+        reference operator*() const { return reference(leaf->key(idx), leaf->values[idx]); }
+
+        iterator& operator++() {
+            if (++idx == leaf->size) {
+                ++leaf;
+                idx = 0;
+            }
+            return *this;
+        }
+        iterator operator++(int) {
+            iterator old = *this;
+            ++*this;
+            return old;
+        }
+
+        bool operator==(const iterator& other) const {
+            return leaf == other.leaf && idx == other.idx;
+        }
+        bool operator!=(const iterator& other) const {
+            return !(*this == other);
+        }
+
+    private:
+        friend class SnapshotReader;
+        // the pair at index i of the leaf, or the first one of the next leaf if
+        // i is past the last pair of this one
+        iterator(const Leaf* leaf, int i) : leaf(leaf), idx(i) {
+            if (idx == leaf->size) {
+                ++this->leaf;
+                idx = 0;
+            }
+        }
+
+        const Leaf* leaf; // one past the last leaf at the end
+        int idx;
+    };
+
+    // the pairs with keys in [lo, hi), usable in a range-based for loop
+    struct range_type {
+        iterator first, last;
+        iterator begin() const { return first; }
+        iterator end() const { return last; }
+    };
+
+    // map the snapshot at path, throw runtime_error if it isn't a valid one
+    explicit SnapshotReader(const string& path, const Compare& comp = Compare());
+    ~SnapshotReader() {
+        munmap((void*)base, length);
+    }
+    SnapshotReader(const SnapshotReader&) = delete;
+    SnapshotReader& operator=(const SnapshotReader&) = delete;
+
+    // search for the value relative to the given key, return not_found if not exists
+    Value search(const Key& key, const Value& not_found = Value(-1)) const;
+    iterator begin() const {
+        if (header->levels == 0) return end();
+        return iterator(leaves, 0);
+    }
+    iterator end() const {
+        iterator it;
+        it.leaf = leaves + (header->levels > 0 ? header->level_nodes[0] : 0);
+        return it;
+    }
+    // the first pair whose key is not less than key
+    iterator lower_bound(const Key& key) const;
+    // the pairs whose keys are in [lo, hi)
+    range_type range(const Key& lo, const Key& hi) const;
+
+    uint64_t size() const {
+        return header->pair_count;
+    }
+
+// private helper functions
+private:
+    // the leaf where the key possibly exists
+    const Leaf* leaf_search(const Key& key) const;
+    // what is wrong with the levels of the header, NULL if nothing
+    const char* check_levels() const;
+    void fail(const string& path, const char* what) {
+        throw runtime_error("cannot map snapshot " + path + ": " + what);
+    }
+};
+
+template <typename Key, typename Value, typename Compare, int LeafFanout, int InternalFanout,
+          SnapshotKeyEncoding Encoding>
+SnapshotReader<Key, Value, Compare, LeafFanout, InternalFanout, Encoding>::SnapshotReader(const string& path, const Compare& comp)
+    : base(NULL), length(0), header(NULL), leaves(NULL), comp(comp) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) fail(path, strerror(errno));
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        fail(path, strerror(errno));
+    }
+    length = st.st_size;
+    if (length < sizeof(SnapshotHeader)) {
+        close(fd);
+        fail(path, "file too small");
+    }
+    void* p = mmap(NULL, length, PROT_READ, MAP_SHARED, fd, 0);
+    // the mapping stays valid without the descriptor
+    close(fd);
+    if (p == MAP_FAILED) fail(path, strerror(errno));
+    base = (const char*) p;
+    header = (const SnapshotHeader*) base;
+
+    const char* problem = NULL;
+    if (memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC)) != 0) {
+        problem = "not a snapshot";
+    } else if (header->key_size != sizeof(Key) || header->value_size != sizeof(Value)
+               || header->leaf_fanout != (uint32_t)LeafFanout
+               || header->internal_fanout != (uint32_t)InternalFanout
+               || header->key_encoding != (uint32_t)Encoding) {
+        problem = "written with another key, value or node size";
+    } else if (header->file_size != length || header->levels > (uint32_t)SNAPSHOT_MAX_LEVELS) {
+        problem = "truncated or corrupt";
+    } else {
+        problem = check_levels();
+    }
+    if (problem) {
+        munmap(p, length);
+        fail(path, problem);
+    }
+    if (header->levels > 0) leaves = (const Leaf*)(base + header->level_offset[0]);
+}
+
+// Lookups trust the level table, so every level has to lie inside the file at
+// an aligned offset, have enough leaves for the pairs, and have one node per
+// InternalFanout nodes of the level below, up to a single root.
+template <typename Key, typename Value, typename Compare, int LeafFanout, int InternalFanout,
+          SnapshotKeyEncoding Encoding>
+const char* SnapshotReader<Key, Value, Compare, LeafFanout, InternalFanout, Encoding>::check_levels() const {
+    uint32_t levels = header->levels;
+    uint64_t pairs = header->pair_count;
+    if (levels == 0) return pairs == 0 ? NULL : "corrupt level table";
+    // every leaf holds at least one pair, and every plain leaf but the last is full
+    uint64_t leaf_num = header->level_nodes[0];
+    uint64_t full_leaf_num = (pairs + LeafFanout - 1) / LeafFanout;
+    if (leaf_num < full_leaf_num || leaf_num > pairs
+        || (Encoding == SNAPSHOT_PLAIN_KEYS && leaf_num != full_leaf_num)) {
+        return "corrupt level table";
+    }
+    for (uint32_t i = 0; i < levels; ++i) {
+        uint64_t offset = header->level_offset[i];
+        uint64_t node_num = header->level_nodes[i];
+        size_t node_size = i == 0 ? sizeof(Leaf) : sizeof(InternalNode);
+        if (offset % SNAPSHOT_ALIGN != 0 || offset < sizeof(SnapshotHeader) || offset > length
+            || node_num == 0 || node_num > (length - offset) / node_size) {
+            return "corrupt level table";
+        }
+        if (i > 0 && node_num != (header->level_nodes[i - 1] + InternalFanout - 1) / InternalFanout) {
+            return "corrupt level table";
+        }
+    }
+    if (header->level_nodes[levels - 1] != 1) return "corrupt level table";
+    return NULL;
+}
+
+template <typename Key, typename Value, typename Compare, int LeafFanout, int InternalFanout,
+          SnapshotKeyEncoding Encoding>
+Value SnapshotReader<Key, Value, Compare, LeafFanout, InternalFanout, Encoding>::search(const Key& key, const Value& not_found) const {
+    if (header->levels == 0) return not_found;
+    const Leaf* leaf = leaf_search(key);
+    int i = leaf->lower_bound(key, comp);
+    if (i < leaf->size && !comp(key, leaf->key(i))) {
+        return leaf->values[i];
+    }
+    return not_found;
+}
+
+// the first pair not less than key is in the leaf the key would be in, or it's
+// the first pair of the next leaf
+template <typename Key, typename Value, typename Compare, int LeafFanout, int InternalFanout,
+          SnapshotKeyEncoding Encoding>
+typename SnapshotReader<Key, Value, Compare, LeafFanout, InternalFanout, Encoding>::iterator
+SnapshotReader<Key, Value, Compare, LeafFanout, InternalFanout, Encoding>::lower_bound(const Key& key) const {
+    if (header->levels == 0) return end();
+    const Leaf* leaf = leaf_search(key);
+    return iterator(leaf, leaf->lower_bound(key, comp));
+}
+
+template <typename Key, typename Value, typename Compare, int LeafFanout, int InternalFanout,
+          SnapshotKeyEncoding Encoding>
+typename SnapshotReader<Key, Value, Compare, LeafFanout, InternalFanout, Encoding>::range_type
+SnapshotReader<Key, Value, Compare, LeafFanout, InternalFanout, Encoding>::range(const Key& lo, const Key& hi) const {
+    range_type result;
+    result.first = lower_bound(lo);
+    result.last = result.first;
+    if (comp(lo, hi)) {
+        result.last = lower_bound(hi);
+    }
+    return result;
+}
+
+// Descend from the root: child c of node j is node j*InternalFanout+c on the
+// level below.
+template <typename Key, typename Value, typename Compare, int LeafFanout, int InternalFanout,
+          SnapshotKeyEncoding Encoding>
+const typename SnapshotReader<Key, Value, Compare, LeafFanout, InternalFanout, Encoding>::Leaf*
+SnapshotReader<Key, Value, Compare, LeafFanout, InternalFanout, Encoding>::leaf_search(const Key& key) const {
+    uint64_t j = 0;
+    for (int level = (int)header->levels - 1; level > 0; --level) {
+        const InternalNode* node = (const InternalNode*)(base + header->level_offset[level]) + j;
+        j = j * InternalFanout + node_upper_bound<sizeof(Key)>(node->keys, node->size, key, comp);
+    }
+    return leaves + j;
+}
+
+#endif /* Snapshot_hpp */
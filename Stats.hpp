@@ -0,0 +1,332 @@
+#ifndef Stats_hpp
+#define Stats_hpp
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <new>
+#include <thread>
+
+using namespace std;
+
+/*
+ * Statistics of a SeqBPlusTree, see SeqBPlusTree::stats.
+ * The structure (depth, node counts, fill factors) is measured on demand by
+ * walking the tree. The events on the hot paths (descents, splits, borrows,
+ * merges, root changes, node allocations) are only counted if the tree is
+ * compiled with BPLUSTREE_STATS defined; otherwise the counting calls are
+ * empty and compile away, and the event counters read 0.
+ *
+ * Every thread counts into a slot of its own, so counting needs no atomic
+ * read-modify-write and threads looking up in the same tree (or shards of one
+ * ShardedBPlusTree) don't share a cache line. A snapshot adds the slots up.
+ */
+
+// most threads with a slot of their own per tree, more share an overflow slot
+const int STATS_MAX_THREADS = 256;
+// # of trees a thread remembers its slot in
+const int STATS_SLOT_CACHE = 4;
+// slots are a cache line apart, so threads don't write to the same line
+const size_t STATS_SLOT_ALIGN = 64;
+// splits are counted by the height of the node split, 0 for the leaves, the
+// last level also counts every higher one
+const int STATS_SPLIT_LEVELS = 16;
+// the fill factor histograms have one bucket per tenth, and one for full nodes
+const int STATS_FILL_BUCKETS = 11;
+
+enum TreeStatCounter {
+    STAT_LOOKUPS = 0,          // descents from the root to a leaf
+    STAT_NODE_VISITS,          // nodes on those descents, leaves included
+    STAT_LEAF_BORROWS,
+    STAT_LEAF_MERGES,
+    STAT_INTERNAL_BORROWS,
+    STAT_INTERNAL_MERGES,
+    STAT_ROOT_GROWTHS,         // a split root got a new root above it
+    STAT_ROOT_COLLAPSES,       // a root with a single reference left was removed
+    STAT_LEAF_ALLOCATIONS,
+    STAT_INTERNAL_ALLOCATIONS,
+    STAT_NODE_FREES,
+    STAT_SPLITS,               // STAT_SPLITS + h: splits of nodes at height h
+    TREE_STAT_COUNT = STAT_SPLITS + STATS_SPLIT_LEVELS
+};
+
+// a snapshot of the statistics of a tree
+struct TreeStats {
+    // the # of internal levels, 0 if the root is a leaf
+    int depth;
+    size_t leaves;
+    size_t internal_nodes;
+    size_t pairs;
+    // leaf_fill[i]: # of leaves holding [i/10, (i+1)/10) of the pairs they
+    // can hold, the last bucket the full ones; internal_fill the same for
+    // the references of internal nodes
+    size_t leaf_fill[STATS_FILL_BUCKETS];
+    size_t internal_fill[STATS_FILL_BUCKETS];
+
+    // the event counters were compiled in, see BPLUSTREE_STATS
+    bool counting;
+    // # of threads that counted
+    int threads;
+    uint64_t counters[TREE_STAT_COUNT];
+
+    TreeStats() : depth(0), leaves(0), internal_nodes(0), pairs(0), counting(false), threads(0) {
+        for (int i = 0; i < STATS_FILL_BUCKETS; ++i) {
+            leaf_fill[i] = internal_fill[i] = 0;
+        }
+        for (int i = 0; i < TREE_STAT_COUNT; ++i) {
+            counters[i] = 0;
+        }
+    }
+
+    uint64_t operator[](TreeStatCounter counter) const {
+        return counters[counter];
+    }
+    // splits of the nodes at the given height, 0 for the leaves
+    uint64_t splits(int height) const {
+        if (height >= STATS_SPLIT_LEVELS) height = STATS_SPLIT_LEVELS - 1;
+        return counters[STAT_SPLITS + height];
+    }
+    double visits_per_lookup() const {
+        uint64_t lookups = counters[STAT_LOOKUPS];
+        return lookups == 0 ? 0 : (double) counters[STAT_NODE_VISITS] / lookups;
+    }
+    // average share of the pairs the leaves can hold that they do hold
+    double leaf_fill_factor(int max_pairs) const {
+        return leaves == 0 ? 0 : (double) pairs / (leaves * max_pairs);
+    }
+
+    // add the statistics of another tree, e.g. of every shard of a sharded tree
+    void add(const TreeStats& other) {
+        if (other.depth > depth) depth = other.depth;
+        leaves += other.leaves;
+        internal_nodes += other.internal_nodes;
+        pairs += other.pairs;
+        for (int i = 0; i < STATS_FILL_BUCKETS; ++i) {
+            leaf_fill[i] += other.leaf_fill[i];
+            internal_fill[i] += other.internal_fill[i];
+        }
+        counting = counting || other.counting;
+        if (other.threads > threads) threads = other.threads;
+        for (int i = 0; i < TREE_STAT_COUNT; ++i) {
+            counters[i] += other.counters[i];
+        }
+    }
+
+    void print() const {
+        printf("depth %d, %zu leaves, %zu internal nodes, %zu pairs\n", depth, leaves, internal_nodes, pairs);
+        print_fill("leaf fill    ", leaf_fill);
+        print_fill("internal fill", internal_fill);
+        if (!counting) {
+            printf("event counters off, compile with BPLUSTREE_STATS\n");
+            return;
+        }
+        printf("%llu lookups by %d threads, %.2f node visits per lookup\n",
+               (unsigned long long) counters[STAT_LOOKUPS], threads, visits_per_lookup());
+        printf("splits by height:");
+        for (int h = 0; h < STATS_SPLIT_LEVELS; ++h) {
+            if (counters[STAT_SPLITS + h] > 0) {
+                printf(" %d: %llu", h, (unsigned long long) counters[STAT_SPLITS + h]);
+            }
+        }
+        printf("\n");
+        printf("leaves: %llu borrows, %llu merges; internal nodes: %llu borrows, %llu merges\n",
+               (unsigned long long) counters[STAT_LEAF_BORROWS], (unsigned long long) counters[STAT_LEAF_MERGES],
+               (unsigned long long) counters[STAT_INTERNAL_BORROWS], (unsigned long long) counters[STAT_INTERNAL_MERGES]);
+        printf("root: %llu growths, %llu collapses\n",
+               (unsigned long long) counters[STAT_ROOT_GROWTHS], (unsigned long long) counters[STAT_ROOT_COLLAPSES]);
+        printf("allocated %llu leaves and %llu internal nodes, freed %llu nodes\n",
+               (unsigned long long) counters[STAT_LEAF_ALLOCATIONS],
+               (unsigned long long) counters[STAT_INTERNAL_ALLOCATIONS],
+               (unsigned long long) counters[STAT_NODE_FREES]);
+    }
+
+private:
+    static void print_fill(const char* name, const size_t* buckets) {
+        printf("%s", name);
+        for (int i = 0; i < STATS_FILL_BUCKETS; ++i) {
+            if (i + 1 < STATS_FILL_BUCKETS) {
+                printf(" %d%%: %zu", i * 10, buckets[i]);
+            } else {
+                printf(" full: %zu", buckets[i]);
+            }
+        }
+        printf("\n");
+    }
+};
+
+// the bucket of a node holding size of at most capacity entries
+inline int stats_fill_bucket(int size, int capacity) {
+    int bucket = size * (STATS_FILL_BUCKETS - 1) / capacity;
+    return bucket < STATS_FILL_BUCKETS ? bucket : STATS_FILL_BUCKETS - 1;
+}
+
+#ifdef BPLUSTREE_STATS
+
+// plain new only guarantees the alignment of max_align_t before C++17
+struct StatsAligned {
+    static void* operator new(size_t size) {
+        void* p = NULL;
+        if (posix_memalign(&p, STATS_SLOT_ALIGN, size) != 0) throw bad_alloc();
+        return p;
+    }
+    static void operator delete(void* p) {
+        free(p);
+    }
+};
+
+// the event counters of one tree, a slot per thread
+class TreeStatsCounters {
+private:
+    struct alignas(STATS_SLOT_ALIGN) Slot : StatsAligned {
+        thread::id owner;
+        // only the owner writes, so a relaxed load and store make an increment
+        atomic<uint64_t> values[TREE_STAT_COUNT];
+
+        explicit Slot(thread::id owner) : owner(owner) {
+            for (int i = 0; i < TREE_STAT_COUNT; ++i) {
+                values[i].store(0, memory_order_relaxed);
+            }
+        }
+    };
+
+    struct Slots : StatsAligned {
+        atomic<Slot*> slots[STATS_MAX_THREADS];
+        atomic<int> used;  // slots[0..used) have been claimed, maybe not published yet
+        Slot overflow;     // shared by the threads beyond STATS_MAX_THREADS
+        uint64_t id;       // tells trees apart in the per thread slot cache
+
+        Slots() : used(0), overflow(thread::id()), id(next_id()) {
+            for (int i = 0; i < STATS_MAX_THREADS; ++i) {
+                slots[i].store(NULL, memory_order_relaxed);
+            }
+        }
+        ~Slots() {
+            for (int i = 0; i < STATS_MAX_THREADS; ++i) {
+                delete slots[i].load();
+            }
+        }
+        static uint64_t next_id() {
+            static atomic<uint64_t> counter(0);
+            return ++counter;
+        }
+    };
+
+    unique_ptr<Slots> s;
+
+public:
+    static const bool enabled = true;
+
+    TreeStatsCounters() : s(new Slots()) {}
+    // the moved-from counters count nothing until reset()
+    TreeStatsCounters(TreeStatsCounters&& other) = default;
+    TreeStatsCounters& operator=(TreeStatsCounters&& other) = default;
+
+    void add(TreeStatCounter counter, uint64_t n = 1) {
+        if (!s) return;
+        Slot* slot = local_slot();
+        if (slot == &s->overflow) {
+            slot->values[counter].fetch_add(n, memory_order_relaxed);
+            return;
+        }
+        atomic<uint64_t>& value = slot->values[counter];
+        value.store(value.load(memory_order_relaxed) + n, memory_order_relaxed);
+    }
+    // lookups descents that visited nodes nodes together
+    void add_descents(uint64_t lookups, uint64_t nodes) {
+        add(STAT_LOOKUPS, lookups);
+        add(STAT_NODE_VISITS, nodes);
+    }
+    void add_split(int height) {
+        if (height >= STATS_SPLIT_LEVELS) height = STATS_SPLIT_LEVELS - 1;
+        add((TreeStatCounter)(STAT_SPLITS + height));
+    }
+
+    // zero every counter, or start counting again after a move
+    // No other thread may count meanwhile, or its counts may survive.
+    void reset() {
+        if (!s) {
+            s.reset(new Slots());
+            return;
+        }
+        for (int i = 0; i <= STATS_MAX_THREADS; ++i) {
+            Slot* slot = i < STATS_MAX_THREADS ? s->slots[i].load() : &s->overflow;
+            if (slot == NULL) continue;
+            for (int j = 0; j < TREE_STAT_COUNT; ++j) {
+                slot->values[j].store(0, memory_order_relaxed);
+            }
+        }
+    }
+
+    // add the counters of every thread into stats
+    void snapshot(TreeStats& stats) const {
+        stats.counting = true;
+        if (!s) return;
+        for (int i = 0; i <= STATS_MAX_THREADS; ++i) {
+            Slot* slot = i < STATS_MAX_THREADS ? s->slots[i].load() : &s->overflow;
+            if (slot == NULL) continue;
+            bool counted = false;
+            for (int j = 0; j < TREE_STAT_COUNT; ++j) {
+                uint64_t value = slot->values[j].load(memory_order_relaxed);
+                stats.counters[j] += value;
+                counted = counted || value > 0;
+            }
+            if (counted) ++stats.threads;
+        }
+    }
+
+private:
+    // the slot of the calling thread, taken the first time
+    Slot* local_slot() {
+        struct CacheEntry {
+            uint64_t id;
+            Slot* slot;
+        };
+        static thread_local CacheEntry cache[STATS_SLOT_CACHE];
+        static thread_local int next_victim = 0;
+        for (int i = 0; i < STATS_SLOT_CACHE; ++i) {
+            if (cache[i].id == s->id) return cache[i].slot;
+        }
+
+        Slot* slot = find_slot(this_thread::get_id());
+        cache[next_victim].id = s->id;
+        cache[next_victim].slot = slot;
+        next_victim = (next_victim + 1) % STATS_SLOT_CACHE;
+        return slot;
+    }
+
+    // the slot owned by id, or a new one
+    // A new thread that gets the id of a finished one carries on with its slot.
+    Slot* find_slot(thread::id id) {
+        int used = s->used.load();
+        for (int i = 0; i < used && i < STATS_MAX_THREADS; ++i) {
+            Slot* slot = s->slots[i].load();
+            if (slot != NULL && slot->owner == id) return slot;
+        }
+        int i = s->used.fetch_add(1);
+        if (i >= STATS_MAX_THREADS) return &s->overflow;
+        Slot* slot = new Slot(id);
+        s->slots[i].store(slot);
+        return slot;
+    }
+};
+
+#else
+
+// BPLUSTREE_STATS is off: nothing is counted
+class TreeStatsCounters {
+public:
+    static const bool enabled = false;
+
+    void add(TreeStatCounter, uint64_t = 1) {}
+    void add_descents(uint64_t, uint64_t) {}
+    void add_split(int) {}
+    void reset() {}
+    void snapshot(TreeStats&) const {}
+};
+
+#endif /* BPLUSTREE_STATS */
+
+#endif /* Stats_hpp */
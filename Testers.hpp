@@ -1,8 +1,16 @@
 #ifndef Testers_hpp
 #define Testers_hpp
 
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <map>
+#include <random>
+#include <sys/wait.h>
+#include <thread>
+
 void sequentialTestForInsertion() {
-    SeqBPlusTree tree = SeqBPlusTree();
+    SeqBPlusTree<int, int> tree = SeqBPlusTree<int, int>();
     // try to repeat the process from http://www.cburch.com/cs/340/reading/btree/
 
     /* Insertion */
@@ -44,7 +52,7 @@ void sequentialTestForInsertion() {
 void sequentialTestForDeletion() {
     /* Deletion */
     /* phase 1: initialization */
-    SeqBPlusTree tree = SeqBPlusTree();
+    SeqBPlusTree<int, int> tree = SeqBPlusTree<int, int>();
     tree.insert(1, 1);
     tree.insert(40, 40);
     tree.insert(60, 60);
@@ -250,4 +258,908 @@ void sequentialTestForDeletion() {
 */
 }
 
+// time n inserts of random keys into a tree of the given order
+template <int Order>
+void timeInsertion(int n) {
+    mt19937 gen(42);
+    vector<int> keys(n);
+    for (int i = 0; i < n; ++i) {
+        keys[i] = (int)gen();
+    }
+    SeqBPlusTree<int, int, Order> tree;
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    for (int i = 0; i < n; ++i) {
+        tree.insert(keys[i], i);
+    }
+    chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+    printf("order %4d: %d inserts in %.3f s (%.1f ns/insert)\n",
+           Order, n, elapsed.count(), elapsed.count() * 1e9 / n);
+}
+
+void sequentialTestForInsertionSpeed() {
+    const int n = 1000000;
+    timeInsertion<4>(n);
+    timeInsertion<16>(n);
+    timeInsertion<64>(n);
+    timeInsertion<256>(n);
+    timeInsertion<1024>(n);
+}
+
+// Delete latency with merge threshold min_pairs, see SeqBPlusTree::set_merge_threshold.
+// The tree starts with every leaf half full, so with the default threshold each
+// remove below merges two leaves and the insert of the same key splits the
+// merged one again. Then most keys are removed, and compact() packs what's left.
+template <int Order>
+void timeRelaxedDeletion(const char* name, int min_pairs) {
+    const int n = 1000000;
+    const int churn = 1000000;
+    mt19937 gen(42);
+    vector<pair<int, int> > pairs(n);
+    for (int i = 0; i < n; ++i) {
+        pairs[i] = make_pair(2 * i, i);
+    }
+    SeqBPlusTree<int, int, Order> tree(pairs.begin(), pairs.end(), 0.0);
+    tree.set_merge_threshold(min_pairs);
+
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    for (int i = 0; i < churn; ++i) {
+        int key = 2 * (int)(gen() % n);
+        tree.remove(key);
+        tree.insert(key, i);
+    }
+    chrono::duration<double> churn_time = chrono::steady_clock::now() - start;
+
+    shuffle(pairs.begin(), pairs.end(), gen);
+    vector<double> latency(n - n / 10);
+    for (size_t i = 0; i < latency.size(); ++i) {
+        chrono::steady_clock::time_point t = chrono::steady_clock::now();
+        tree.remove(pairs[i].first);
+        latency[i] = chrono::duration<double>(chrono::steady_clock::now() - t).count() * 1e9;
+    }
+    sort(latency.begin(), latency.end());
+    int nodes = tree.nodes();
+
+    start = chrono::steady_clock::now();
+    while (!tree.compact()) {}
+    chrono::duration<double> compact_time = chrono::steady_clock::now() - start;
+    printf("%s: %.1f ns per remove+insert, remove p50 %.0f ns p99.9 %.0f ns p99.99 %.0f ns, "
+           "%d nodes, compact %.1f ms to %d nodes\n", name, churn_time.count() * 1e9 / churn,
+           latency[latency.size() / 2], latency[latency.size() * 999 / 1000], latency[latency.size() * 9999 / 10000],
+           nodes, compact_time.count() * 1e3, tree.nodes());
+}
+
+void sequentialTestForRelaxedDeletion() {
+    timeRelaxedDeletion<16>("order 16, merge below 8 (default)", 8);
+    timeRelaxedDeletion<16>("order 16, merge when empty       ", 1);
+    timeRelaxedDeletion<64>("order 64, merge below 32 (default)", 32);
+    timeRelaxedDeletion<64>("order 64, merge when empty        ", 1);
+}
+
+// Random inserts and removes on a tree and a map, then walk the tree with
+// the iterators and compare every step with the map: forward from begin(),
+// backward from end(), lower_bound/upper_bound of every key, the keys between
+// them and the ones past either end, and ranges whose hi is past the last key
+// or not above lo.
+template <int Order>
+void checkIterators(const char* name, int min_pairs) {
+    const int range = 4000; // keys are the even numbers below 2 * range
+    const int rounds = 20;
+    mt19937 gen(42);
+    SeqBPlusTree<int, int, Order> tree;
+    tree.set_merge_threshold(min_pairs);
+    map<int, int> expected;
+    typedef typename SeqBPlusTree<int, int, Order>::iterator iterator;
+    int wrong = 0, checks = 0;
+    // whether it points to the pair of want, counting a mismatch if not
+    auto check = [&](iterator it, map<int, int>::iterator want) {
+        ++checks;
+        if (want == expected.end() ? it != tree.end()
+                                   : it == tree.end() || it.key() != want->first || it.value() != want->second) {
+            wrong++;
+        }
+    };
+
+    for (int round = 0; round < rounds; ++round) {
+        // grow in the first half, shrink in the second
+        int inserts = round < rounds / 2 ? 3 : 1;
+        for (int i = 0; i < range; ++i) {
+            int key = 2 * (int)(gen() % range);
+            if ((int)(gen() % 4) < inserts) {
+                tree.insert(key, i);
+                expected[key] = i;
+            } else {
+                tree.remove(key);
+                expected.erase(key);
+            }
+        }
+
+        iterator it = tree.begin();
+        for (map<int, int>::iterator want = expected.begin(); want != expected.end(); ++want, ++it) {
+            check(it, want);
+        }
+        check(it, expected.end());
+        it = tree.end();
+        for (map<int, int>::reverse_iterator want = expected.rbegin(); want != expected.rend(); ++want) {
+            check(--it, --want.base());
+        }
+        if (!expected.empty()) {
+            check(it, expected.begin());
+            check(--tree.end(), --expected.end());
+        }
+
+        for (int key = -1; key <= 2 * range + 1; ++key) {
+            check(tree.lower_bound(key), expected.lower_bound(key));
+            check(tree.upper_bound(key), expected.upper_bound(key));
+        }
+
+        for (int i = 0; i < 100; ++i) {
+            int lo = (int)(gen() % (2 * range + 2)) - 1;
+            // every tenth range ends past the last key, every tenth one is empty
+            int hi = i % 10 == 0 ? 2 * range + 1 + (int)(gen() % 10)
+                   : i % 10 == 1 ? lo - (int)(gen() % 3)
+                   : lo + (int)(gen() % 200);
+            typename SeqBPlusTree<int, int, Order>::range_type r = tree.range(lo, hi);
+            map<int, int>::iterator want = expected.lower_bound(lo);
+            map<int, int>::iterator last = lo < hi ? expected.lower_bound(hi) : want;
+            it = r.begin();
+            for (; want != last; ++want, ++it) {
+                check(it, want);
+            }
+            check(r.end(), last);
+            ++checks;
+            if (it != r.end()) wrong++;
+        }
+    }
+    printf("%s: %d pairs left, %d of %d checks wrong\n", name, (int)expected.size(), wrong, checks);
+}
+
+void sequentialTestForIterators() {
+    checkIterators<4>("order 4, merge below 2 (default)", 2);
+    checkIterators<4>("order 4, merge when empty       ", 1);
+    checkIterators<64>("order 64, merge below 32 (default)", 32);
+    checkIterators<64>("order 64, merge when empty        ", 1);
+}
+
+// Rounds of random inserts and removes on a tree and a map, growing the tree
+// first and shrinking it after, so that leaves split, borrow and merge. After
+// each round every key, present or not, is looked up, and the pairs are
+// compared in order. make_key turns 0..range-1 into keys in the same order.
+template <typename Tree, typename Key>
+void checkRandomUpdates(const char* name, Key (*make_key)(int), int min_pairs) {
+    const int range = 5000;
+    const int rounds = 10;
+    mt19937 gen(42);
+    Tree tree;
+    tree.set_merge_threshold(min_pairs);
+    map<Key, int> expected;
+    int wrong = 0, bad_returns = 0;
+
+    for (int round = 0; round < rounds; ++round) {
+        int inserts = round < rounds / 2 ? 3 : 1;
+        for (int i = 0; i < range; ++i) {
+            Key key = make_key((int)(gen() % range));
+            if ((int)(gen() % 4) < inserts) {
+                bool fresh = expected.count(key) == 0;
+                expected[key] = i;
+                if (tree.insert(key, i) != fresh) bad_returns++;
+            } else if (tree.remove(key) != (expected.erase(key) == 1)) {
+                bad_returns++;
+            }
+        }
+        for (int k = 0; k < range; ++k) {
+            Key key = make_key(k);
+            typename map<Key, int>::iterator want = expected.find(key);
+            typename Tree::iterator it = tree.find(key);
+            if (want == expected.end() ? it != tree.end() : it == tree.end() || it.value() != want->second) {
+                wrong++;
+            }
+        }
+        typename Tree::iterator it = tree.begin();
+        for (typename map<Key, int>::iterator want = expected.begin(); want != expected.end(); ++want, ++it) {
+            if (it == tree.end() || !(it.key() == want->first) || it.value() != want->second) wrong++;
+        }
+        if (it != tree.end()) wrong++;
+    }
+    printf("%s: %d pairs left, %d wrong, %d bad returns, %d nodes\n",
+           name, (int)expected.size(), wrong, bad_returns, tree.nodes());
+}
+
+// keys with a long common prefix, the seperators only keep what tells two leaves apart
+string prefixed_key(int k) {
+    char buf[64];
+    snprintf(buf, sizeof(buf), "tenant/0042/customer/%06d/orders", k);
+    return buf;
+}
+
+int plain_key(int k) {
+    return k;
+}
+
+void sequentialTestForRandomUpdates() {
+    // small and odd orders borrow and merge all the time, the seperators they
+    // move come from the fence keys on the path
+    checkRandomUpdates<SeqBPlusTree<int, int, 4>, int>("int keys, order 4              ", plain_key, 2);
+    checkRandomUpdates<SeqBPlusTree<int, int, 5>, int>("int keys, order 5              ", plain_key, 2);
+    checkRandomUpdates<SeqBPlusTree<int, int, 5, less<int>, SPLIT_LAYOUT>, int>(
+        "int keys, order 5, split layout", plain_key, 2);
+    checkRandomUpdates<SeqBPlusTree<int, int, 8>, int>("int keys, order 8, relaxed     ", plain_key, 1);
+    checkRandomUpdates<SeqBPlusTree<string, int, 4>, string>("string keys, order 4           ", prefixed_key, 2);
+    checkRandomUpdates<SeqBPlusTree<string, int, 16>, string>("string keys, order 16          ", prefixed_key, 8);
+}
+
+// orders strings and looks them up by a const char* without building a string
+struct TransparentStringLess {
+    typedef void is_transparent;
+    bool operator()(const string& a, const string& b) const { return a < b; }
+    bool operator()(const string& a, const char* b) const { return a.compare(b) < 0; }
+    bool operator()(const char* a, const string& b) const { return b.compare(a) > 0; }
+};
+
+// Random try_emplace, insert_or_assign and remove on a tree and a map, where
+// -1 is a value like any other. Then check the return values, find, contains,
+// search with a not_found no value uses, search_batch, and heterogeneous
+// find/contains/lower_bound by const char*.
+void sequentialTestForLookups() {
+    const int range = 20000;
+    mt19937 gen(42);
+    SeqBPlusTree<int, int, 8> tree;
+    map<int, int> expected;
+    int wrong = 0;
+    for (int i = 0; i < 4 * range; ++i) {
+        int k = (int)(gen() % range);
+        int v = (int)(gen() % 4) - 1;
+        int op = (int)(gen() % 3);
+        if (op == 0) {
+            pair<SeqBPlusTree<int, int, 8>::iterator, bool> r = tree.try_emplace(k, v);
+            pair<map<int, int>::iterator, bool> want = expected.insert(make_pair(k, v));
+            if (r.second != want.second || r.first.key() != k || r.first.value() != want.first->second) wrong++;
+        } else if (op == 1) {
+            pair<SeqBPlusTree<int, int, 8>::iterator, bool> r = tree.insert_or_assign(k, v);
+            bool fresh = expected.count(k) == 0;
+            expected[k] = v;
+            if (r.second != fresh || r.first.key() != k || r.first.value() != v) wrong++;
+        } else if (tree.remove(k) != (expected.erase(k) == 1)) {
+            wrong++;
+        }
+    }
+    vector<int> keys(range);
+    for (int k = 0; k < range; ++k) {
+        keys[k] = k;
+    }
+    vector<int> batch;
+    tree.search_batch(keys, batch, -2);
+    for (int k = 0; k < range; ++k) {
+        map<int, int>::iterator want = expected.find(k);
+        bool found = want != expected.end();
+        SeqBPlusTree<int, int, 8>::iterator it = tree.find(k);
+        if ((it != tree.end()) != found || tree.contains(k) != found) wrong++;
+        if (found && it != tree.end() && it.value() != want->second) wrong++;
+        int value = found ? want->second : -2;
+        if (tree.search(k, -2) != value || batch[k] != value) wrong++;
+    }
+
+    SeqBPlusTree<string, int, 8, TransparentStringLess> strings;
+    map<string, int> expected_strings;
+    for (int i = 0; i < range; ++i) {
+        string key = prefixed_key((int)(gen() % range));
+        strings.insert(key, i);
+        expected_strings[key] = i;
+    }
+    for (int k = 0; k < range; ++k) {
+        string key = prefixed_key(k);
+        map<string, int>::iterator want = expected_strings.find(key);
+        SeqBPlusTree<string, int, 8, TransparentStringLess>::iterator it = strings.find(key.c_str());
+        bool found = want != expected_strings.end();
+        if ((it != strings.end()) != found || strings.contains(key.c_str()) != found) wrong++;
+        if (found && it != strings.end() && it.value() != want->second) wrong++;
+        map<string, int>::iterator next = expected_strings.lower_bound(key);
+        it = strings.lower_bound(key.c_str());
+        if (next == expected_strings.end() ? it != strings.end() : it == strings.end() || it.key() != next->first) {
+            wrong++;
+        }
+    }
+    printf("%d int pairs, %d string pairs, %d wrong\n", (int)expected.size(), (int)expected_strings.size(), wrong);
+}
+
+// fill a concurrent tree from several threads, then time lookups as the
+// number of reader threads doubles
+template <typename Tree>
+void timeConcurrentSearch(const char* name) {
+    const int n = 1000000;
+    const int lookups = 2000000; // per thread
+    int max_threads = (int)thread::hardware_concurrency();
+    if (max_threads < 1) max_threads = 1;
+
+    printf("%s\n", name);
+    Tree tree;
+    vector<thread> writers;
+    for (int t = 0; t < max_threads; ++t) {
+        writers.push_back(thread([&tree, t, max_threads]() {
+            for (int k = t; k < n; k += max_threads) {
+                tree.insert(k, k);
+            }
+        }));
+    }
+    for (int t = 0; t < max_threads; ++t) {
+        writers[t].join();
+    }
+
+    for (int threads = 1; threads <= max_threads; threads *= 2) {
+        atomic<int> misses(0);
+        vector<thread> readers;
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        for (int t = 0; t < threads; ++t) {
+            readers.push_back(thread([&tree, &misses, t]() {
+                mt19937 gen(t);
+                for (int i = 0; i < lookups; ++i) {
+                    int k = gen() % n;
+                    if (tree.search(k) != k) misses++;
+                }
+            }));
+        }
+        for (int t = 0; t < threads; ++t) {
+            readers[t].join();
+        }
+        chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+        printf("%3d threads: %.2f M lookups/s, %d misses\n",
+               threads, threads * (double)lookups / elapsed.count() / 1e6, (int)misses);
+    }
+}
+
+void concurrentTestForSearchScaling() {
+    timeConcurrentSearch<ConBPlusTree<int, int, 64> >("optimistic lock coupling");
+    timeConcurrentSearch<BLinkBPlusTree<int, int, 64> >("B-link");
+}
+
+// random inserts and removes from several threads, each on its own keys, then
+// check that the tree holds exactly what every thread left behind
+template <typename Tree>
+void checkConcurrentUpdates(const char* name) {
+    const int range = 100000; // keys per thread
+    const int updates = 400000; // per thread
+    int threads = (int)thread::hardware_concurrency();
+    if (threads < 4) threads = 4; // interleave even on small machines
+
+    Tree tree;
+    vector<map<int, int> > expected(threads);
+    atomic<int> bad_returns(0);
+    vector<thread> writers;
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    for (int t = 0; t < threads; ++t) {
+        writers.push_back(thread([&tree, &expected, &bad_returns, t, threads]() {
+            mt19937 gen(t);
+            map<int, int>& mine = expected[t];
+            for (int i = 0; i < updates; ++i) {
+                // thread t owns the keys k with k % threads == t
+                int k = (int)(gen() % range) * threads + t;
+                if (gen() % 3 == 0) {
+                    if (tree.remove(k) != (mine.erase(k) == 1)) bad_returns++;
+                } else {
+                    // an existing key gets the new value
+                    bool fresh = mine.count(k) == 0;
+                    mine[k] = i;
+                    if (tree.insert(k, i) != fresh) bad_returns++;
+                }
+            }
+        }));
+    }
+    for (int t = 0; t < threads; ++t) {
+        writers[t].join();
+    }
+    chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+
+    int wrong = 0, missing = 0, stray = 0;
+    for (int k = 0; k < range * threads; ++k) {
+        const map<int, int>& mine = expected[k % threads];
+        map<int, int>::const_iterator it = mine.find(k);
+        int value = tree.search(k);
+        if (it == mine.end()) {
+            if (value != -1) stray++;
+        } else if (value == -1) {
+            missing++;
+        } else if (value != it->second) {
+            wrong++;
+        }
+    }
+    printf("%s: %d threads, %.2f M updates/s, %d wrong, %d missing, %d stray, %d bad returns\n",
+           name, threads, threads * (double)updates / elapsed.count() / 1e6,
+           wrong, missing, stray, (int)bad_returns);
+}
+
+void concurrentTestForMixedUpdates() {
+    // a small order splits and empties leaves all the time
+    checkConcurrentUpdates<ConBPlusTree<int, int, 8> >("optimistic lock coupling");
+    checkConcurrentUpdates<BLinkBPlusTree<int, int, 8> >("B-link");
+}
+
+// random inserts into a sharded tree as the number of writer threads doubles
+void shardedTestForInsertionScaling() {
+    const int n = 2000000;
+    int max_threads = (int)thread::hardware_concurrency();
+    if (max_threads < 1) max_threads = 1;
+
+    for (int threads = 1; threads <= max_threads; threads *= 2) {
+        ShardedBPlusTree<int, int> tree(HashPartitioner<int>(4 * max_threads));
+        vector<thread> writers;
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        for (int t = 0; t < threads; ++t) {
+            writers.push_back(thread([&tree, t, threads]() {
+                mt19937 gen(t);
+                for (int i = t; i < n; i += threads) {
+                    tree.insert((int)gen(), i);
+                }
+            }));
+        }
+        for (int t = 0; t < threads; ++t) {
+            writers[t].join();
+        }
+        chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+        printf("%3d threads: %.2f M inserts/s\n", threads, n / elapsed.count() / 1e6);
+    }
+}
+
+// Random inserts, batches of inserts and removes from several threads, each on
+// its own keys, then check every key and a few hundred ranges against what
+// the threads left behind.
+template <typename Partitioner>
+void checkShardedUpdates(const char* name, const Partitioner& partitioner) {
+    const int range = 50000; // keys per thread
+    const int updates = 100000; // per thread
+    const int threads = 4;
+
+    ShardedBPlusTree<int, int, Partitioner> tree(partitioner);
+    vector<map<int, int> > expected(threads);
+    atomic<int> bad_returns(0);
+    vector<thread> writers;
+    for (int t = 0; t < threads; ++t) {
+        writers.push_back(thread([&tree, &expected, &bad_returns, t]() {
+            mt19937 gen(t);
+            map<int, int>& mine = expected[t];
+            for (int i = 0; i < updates; ++i) {
+                // thread t owns the keys k with k % threads == t
+                int k = (int)(gen() % range) * threads + t;
+                int op = (int)(gen() % 8);
+                if (op < 3) {
+                    if (tree.remove(k) != (mine.erase(k) == 1)) bad_returns++;
+                } else if (op < 7) {
+                    bool fresh = mine.count(k) == 0;
+                    mine[k] = i;
+                    if (tree.insert(k, i) != fresh) bad_returns++;
+                } else {
+                    // a short run of this thread's keys, spread over the shards
+                    vector<pair<int, int> > batch;
+                    for (int j = 0; j < 8; ++j) {
+                        batch.push_back(make_pair(k + j * threads, i));
+                    }
+                    size_t fresh = 0;
+                    for (size_t j = 0; j < batch.size(); ++j) {
+                        fresh += mine.count(batch[j].first) == 0;
+                        mine[batch[j].first] = i;
+                    }
+                    if (tree.insert_batch(batch.begin(), batch.end()) != fresh) bad_returns++;
+                }
+            }
+        }));
+    }
+    for (int t = 0; t < threads; ++t) {
+        writers[t].join();
+    }
+
+    map<int, int> all;
+    for (int t = 0; t < threads; ++t) {
+        all.insert(expected[t].begin(), expected[t].end());
+    }
+    int wrong = 0;
+    for (int k = -1; k <= (range + 8) * threads; ++k) {
+        map<int, int>::iterator it = all.find(k);
+        if (tree.search(k, -1) != (it == all.end() ? -1 : it->second)) wrong++;
+    }
+    mt19937 gen(42);
+    int wrong_ranges = 0;
+    for (int i = 0; i < 300; ++i) {
+        int lo = (int)(gen() % (range * threads)) - 10;
+        int hi = i % 10 == 0 ? lo : lo + (int)(gen() % 2000);
+        vector<pair<int, int> > got = tree.range(lo, hi);
+        vector<pair<int, int> > want(all.lower_bound(lo), lo < hi ? all.lower_bound(hi) : all.lower_bound(lo));
+        if (got != want) wrong_ranges++;
+    }
+    printf("%s: %d pairs, %d wrong values, %d of 300 ranges wrong, %d bad returns\n",
+           name, (int)all.size(), wrong, wrong_ranges, (int)bad_returns);
+}
+
+void shardedTestForMixedUpdates() {
+    // the keys are below 200000, cut them into 8 ranges
+    vector<int> bounds;
+    for (int i = 1; i < 8; ++i) {
+        bounds.push_back(i * 25000);
+    }
+    checkShardedUpdates("hash partitions ", HashPartitioner<int>(8));
+    checkShardedUpdates("range partitions", RangePartitioner<int>(bounds));
+}
+
+// fill a disk-backed tree through a pool much smaller than the tree, then
+// reopen the file and check every key without loading anything up front
+void persistentTestForRestart() {
+    const int n = 1000000;
+    const char* path = "/tmp/bplustree_restart.db";
+    remove(path);
+    mt19937 gen(42);
+    vector<int> keys(n);
+    for (int i = 0; i < n; ++i) {
+        keys[i] = (int)gen();
+    }
+
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    {
+        DiskBPlusTree<int, int> tree(path, 256);
+        for (int i = 0; i < n; ++i) {
+            tree.insert(keys[i], i);
+        }
+        printf("%d inserts in %.3f s, %u pages, %zu misses, %zu write-backs\n",
+               n, chrono::duration<double>(chrono::steady_clock::now() - start).count(),
+               tree.pages(), tree.buffer_pool().miss_count(), tree.buffer_pool().write_back_count());
+    }
+
+    start = chrono::steady_clock::now();
+    DiskBPlusTree<int, int> tree(path, 256);
+    printf("reopened in %.3f ms\n",
+           chrono::duration<double>(chrono::steady_clock::now() - start).count() * 1e3);
+    // a key inserted twice keeps the later value
+    map<int, int> expected;
+    for (int i = 0; i < n; ++i) {
+        expected[keys[i]] = i;
+    }
+    int wrong = 0;
+    for (map<int, int>::iterator it = expected.begin(); it != expected.end(); ++it) {
+        if (tree.search(it->first) != it->second) wrong++;
+    }
+    printf("%d wrong values after reopening\n", wrong);
+    remove(path);
+}
+
+// Random inserts and removes on a disk-backed tree through a pool of a few
+// pages and on a map, so that splits and merges keep evicting pages. Then
+// check every key and some ranges, reopen the file and check again.
+void persistentTestForRandomUpdates() {
+    const int range = 50000;
+    const int updates = 300000;
+    const char* path = "/tmp/bplustree_updates.db";
+    remove(path);
+    mt19937 gen(42);
+    map<int, int> expected;
+    int bad_returns = 0;
+
+    // the wrong values and ranges of the tree
+    auto check = [&](DiskBPlusTree<int, int>& tree, const char* when) {
+        int wrong = 0, wrong_ranges = 0;
+        for (int k = -1; k <= range; ++k) {
+            map<int, int>::iterator it = expected.find(k);
+            if (tree.search(k, -1) != (it == expected.end() ? -1 : it->second)) wrong++;
+        }
+        for (int i = 0; i < 100; ++i) {
+            int lo = (int)(gen() % range) - 10;
+            int hi = i % 10 == 0 ? lo - 1 : lo + (int)(gen() % 2000);
+            vector<pair<int, int> > want(expected.lower_bound(lo),
+                                         lo < hi ? expected.lower_bound(hi) : expected.lower_bound(lo));
+            if (tree.range(lo, hi) != want) wrong_ranges++;
+        }
+        printf("%s: %d pairs, %d wrong values, %d of 100 ranges wrong\n",
+               when, (int)expected.size(), wrong, wrong_ranges);
+    };
+
+    {
+        DiskBPlusTree<int, int> tree(path, 16);
+        for (int i = 0; i < updates; ++i) {
+            int k = (int)(gen() % range);
+            // grow for the first half, shrink after
+            if ((int)(gen() % 4) < (i < updates / 2 ? 3 : 1)) {
+                bool fresh = expected.count(k) == 0;
+                expected[k] = i;
+                if (tree.insert(k, i) != fresh) bad_returns++;
+            } else if (tree.remove(k) != (expected.erase(k) == 1)) {
+                bad_returns++;
+            }
+        }
+        printf("%d bad returns, %zu misses\n", bad_returns, tree.buffer_pool().miss_count());
+        check(tree, "before closing");
+    }
+    DiskBPlusTree<int, int> tree(path, 16);
+    check(tree, "after reopening");
+    remove(path);
+}
+
+// snapshot a tree, then time mapping it and looking every key up in the mapping
+void snapshotTestForStartup() {
+    const int n = 1000000;
+    const char* path = "/tmp/bplustree_snapshot.snap";
+    mt19937 gen(42);
+    vector<pair<int, int> > pairs(n);
+    for (int i = 0; i < n; ++i) {
+        pairs[i] = make_pair((int)gen(), i);
+    }
+    SeqBPlusTree<int, int, 64> tree(pairs.begin(), pairs.end());
+
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    tree.serialize(path);
+    printf("serialized in %.3f s\n", chrono::duration<double>(chrono::steady_clock::now() - start).count());
+
+    start = chrono::steady_clock::now();
+    SnapshotReader<int, int> snapshot(path);
+    printf("mapped in %.3f ms\n", chrono::duration<double>(chrono::steady_clock::now() - start).count() * 1e3);
+
+    int wrong = 0;
+    start = chrono::steady_clock::now();
+    for (SeqBPlusTree<int, int, 64>::iterator it = tree.begin(); it != tree.end(); ++it) {
+        if (snapshot.search(it.key()) != it.value()) wrong++;
+    }
+    chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+    printf("%llu lookups in %.3f s, %d wrong values\n",
+           (unsigned long long)snapshot.size(), elapsed.count(), wrong);
+    remove(path);
+}
+
+// Write snapshots of different sizes with small fanouts, so that they have
+// several levels and partly filled last nodes, and compare every pair, the
+// lookups of the keys and their neighbours, lower_bound and ranges with a map.
+// Then damage the level table of a header and make sure the reader refuses it.
+template <SnapshotKeyEncoding Encoding>
+void checkSnapshot(const char* name) {
+    const char* path = "/tmp/bplustree_check.snap";
+    typedef SnapshotReader<int64_t, int64_t, less<int64_t>, 8, 4, Encoding> Reader;
+    const int sizes[] = {0, 1, 8, 9, 33, 1000, 100000};
+    mt19937 gen(42);
+    int wrong = 0, checks = 0;
+
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); ++s) {
+        // mostly small gaps, sometimes one too wide for a delta
+        map<int64_t, int64_t> expected;
+        int64_t key = -1000000;
+        for (int i = 0; i < sizes[s]; ++i) {
+            key += gen() % 20 == 0 ? (int64_t)1 << 33 : 1 + gen() % 100;
+            expected[key] = i;
+        }
+        write_snapshot<int64_t, int64_t, 8, 4, Encoding>(path, expected.begin(), expected.end(), expected.size());
+        Reader snapshot(path);
+
+        checks += 2;
+        if (snapshot.size() != expected.size()) wrong++;
+        typename Reader::iterator it = snapshot.begin();
+        for (map<int64_t, int64_t>::iterator want = expected.begin(); want != expected.end(); ++want, ++it) {
+            ++checks;
+            if (it == snapshot.end() || it.key() != want->first || it.value() != want->second) wrong++;
+        }
+        if (it != snapshot.end()) wrong++;
+
+        for (map<int64_t, int64_t>::iterator want = expected.begin(); want != expected.end(); ++want) {
+            for (int64_t k = want->first - 1; k <= want->first + 1; ++k) {
+                map<int64_t, int64_t>::iterator found = expected.find(k);
+                map<int64_t, int64_t>::iterator next = expected.lower_bound(k);
+                typename Reader::iterator lb = snapshot.lower_bound(k);
+                checks += 2;
+                if (snapshot.search(k, -1) != (found == expected.end() ? -1 : found->second)) wrong++;
+                if (next == expected.end() ? lb != snapshot.end() : lb == snapshot.end() || lb.key() != next->first) {
+                    wrong++;
+                }
+            }
+        }
+
+        for (int i = 0; i < 100 && !expected.empty(); ++i) {
+            int64_t lo = expected.begin()->first - 10 + (int64_t)(gen() % 100000);
+            int64_t hi = i % 10 == 0 ? lo : lo + (int64_t)(gen() % 5000);
+            map<int64_t, int64_t>::iterator want = expected.lower_bound(lo);
+            map<int64_t, int64_t>::iterator last = lo < hi ? expected.lower_bound(hi) : want;
+            typename Reader::range_type r = snapshot.range(lo, hi);
+            ++checks;
+            for (it = r.begin(); it != r.end() && want != last; ++it, ++want) {
+                if (it.key() != want->first || it.value() != want->second) break;
+            }
+            if (it != r.end() || want != last) wrong++;
+        }
+    }
+
+    // the last snapshot has eight levels, send its level table astray
+    const size_t fields[] = {offsetof(SnapshotHeader, level_offset), offsetof(SnapshotHeader, level_offset) + 8,
+                             offsetof(SnapshotHeader, level_nodes), offsetof(SnapshotHeader, level_nodes) + 8,
+                             offsetof(SnapshotHeader, levels), offsetof(SnapshotHeader, pair_count)};
+    const uint64_t bad_values[] = {(uint64_t)1 << 40, 72, 3};
+    int accepted = 0, corrupt = 0;
+    for (size_t f = 0; f < sizeof(fields) / sizeof(fields[0]); ++f) {
+        for (size_t v = 0; v < sizeof(bad_values) / sizeof(bad_values[0]); ++v) {
+            FILE* file = fopen(path, "r+b");
+            uint64_t old_value = 0;
+            size_t width = fields[f] == offsetof(SnapshotHeader, levels) ? 4 : 8;
+            fseek(file, (long)fields[f], SEEK_SET);
+            if (fread(&old_value, width, 1, file) != 1 || old_value == bad_values[v]) {
+                fclose(file);
+                continue;
+            }
+            fseek(file, (long)fields[f], SEEK_SET);
+            fwrite(&bad_values[v], width, 1, file);
+            fclose(file);
+            ++corrupt;
+            try {
+                Reader snapshot(path);
+                accepted++;
+            } catch (const runtime_error&) {
+            }
+            file = fopen(path, "r+b");
+            fseek(file, (long)fields[f], SEEK_SET);
+            fwrite(&old_value, width, 1, file);
+            fclose(file);
+        }
+    }
+    printf("%s: %d of %d checks wrong, %d of %d corrupt headers accepted\n", name, wrong, checks, accepted, corrupt);
+    remove(path);
+}
+
+void snapshotTestForRoundTrip() {
+    checkSnapshot<SNAPSHOT_PLAIN_KEYS>("plain keys");
+    checkSnapshot<SNAPSHOT_DELTA_KEYS>("delta keys");
+}
+
+// synced inserts into a durable tree from more and more writer threads, the
+// commits per fdatasync show how much the group commit shares
+void durableTestForGroupCommit() {
+    const int n = 20000;
+    const char* path = "/tmp/bplustree_durable.db";
+    for (int threads = 1; threads <= 64; threads *= 4) {
+        remove(path);
+        remove((string(path) + ".wal").c_str());
+        DurableBPlusTree<int, int> tree(path);
+        uint64_t syncs_before = tree.log().sync_count();
+        vector<thread> writers;
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        for (int t = 0; t < threads; ++t) {
+            writers.push_back(thread([&tree, t, threads]() {
+                mt19937 gen(t);
+                for (int i = t; i < n; i += threads) {
+                    tree.insert((int)gen(), i);
+                }
+            }));
+        }
+        for (int t = 0; t < threads; ++t) {
+            writers[t].join();
+        }
+        chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+        uint64_t syncs = tree.log().sync_count() - syncs_before;
+        printf("%3d threads: %.0f inserts/s, %.1f commits per sync\n",
+               threads, n / elapsed.count(), (double)n / (syncs > 0 ? syncs : 1));
+    }
+    remove(path);
+    remove((string(path) + ".wal").c_str());
+}
+
+// A child process applies random inserts and removes to a durable tree and
+// exits without closing it, as if it crashed: pages evicted since the last
+// checkpoint are in the file, the rest only in the log. Every operation was
+// committed, so the recovered tree has to hold all of them. The small pool and
+// log size make evictions and checkpoints happen during each round.
+void durableTestForCrashRecovery() {
+    const int range = 20000;
+    const int updates = 30000; // per round
+    const int rounds = 5;
+    const char* path = "/tmp/bplustree_crash.db";
+    remove(path);
+    remove((string(path) + ".wal").c_str());
+    WalOptions options;
+    options.sync_on_commit = false; // a process crash keeps what the OS has
+    options.checkpoint_bytes = 256 << 10;
+    map<int, int> expected;
+
+    for (int round = 0; round < rounds; ++round) {
+        // the child stops after a different # of updates each round
+        int done = updates - round * updates / (2 * rounds);
+        fflush(stdout);
+        pid_t child = fork();
+        if (child == 0) {
+            DurableBPlusTree<int, int> tree(path, options, 16);
+            mt19937 gen(round);
+            for (int i = 0; i < done; ++i) {
+                int k = (int)(gen() % range);
+                if (gen() % 3 == 0) {
+                    tree.remove(k);
+                } else {
+                    tree.insert(k, i);
+                }
+            }
+            _exit(0);
+        }
+        int status = 0;
+        if (child < 0 || waitpid(child, &status, 0) != child || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            printf("round %d: the child didn't finish\n", round);
+            break;
+        }
+        mt19937 gen(round);
+        for (int i = 0; i < done; ++i) {
+            int k = (int)(gen() % range);
+            if (gen() % 3 == 0) {
+                expected.erase(k);
+            } else {
+                expected[k] = i;
+            }
+        }
+
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        DurableBPlusTree<int, int> tree(path, options, 16);
+        double recovery_ms = chrono::duration<double>(chrono::steady_clock::now() - start).count() * 1e3;
+        int wrong = 0;
+        for (int k = 0; k < range; ++k) {
+            map<int, int>::iterator it = expected.find(k);
+            if (tree.search(k, -1) != (it == expected.end() ? -1 : it->second)) wrong++;
+        }
+        vector<pair<int, int> > all(expected.begin(), expected.end());
+        printf("round %d: %d updates, recovered in %.1f ms, %d pairs, %d wrong values, range %s\n",
+               round, done, recovery_ms, (int)expected.size(), wrong,
+               tree.range(0, range) == all ? "matches" : "differs");
+    }
+    remove(path);
+    remove((string(path) + ".wal").c_str());
+}
+
+// the same keys (time stamps with small random gaps) in a plain and in a
+// delta encoded snapshot: file size and lookup time
+template <SnapshotKeyEncoding Encoding>
+void timeSnapshotEncoding(const char* name, const vector<pair<int64_t, int64_t> >& pairs) {
+    const char* path = "/tmp/bplustree_encoding.snap";
+    write_snapshot<int64_t, int64_t, SNAPSHOT_LEAF_FANOUT, SNAPSHOT_INTERNAL_FANOUT, Encoding>(
+        path, pairs.begin(), pairs.end(), pairs.size());
+    SnapshotReader<int64_t, int64_t, less<int64_t>, SNAPSHOT_LEAF_FANOUT, SNAPSHOT_INTERNAL_FANOUT, Encoding> snapshot(path);
+    FILE* f = fopen(path, "rb");
+    fseek(f, 0, SEEK_END);
+    long bytes = ftell(f);
+    fclose(f);
+
+    int wrong = 0;
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    for (size_t i = 0; i < pairs.size(); ++i) {
+        if (snapshot.search(pairs[i].first) != pairs[i].second) wrong++;
+    }
+    chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+    printf("%s: %.1f MB (%.2f bytes/pair), %.1f ns/lookup, %d wrong values\n", name, bytes / 1e6,
+           (double)bytes / pairs.size(), elapsed.count() * 1e9 / pairs.size(), wrong);
+    remove(path);
+}
+
+void snapshotTestForKeyEncoding() {
+    const int n = 4000000;
+    mt19937 gen(42);
+    vector<pair<int64_t, int64_t> > pairs(n);
+    int64_t key = 1700000000000LL;
+    for (int i = 0; i < n; ++i) {
+        key += 1 + gen() % 1000;
+        pairs[i] = make_pair(key, (int64_t)i);
+    }
+    timeSnapshotEncoding<SNAPSHOT_PLAIN_KEYS>("plain keys", pairs);
+    timeSnapshotEncoding<SNAPSHOT_DELTA_KEYS>("delta keys", pairs);
+}
+
+// the event counters need BPLUSTREE_STATS, e.g. g++ -DBPLUSTREE_STATS main.cpp
+void statsTestForChurn() {
+    SeqBPlusTree<int64_t, int64_t, 16> tree;
+    mt19937_64 gen(42);
+    for (int i = 0; i < 1000000; ++i) {
+        tree.insert(gen() % 4000000, i);
+    }
+    printf("after 1M random inserts:\n");
+    tree.stats().print();
+
+    tree.reset_stats();
+    for (int i = 0; i < 1000000; ++i) {
+        if (i % 2) {
+            tree.insert(gen() % 4000000, i);
+        } else {
+            tree.remove(gen() % 4000000);
+        }
+        tree.contains(gen() % 4000000);
+    }
+    printf("\nafter 1M inserts and removes with lookups:\n");
+    tree.stats().print();
+}
+
+void benchmarkTestForWorkloads() {
+    // the default sizes; add 10000000 and 100000000 given the memory, see Benchmark.hpp
+    BenchmarkOptions options;
+    run_benchmarks(options);
+}
+
 #endif /* Testers_hpp */
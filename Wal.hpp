@@ -0,0 +1,295 @@
+#ifndef Wal_hpp
+#define Wal_hpp
+
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <exception>
+#include <fcntl.h>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+using namespace std;
+
+// how a log treats the commits, see WriteAheadLog
+struct WalOptions {
+    // a commit waits until its record is on the device, otherwise only until
+    // it's handed to the OS, which survives a crash of the process but not of
+    // the machine
+    bool sync_on_commit;
+    // a thread that is about to sync waits this long for more commits to join
+    // it, 0 syncs right away (commits arriving during a sync still share the next one)
+    unsigned group_commit_us;
+    // ... but stops waiting once this many bytes are pending
+    size_t group_commit_bytes;
+    // a tree using the log checkpoints once the log grows past this, 0 never
+    size_t checkpoint_bytes;
+
+    WalOptions() : sync_on_commit(true), group_commit_us(0), group_commit_bytes(1 << 20),
+                   checkpoint_bytes(64 << 20) {}
+};
+
+// CRC-32 (IEEE), to tell a torn record at the end of the log from a whole one
+struct WalCrcTable {
+    uint32_t entries[256];
+
+    WalCrcTable() {
+        for (uint32_t i = 0; i < 256; ++i) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; ++k) {
+                c = c & 1 ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+            }
+            entries[i] = c;
+        }
+    }
+};
+
+inline uint32_t wal_crc32(const char* data, size_t len, uint32_t crc = 0) {
+    static const WalCrcTable table;
+    crc = ~crc;
+    for (size_t i = 0; i < len; ++i) {
+        crc = table.entries[(crc ^ (uint8_t)data[i]) & 0xFF] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+/*
+ * Append-only write-ahead log with group commit.
+ *
+ * A record is a type byte and a payload, framed by its length and a CRC. The
+ * log sequence number (LSN) of a record is the log position right after it;
+ * LSNs keep growing across reset(), which starts the file over.
+ * append() only copies the record into a buffer. commit(lsn) returns once
+ * every record up to lsn is written (and synced, see WalOptions). The first
+ * committing thread that finds no sync running becomes the leader: it takes
+ * the whole buffer, writes it with one write and one fdatasync, and wakes
+ * every thread whose record went with it. Threads arriving meanwhile wait and
+ * share the next sync, so under load one fdatasync covers many commits.
+ * I/O errors throw runtime_error. The first one sticks: records that got an
+ * LSN may be lost with it, so every later call throws it again, including
+ * the commits waiting for those records.
+ */
+class WriteAheadLog {
+private:
+    struct RecordHeader {
+        uint32_t crc;    // of the type and the payload
+        uint32_t length; // of the payload
+        uint8_t type;
+    };
+    static const size_t RECORD_HEADER_SIZE = 9;
+
+    int fd;
+    string path;
+    WalOptions options;
+
+    mutex lock;
+    condition_variable done;    // a leader finished, or the buffer filled up
+    vector<char> buffer;        // records appended but not written yet
+    vector<char> spare;         // swapped with buffer by the leader, keeps its capacity
+    uint64_t base_lsn;          // the LSN of the start of the file
+    uint64_t next_lsn;          // the LSN the next record ends before
+    uint64_t written_lsn;       // handed to the OS up to here
+    uint64_t synced_lsn;        // on the device up to here
+    bool syncing;               // a leader is writing
+    // counters, e.g. to tune the group commit
+    uint64_t commits, syncs;
+    exception_ptr error;        // the first error writing the log, see check()
+
+    void fail(const char* what) {
+        throw runtime_error(string(what) + " " + path + ": " + strerror(errno));
+    }
+    // throw the error that made the log unusable, if any; call with lock held
+    void check() {
+        if (error) rethrow_exception(error);
+    }
+
+    void write_fully(const char* data, size_t len, uint64_t offset) {
+        size_t done_bytes = 0;
+        while (done_bytes < len) {
+            ssize_t n = ::pwrite(fd, data + done_bytes, len - done_bytes, (off_t)(offset + done_bytes));
+            if (n < 0 && errno == EINTR) continue;
+            if (n < 0) fail("cannot write");
+            done_bytes += n;
+        }
+    }
+
+public:
+    WriteAheadLog(const string& path, const WalOptions& options = WalOptions())
+        : fd(-1), path(path), options(options), base_lsn(0), next_lsn(0),
+          written_lsn(0), synced_lsn(0), syncing(false), commits(0), syncs(0) {
+        fd = ::open(path.c_str(), O_RDWR | O_CREAT, 0644);
+        if (fd < 0) fail("cannot open");
+    }
+    ~WriteAheadLog() {
+        if (fd >= 0) ::close(fd);
+    }
+    WriteAheadLog(const WriteAheadLog&) = delete;
+    WriteAheadLog& operator=(const WriteAheadLog&) = delete;
+
+    // Call visit(type, payload, length) for every record in the file, in order,
+    // and return the # of records. Reading stops at the first torn or corrupt
+    // record, which is where a crash cut the log off.
+    // Has to come before the first append: whatever follows the last whole
+    // record is cut off, and appending continues there.
+    template <typename Visitor>
+    size_t replay(Visitor visit) {
+        off_t end = ::lseek(fd, 0, SEEK_END);
+        if (end < 0) fail("cannot seek");
+        vector<char> data(end);
+        size_t got = 0;
+        while (got < data.size()) {
+            ssize_t n = ::pread(fd, data.data() + got, data.size() - got, (off_t)got);
+            if (n < 0 && errno == EINTR) continue;
+            if (n < 0) fail("cannot read");
+            if (n == 0) break;
+            got += n;
+        }
+        size_t pos = 0, records = 0;
+        while (pos + RECORD_HEADER_SIZE <= got) {
+            RecordHeader h;
+            memcpy(&h.crc, &data[pos], 4);
+            memcpy(&h.length, &data[pos + 4], 4);
+            if (pos + RECORD_HEADER_SIZE + h.length > got) break;
+            if (wal_crc32(&data[pos + 8], 1 + h.length) != h.crc) break;
+            h.type = (uint8_t)data[pos + 8];
+            visit(h.type, &data[pos + RECORD_HEADER_SIZE], (size_t)h.length);
+            pos += RECORD_HEADER_SIZE + h.length;
+            ++records;
+        }
+        if (pos < (size_t)end && ::ftruncate(fd, (off_t)pos) != 0) fail("cannot truncate");
+        lock_guard<mutex> guard(lock);
+        check();
+        next_lsn = written_lsn = synced_lsn = base_lsn + pos;
+        return records;
+    }
+
+    // Append a record whose payload is part a followed by part b, return its LSN.
+    // It's durable once commit() or sync() of that LSN returns.
+    uint64_t append(uint8_t type, const void* a, size_t a_len, const void* b = NULL, size_t b_len = 0) {
+        char header[RECORD_HEADER_SIZE];
+        uint32_t length = (uint32_t)(a_len + b_len);
+        header[8] = (char)type;
+        uint32_t crc = wal_crc32(&header[8], 1);
+        crc = wal_crc32((const char*)a, a_len, crc);
+        if (b_len > 0) crc = wal_crc32((const char*)b, b_len, crc);
+        memcpy(&header[0], &crc, 4);
+        memcpy(&header[4], &length, 4);
+
+        lock_guard<mutex> guard(lock);
+        check();
+        buffer.insert(buffer.end(), header, header + RECORD_HEADER_SIZE);
+        buffer.insert(buffer.end(), (const char*)a, (const char*)a + a_len);
+        if (b_len > 0) buffer.insert(buffer.end(), (const char*)b, (const char*)b + b_len);
+        next_lsn += RECORD_HEADER_SIZE + length;
+        if (buffer.size() >= options.group_commit_bytes) done.notify_all();
+        return next_lsn;
+    }
+
+    // wait until the records up to lsn are durable as WalOptions asks
+    void commit(uint64_t lsn) {
+        wait(lsn, options.sync_on_commit, true);
+    }
+    // wait until the records up to lsn are on the device, whatever the options
+    void sync(uint64_t lsn) {
+        wait(lsn, true, false);
+    }
+    // the LSN of the last record appended
+    uint64_t last_lsn() {
+        lock_guard<mutex> guard(lock);
+        return next_lsn;
+    }
+
+    // Start the file over with a single record, and wait until it's on the
+    // device. Every record appended so far has to be synced already, and no
+    // thread may append meanwhile.
+    void reset(uint8_t type, const void* payload, size_t len) {
+        {
+            unique_lock<mutex> guard(lock);
+            while (syncing) done.wait(guard);
+            check();
+            if (!buffer.empty() || synced_lsn != next_lsn) {
+                throw logic_error("WriteAheadLog: reset with records not synced");
+            }
+            try {
+                if (::ftruncate(fd, 0) != 0) fail("cannot truncate");
+            } catch (...) {
+                // the file may have lost synced records too
+                error = current_exception();
+                throw;
+            }
+            base_lsn = next_lsn;
+        }
+        sync(append(type, payload, len));
+    }
+
+    // bytes in the file, including the records not written yet
+    uint64_t size() {
+        lock_guard<mutex> guard(lock);
+        return next_lsn - base_lsn;
+    }
+    uint64_t commit_count() {
+        lock_guard<mutex> guard(lock);
+        return commits;
+    }
+    uint64_t sync_count() {
+        lock_guard<mutex> guard(lock);
+        return syncs;
+    }
+
+private:
+    void wait(uint64_t lsn, bool need_sync, bool is_commit) {
+        unique_lock<mutex> guard(lock);
+        if (is_commit) ++commits;
+        while (true) {
+            if (synced_lsn >= lsn || (!need_sync && written_lsn >= lsn)) return;
+            // records up to lsn went with a write that failed, or come after it
+            check();
+            if (syncing) {
+                done.wait(guard);
+                continue;
+            }
+            // become the leader, let more commits join unless the buffer is full enough
+            syncing = true;
+            if (options.group_commit_us > 0 && buffer.size() < options.group_commit_bytes) {
+                done.wait_for(guard, chrono::microseconds(options.group_commit_us), [this]() {
+                    return buffer.size() >= options.group_commit_bytes;
+                });
+            }
+            spare.swap(buffer);
+            uint64_t offset = written_lsn - base_lsn;
+            uint64_t end = next_lsn;
+            bool do_sync = need_sync || options.sync_on_commit;
+            guard.unlock();
+            try {
+                write_fully(spare.data(), spare.size(), offset);
+                if (do_sync && ::fdatasync(fd) != 0) fail("cannot sync");
+            } catch (...) {
+                spare.clear();
+                guard.lock();
+                // wake the commits of these records to throw as well, a later
+                // leader would otherwise write past them as if they were there
+                error = current_exception();
+                syncing = false;
+                done.notify_all();
+                throw;
+            }
+            spare.clear();
+            guard.lock();
+            written_lsn = end;
+            if (do_sync) {
+                synced_lsn = end;
+                ++syncs;
+            }
+            syncing = false;
+            done.notify_all();
+        }
+    }
+};
+
+#endif /* Wal_hpp */
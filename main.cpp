@@ -1,9 +1,69 @@
+#include <cstdio>
+#include <cstring>
+
 #include "Sequential.hpp"
+#include "Concurrent.hpp"
+#include "BLink.hpp"
+#include "Sharded.hpp"
+#include "Persistent.hpp"
+#include "Durable.hpp"
+#include "Benchmark.hpp"
 #include "Testers.hpp"
 
 using namespace std;
 
-int main() {
-    // sequentialTestForInsertion();
-    sequentialTestForDeletion();
+struct Tester {
+    const char* name;
+    void (*run)();
+    bool checks; // compares the trees with std::map, otherwise it times them
+};
+
+// every tester, so that every tree gets compiled
+const Tester testers[] = {
+    {"sequentialTestForInsertion", sequentialTestForInsertion, false},
+    {"sequentialTestForDeletion", sequentialTestForDeletion, false},
+    {"sequentialTestForInsertionSpeed", sequentialTestForInsertionSpeed, false},
+    {"sequentialTestForRelaxedDeletion", sequentialTestForRelaxedDeletion, false},
+    {"sequentialTestForIterators", sequentialTestForIterators, true},
+    {"sequentialTestForRandomUpdates", sequentialTestForRandomUpdates, true},
+    {"sequentialTestForLookups", sequentialTestForLookups, true},
+    {"concurrentTestForSearchScaling", concurrentTestForSearchScaling, false},
+    {"concurrentTestForMixedUpdates", concurrentTestForMixedUpdates, true},
+    {"shardedTestForInsertionScaling", shardedTestForInsertionScaling, false},
+    {"shardedTestForMixedUpdates", shardedTestForMixedUpdates, true},
+    {"persistentTestForRestart", persistentTestForRestart, true},
+    {"persistentTestForRandomUpdates", persistentTestForRandomUpdates, true},
+    {"snapshotTestForStartup", snapshotTestForStartup, false},
+    {"snapshotTestForRoundTrip", snapshotTestForRoundTrip, true},
+    {"snapshotTestForKeyEncoding", snapshotTestForKeyEncoding, false},
+    {"durableTestForGroupCommit", durableTestForGroupCommit, false},
+    {"durableTestForCrashRecovery", durableTestForCrashRecovery, true},
+    {"statsTestForChurn", statsTestForChurn, false},
+    {"benchmarkTestForWorkloads", benchmarkTestForWorkloads, false},
+};
+
+// Run the testers named on the command line, or every checking one for
+// "checks", e.g.  ./main checks  or  ./main concurrentTestForSearchScaling
+// Without arguments only sequentialTestForDeletion runs.
+int main(int argc, char** argv) {
+    if (argc < 2) {
+        sequentialTestForDeletion();
+        return 0;
+    }
+    for (int i = 1; i < argc; ++i) {
+        bool all_checks = strcmp(argv[i], "checks") == 0;
+        bool found = false;
+        for (size_t t = 0; t < sizeof(testers) / sizeof(testers[0]); ++t) {
+            if (all_checks ? testers[t].checks : strcmp(argv[i], testers[t].name) == 0) {
+                printf("== %s\n", testers[t].name);
+                testers[t].run();
+                found = true;
+            }
+        }
+        if (!found) {
+            fprintf(stderr, "no tester %s\n", argv[i]);
+            return 1;
+        }
+    }
+    return 0;
 }